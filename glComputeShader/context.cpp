@@ -1,4 +1,10 @@
 #include "context.h"
+#include "timer.h"
+
+#ifndef USE_EGL
+
+/* glad.h cannot be included here since it must not follow GL.h */
+extern "C" int gladLoadGL(void);
 
 LRESULT CALLBACK WindowProcedure(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
 HWND createWindow(HINSTANCE hInstance, WNDCLASSEX& wcex, HWND& WND, HDC& DC, HGLRC& RC, int major, int minor);
@@ -30,6 +36,8 @@ void printWindowsError()
 /// <returns></returns>
 int startContext(contextInfo* ci, int major, int minor)
 {
+	uint64_t startTime = tic();
+
 	ci->DC = NULL;
 	ci->RC = NULL;
 	ci->hWnd = NULL;
@@ -43,6 +51,9 @@ int startContext(contextInfo* ci, int major, int minor)
 	SetWindowText(ci->hWnd, (LPCSTR)glGetString(GL_VERSION));
 	//ShowWindow(ci->hWnd, 1);
 
+	ci->createTime = toc(startTime);
+	printf("startContext(): WGL context created in %f ms\n", ci->createTime);
+
 	return 1;
 }
 
@@ -61,6 +72,15 @@ void stopContext(contextInfo* ci)
     UnregisterClassA(ci->wcex.lpszClassName,ci->wcex.hInstance);
 }
 
+/// <summary>
+/// Load OpenGL entry points for the current context
+/// </summary>
+/// <returns></returns>
+int loadGLFunctions()
+{
+	return gladLoadGL();
+}
+
 
 /// <summary>
 /// Internal function to create a window
@@ -263,3 +283,4 @@ LRESULT CALLBACK WindowProcedure(HWND hWnd, UINT message, WPARAM wParam, LPARAM
 	return 0;
 }
 
+#endif // !USE_EGL
@@ -3,10 +3,21 @@
 
 #include <stdio.h>
 
+// Windows builds use a hidden WGL window, everything else (or any build that
+// defines USE_EGL) creates a headless EGL context with no window system
+#if !defined(_WIN32) && !defined(USE_EGL)
+#define USE_EGL
+#endif
+
+#ifdef USE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#else
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
 #include <windows.h>
 #include <GL\GL.h>
 #include "gl\wglext.h"
+#endif
 
 #ifdef MATLAB_MEX_FILE
 #include "mex.h"
@@ -16,17 +27,30 @@
 // https://gist.github.com/Eleobert/d4bbf044db7cb5a587666cff5a6f1174
 
 struct contextInfo {
+#ifdef USE_EGL
+	EGLDisplay display;
+	EGLContext context;
+	EGLSurface surface;		/* EGL_NO_SURFACE when surfaceless contexts are supported */
+#else
 	HDC DC;
 	HGLRC RC;
 	HWND hWnd;
     WNDCLASSEX wcex;
+#endif
+	double createTime;		/* time spent in startContext, in ms */
 };
 
+#ifdef USE_EGL
+#define LOAD_GL_FUNC(x, p) p x; x =  reinterpret_cast<p>(eglGetProcAddress(#x)); \
+					if (x == nullptr) { printf("Error Loading OpenGL function %s", #x); return 0;}
+#else
 #define LOAD_GL_FUNC(x, p) p x; x =  reinterpret_cast<p>(wglGetProcAddress(#x)); \
 					if (x == nullptr) { printf("Error Loading OpenGL function %s", #x); return 0;}
+#endif
 
 int startContext(contextInfo* ci, int major, int minor);
 void stopContext(contextInfo* ci);
+int loadGLFunctions();
 void pollEvents();
 
 
@@ -0,0 +1,160 @@
+#include "context.h"
+#include "timer.h"
+
+#ifdef USE_EGL
+
+#include <string.h>
+#include "gl/glad.h"
+
+// Headless backend for machines with no window system (Linux batch nodes).
+// Prefers Mesa's surfaceless platform, which works with llvmpipe and needs no
+// X server or DRM device, and falls back to the default display with a 1x1
+// pbuffer when surfaceless contexts are not available.
+
+static EGLDisplay getHeadlessDisplay()
+{
+	const char* clientExts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+
+	if (clientExts && strstr(clientExts, "EGL_MESA_platform_surfaceless")) {
+		PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT =
+			reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+		if (eglGetPlatformDisplayEXT != nullptr) {
+			EGLDisplay display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+			if (display != EGL_NO_DISPLAY)
+				return display;
+		}
+	}
+
+	return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+/// <summary>
+/// Create OpenGL context
+/// </summary>
+/// <param name="ci"></param>
+/// <param name="major"></param>
+/// <param name="minor"></param>
+/// <returns></returns>
+int startContext(contextInfo* ci, int major, int minor)
+{
+	uint64_t startTime = tic();
+
+	ci->display = EGL_NO_DISPLAY;
+	ci->context = EGL_NO_CONTEXT;
+	ci->surface = EGL_NO_SURFACE;
+
+	ci->display = getHeadlessDisplay();
+	if (ci->display == EGL_NO_DISPLAY) {
+		printf("startContext(): Could not get EGL display\n");
+		return 0;
+	}
+
+	EGLint eglMajor, eglMinor;
+	if (!eglInitialize(ci->display, &eglMajor, &eglMinor)) {
+		printf("startContext(): Could not initialize EGL: 0x%x\n", eglGetError());
+		ci->display = EGL_NO_DISPLAY;
+		return 0;
+	}
+
+	const char* displayExts = eglQueryString(ci->display, EGL_EXTENSIONS);
+	bool surfaceless = displayExts && strstr(displayExts, "EGL_KHR_surfaceless_context");
+
+	const EGLint configAttribs[] = {
+		EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+
+	EGLConfig config;
+	EGLint numConfigs;
+	if (!eglChooseConfig(ci->display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0) {
+		printf("startContext(): Could not choose EGL config: 0x%x\n", eglGetError());
+		stopContext(ci);
+		return 0;
+	}
+
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		printf("startContext(): Could not bind OpenGL API: 0x%x\n", eglGetError());
+		stopContext(ci);
+		return 0;
+	}
+
+	const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, major,
+		EGL_CONTEXT_MINOR_VERSION, minor,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+
+	ci->context = eglCreateContext(ci->display, config, EGL_NO_CONTEXT, contextAttribs);
+	if (ci->context == EGL_NO_CONTEXT) {
+		printf("startContext(): Could not create OpenGL %d.%d core context: 0x%x\n", major, minor, eglGetError());
+		stopContext(ci);
+		return 0;
+	}
+
+	if (!surfaceless) {
+		const EGLint pbufferAttribs[] = {
+			EGL_WIDTH, 1,
+			EGL_HEIGHT, 1,
+			EGL_NONE
+		};
+		ci->surface = eglCreatePbufferSurface(ci->display, config, pbufferAttribs);
+		if (ci->surface == EGL_NO_SURFACE) {
+			printf("startContext(): Could not create pbuffer surface: 0x%x\n", eglGetError());
+			stopContext(ci);
+			return 0;
+		}
+	}
+
+	if (!eglMakeCurrent(ci->display, ci->surface, ci->surface, ci->context)) {
+		printf("startContext(): Could not make OpenGL context current: 0x%x\n", eglGetError());
+		stopContext(ci);
+		return 0;
+	}
+
+	ci->createTime = toc(startTime);
+	printf("startContext(): EGL %d.%d %s context created in %f ms\n", eglMajor, eglMinor,
+		surfaceless ? "surfaceless" : "pbuffer", ci->createTime);
+
+	return 1;
+}
+
+/// <summary>
+/// Destroy OpenGL context
+/// </summary>
+/// <param name="ci"></param>
+void stopContext(contextInfo* ci)
+{
+	if (ci->display == EGL_NO_DISPLAY)
+		return;
+
+	eglMakeCurrent(ci->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (ci->surface != EGL_NO_SURFACE)
+		eglDestroySurface(ci->display, ci->surface);
+	if (ci->context != EGL_NO_CONTEXT)
+		eglDestroyContext(ci->display, ci->context);
+	eglTerminate(ci->display);
+
+	ci->display = EGL_NO_DISPLAY;
+	ci->context = EGL_NO_CONTEXT;
+	ci->surface = EGL_NO_SURFACE;
+}
+
+/// <summary>
+/// Load OpenGL entry points for the current context
+/// </summary>
+/// <returns></returns>
+int loadGLFunctions()
+{
+	return gladLoadGLLoader((GLADloadproc)eglGetProcAddress);
+}
+
+/// <summary>
+/// No window system, nothing to dispatch
+/// </summary>
+void pollEvents()
+{
+}
+
+#endif // USE_EGL
@@ -0,0 +1,251 @@
+#include "demDecode.h"
+#include "lodepng.h"
+#include "threadpool.h"
+#include "timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#define DEMDECODE_SSE2
+#include <emmintrin.h>
+#endif
+
+/* Rows per band of the decode pipeline */
+const unsigned int decodeBandRows = 32;
+
+void decodeElevationRow(const uint8_t* px, unsigned int bytesPerPixel, unsigned int n, demEncoding encoding, float* out)
+{
+	const float scale = encoding == DEM_MAPBOX ? 0.1f : 1.0f / 256.0f;
+	const float offset = encoding == DEM_MAPBOX ? -10000.0f : -32768.0f;
+	unsigned int i = 0;
+
+#ifdef DEMDECODE_SSE2
+	/* Little-endian words r | g<<8 | b<<16, swapped to r<<16 | g<<8 | b */
+	const __m128i byteMask = _mm_set1_epi32(0xff), greenMask = _mm_set1_epi32(0xff00);
+	const __m128 vscale = _mm_set1_ps(scale), voffset = _mm_set1_ps(offset);
+	for (; i + 4 <= n; i += 4) {
+		__m128i w;
+		if (bytesPerPixel == 4) {
+			w = _mm_loadu_si128((const __m128i*)&px[(size_t)i * 4]);
+		}
+		else {
+			/* The last word of a row may not be readable past its 3 bytes */
+			const uint8_t* p = &px[(size_t)i * 3];
+			uint32_t w0, w1, w2, w3 = (uint32_t)p[9] | (uint32_t)p[10] << 8 | (uint32_t)p[11] << 16;
+			memcpy(&w0, p, 4);
+			memcpy(&w1, p + 3, 4);
+			memcpy(&w2, p + 6, 4);
+			w = _mm_set_epi32((int)w3, (int)w2, (int)w1, (int)w0);
+		}
+		__m128i v = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(w, byteMask), 16), _mm_and_si128(w, greenMask)),
+			_mm_and_si128(_mm_srli_epi32(w, 16), byteMask));
+		/* (r*65536 + g*256 + b) fits in 24 bits, so it converts exactly */
+		_mm_storeu_ps(&out[i], _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), vscale), voffset));
+	}
+#endif
+
+	for (; i < n; i++) {
+		const uint8_t* p = &px[(size_t)i * bytesPerPixel];
+		float v = (float)((uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | (uint32_t)p[2]);
+		out[i] = v * scale + offset;
+	}
+}
+
+/*
+* Paeth filter, the bytes of a pixel are independent chains the
+* compiler interleaves once the pixel size is known.
+*/
+template <unsigned int bpp>
+static void unfilterPaeth(uint8_t* row, const uint8_t* prev, size_t length)
+{
+	/* With a = c = 0 the predictor is b */
+	for (size_t k = 0; k < bpp; k++)
+		row[k] = (uint8_t)(row[k] + prev[k]);
+	for (size_t i = bpp; i < length; i += bpp) {
+		for (unsigned int k = 0; k < bpp; k++) {
+			int a = row[i + k - bpp], b = prev[i + k], c = prev[i + k - bpp];
+			int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+			int pred = pb <= pc ? b : c;
+			pred = pa <= pb && pa <= pc ? a : pred;
+			row[i + k] = (uint8_t)(row[i + k] + pred);
+		}
+	}
+}
+
+/*
+* Reverses the PNG filter of one scanline in place, prev is the
+* unfiltered scanline above, zeros for the first one.
+*/
+static int unfilterScanline(uint8_t filter, uint8_t* row, const uint8_t* prev, size_t length, unsigned int bpp)
+{
+	switch (filter) {
+	case 0:
+		break;
+	case 1:
+		for (size_t i = bpp; i < length; i++)
+			row[i] = (uint8_t)(row[i] + row[i - bpp]);
+		break;
+	case 2:
+		for (size_t i = 0; i < length; i++)
+			row[i] = (uint8_t)(row[i] + prev[i]);
+		break;
+	case 3:
+		for (size_t i = 0; i < bpp; i++)
+			row[i] = (uint8_t)(row[i] + (prev[i] >> 1));
+		for (size_t i = bpp; i < length; i++)
+			row[i] = (uint8_t)(row[i] + (((unsigned int)row[i - bpp] + prev[i]) >> 1));
+		break;
+	case 4:
+		if (bpp == 3)
+			unfilterPaeth<3>(row, prev, length);
+		else
+			unfilterPaeth<4>(row, prev, length);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+ElevationPNG::ElevationPNG()
+	: width(0), height(0), inflateTime(0), decodeTime(0), bytesPerPixel(0)
+{
+}
+
+/*
+* Reads a PNG and checks that decode() can handle it.
+*/
+int ElevationPNG::open(const char* path)
+{
+	close();
+
+	if (lodepng::load_file(file, path) || file.empty()) {
+		printf("ElevationPNG::open(): cannot read %s\n", path);
+		return 0;
+	}
+
+	LodePNGState state;
+	lodepng_state_init(&state);
+	unsigned int w, h;
+	unsigned error = lodepng_inspect(&w, &h, &state, file.data(), file.size());
+	const LodePNGColorMode& color = state.info_png.color;
+	bool supported = !error && color.bitdepth == 8 && state.info_png.interlace_method == 0 &&
+		(color.colortype == LCT_RGB || color.colortype == LCT_RGBA);
+	unsigned int bpp = color.colortype == LCT_RGBA ? 4 : 3;
+	lodepng_state_cleanup(&state);
+
+	if (error) {
+		printf("ElevationPNG::open(): %s: %s\n", path, lodepng_error_text(error));
+		close();
+		return 0;
+	}
+	if (!supported) {
+		printf("ElevationPNG::open(): %s is not an 8-bit RGB or RGBA non-interlaced PNG\n", path);
+		close();
+		return 0;
+	}
+
+	width = w;
+	height = h;
+	bytesPerPixel = bpp;
+	return 1;
+}
+
+void ElevationPNG::close()
+{
+	file.clear();
+	file.shrink_to_fit();
+	width = height = 0;
+	bytesPerPixel = 0;
+}
+
+/*
+* Decodes the elevations to out, row y at out + y*stride (stride in
+* floats, at least width), with numThreads threads (0 for all cores).
+*/
+int ElevationPNG::decode(float* out, size_t stride, demEncoding encoding, unsigned int numThreads)
+{
+	if (file.empty() || stride < width) {
+		printf("ElevationPNG::decode(): no PNG open or stride below the width\n");
+		return 0;
+	}
+
+	/* The image data is the concatenation of the IDAT chunks */
+	uint64_t startTime = tic();
+	std::vector<unsigned char> compressed;
+	const unsigned char* end = file.data() + file.size();
+	for (const unsigned char* chunk = file.data() + 8; chunk + 12 <= end; chunk = lodepng_chunk_next_const(chunk)) {
+		size_t length = lodepng_chunk_length(chunk);
+		if (chunk + 12 + length > end)
+			break;
+		if (lodepng_chunk_type_equals(chunk, "IDAT"))
+			compressed.insert(compressed.end(), chunk + 8, chunk + 8 + length);
+		if (lodepng_chunk_type_equals(chunk, "IEND"))
+			break;
+	}
+
+	unsigned char* filtered = NULL;
+	size_t filteredSize = 0;
+	unsigned error = lodepng_zlib_decompress(&filtered, &filteredSize, compressed.data(), compressed.size(), &lodepng_default_decompress_settings);
+	const size_t rowBytes = (size_t)width * bytesPerPixel;
+	if (error || filteredSize < (size_t)height * (rowBytes + 1)) {
+		printf("ElevationPNG::decode(): corrupt image data\n");
+		free(filtered);
+		return 0;
+	}
+	inflateTime = toc(startTime);
+
+	/*
+	* Band b waits until band b-1 is unfiltered, the bottom row of which
+	* its first row may refer to, then unfilters its rows, lets band b+1
+	* go and converts them while they are in cache. Workers take bands
+	* in increasing order, so the lowest unfinished band always runs.
+	*/
+	startTime = tic();
+	const unsigned int numBands = (height + decodeBandRows - 1) / decodeBandRows;
+	std::mutex lock;
+	std::condition_variable bandDone;
+	unsigned int bandsUnfiltered = 0;
+	bool failed = false;
+	const std::vector<uint8_t> zeros(rowBytes, 0);
+
+	ThreadPool pool(std::min(numThreads == 0 ? std::thread::hardware_concurrency() : numThreads, numBands));
+	pool.run(numBands, [&](size_t band, unsigned int worker) {
+		unsigned int y0 = (unsigned int)band * decodeBandRows, y1 = std::min(y0 + decodeBandRows, height);
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			bandDone.wait(guard, [&]() { return bandsUnfiltered >= band; });
+		}
+
+		bool ok = true;
+		for (unsigned int y = y0; y < y1; y++) {
+			uint8_t* row = filtered + (size_t)y * (rowBytes + 1);
+			const uint8_t* prev = y > 0 ? row - rowBytes : zeros.data();
+			ok = ok && unfilterScanline(row[0], row + 1, prev, rowBytes, bytesPerPixel);
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			bandsUnfiltered = (unsigned int)band + 1;
+			failed = failed || !ok;
+		}
+		bandDone.notify_all();
+
+		for (unsigned int y = y0; ok && y < y1; y++)
+			decodeElevationRow(filtered + (size_t)y * (rowBytes + 1) + 1, bytesPerPixel, width, encoding, out + (size_t)y * stride);
+	});
+
+	free(filtered);
+	decodeTime = toc(startTime);
+	if (failed) {
+		printf("ElevationPNG::decode(): unknown scanline filter\n");
+		return 0;
+	}
+	return 1;
+}
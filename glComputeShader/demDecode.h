@@ -0,0 +1,50 @@
+#ifndef DEMDECODE_H
+#define DEMDECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+/*
+* RGB elevation encodings of web map tiles.
+*/
+enum demEncoding {
+	DEM_TERRARIUM = 0,			/* (r*256 + g + b/256) - 32768 */
+	DEM_MAPBOX					/* -10000 + (r*65536 + g*256 + b) * 0.1, Terrain-RGB */
+};
+
+/*
+* Converts n pixels of 3 (RGB) or 4 (RGBA) bytes to elevations in
+* meters, four at a time with SSE2 where available.
+*/
+void decodeElevationRow(const uint8_t* px, unsigned int bytesPerPixel, unsigned int n, demEncoding encoding, float* out);
+
+/*
+* Elevation PNG decoded straight to floats. open() reads the file
+* and its header, decode() inflates the image data and unfilters the
+* scanlines in place, in bands of rows. Every band is converted to
+* elevations by the thread that unfiltered it while the next band is
+* unfiltered on another thread, the rows go straight to the caller's
+* buffer, no RGBA image is ever made. 8-bit RGB and RGBA
+* non-interlaced PNGs only, which is what elevation tiles are.
+*/
+class ElevationPNG {
+public:
+	ElevationPNG();
+
+	int open(const char* path);
+	int decode(float* out, size_t stride, demEncoding encoding, unsigned int numThreads = 0);
+	void close();
+
+	unsigned int width;			/* in pixels */
+	unsigned int height;		/* in pixels */
+	double inflateTime;			/* last decode(), in ms */
+	double decodeTime;			/* last decode(), unfiltering and conversion, in ms */
+
+private:
+	std::vector<unsigned char> file;
+	unsigned int bytesPerPixel;
+};
+
+#endif // !DEMDECODE_H
@@ -0,0 +1,233 @@
+#include "demFile.h"
+#include "viewshedGL.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+/*
+* File header, samples start at dataOffset.
+*/
+struct demFileHeader {
+	char magic[4];				/* "VSDM" */
+	uint32_t version;
+	uint32_t width, height;
+	uint32_t sampleType;		/* demSampleType */
+	uint32_t dataOffset;		/* multiple of 4 KB, past the header */
+	double imgBounds[4];
+	float elevationRange[2];
+	float quantizationError;
+	uint32_t reserved;
+};
+
+const uint32_t demFileVersion = 1;
+const size_t demDataOffset = 4096;
+
+/* Meters per DEM_UINT16 step, the same as GLViewshedEngine uses for R16UI */
+static float uint16Scale(const float range[2])
+{
+	return std::max(range[1] - range[0], 1.0f) / 65535.0f;
+}
+
+DemFile::DemFile()
+	: width(0), height(0), sampleType(DEM_FLOAT32), quantizationError(0), dataOffset(0)
+{
+	memset(imgBounds, 0, sizeof(imgBounds));
+	elevationRange[0] = elevationRange[1] = 0;
+}
+
+DemFile::~DemFile()
+{
+	close();
+}
+
+/*
+* Writes a row-major float DEM (in meters), DEM_UINT16 quantized
+* over the range of its heights.
+*/
+int DemFile::create(const char* path, const float* elev, unsigned int width, unsigned int height, const double imgBounds[4], demSampleType type)
+{
+	if (width < 2 || height < 2 || !hostLittleEndian()) {
+		printf("DemFile::create(): DEM must be at least 2x2 and the host little endian\n");
+		return 0;
+	}
+
+	const size_t n = (size_t)width * height;
+	demFileHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "VSDM", 4);
+	hdr.version = demFileVersion;
+	hdr.width = width;
+	hdr.height = height;
+	hdr.sampleType = (uint32_t)type;
+	hdr.dataOffset = (uint32_t)demDataOffset;
+	for (int i = 0; i < 4; i++)
+		hdr.imgBounds[i] = imgBounds[i];
+
+	std::vector<uint16_t> quantized;
+	if (type == DEM_UINT16) {
+		hdr.elevationRange[0] = *std::min_element(elev, elev + n);
+		hdr.elevationRange[1] = *std::max_element(elev, elev + n);
+		const float scale = uint16Scale(hdr.elevationRange), offset = hdr.elevationRange[0];
+		quantized.resize(n);
+		for (size_t i = 0; i < n; i++) {
+			float v = (elev[i] - offset) / scale;
+			quantized[i] = (uint16_t)std::min(std::max(floorf(v + 0.5f), 0.0f), 65535.0f);
+			hdr.quantizationError = std::max(hdr.quantizationError, fabsf((float)quantized[i] * scale + offset - elev[i]));
+		}
+	}
+
+	FILE* f = fopen(path, "wb");
+	if (f == NULL) {
+		printf("DemFile::create(): cannot create %s\n", path);
+		return 0;
+	}
+
+	std::vector<uint8_t> pad(demDataOffset, 0);
+	memcpy(pad.data(), &hdr, sizeof(hdr));
+	int status = fwrite(pad.data(), 1, pad.size(), f) == pad.size();
+	if (type == DEM_UINT16)
+		status = status && fwrite(quantized.data(), sizeof(uint16_t), n, f) == n;
+	else
+		status = status && fwrite(elev, sizeof(float), n, f) == n;
+
+	if (fclose(f) != 0 || !status) {
+		printf("DemFile::create(): write to %s failed\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+* Converts a Terrarium or Mapbox elevation PNG to a DEM file.
+*/
+int DemFile::createFromPNG(const char* pngPath, const char* path, demEncoding encoding, const double imgBounds[4], demSampleType type)
+{
+	ElevationPNG png;
+	if (!png.open(pngPath))
+		return 0;
+
+	std::vector<float> elev((size_t)png.width * png.height);
+	if (!png.decode(elev.data(), png.width, encoding))
+		return 0;
+	return create(path, elev.data(), png.width, png.height, imgBounds, type);
+}
+
+/*
+* Maps a DEM file and checks its header.
+*/
+int DemFile::open(const char* path)
+{
+	close();
+
+	if (!hostLittleEndian()) {
+		printf("DemFile::open(): DEM files need a little endian host\n");
+		return 0;
+	}
+
+	if (!mapping.open(path))
+		return 0;
+
+	demFileHeader hdr;
+	if (mapping.size >= sizeof(hdr))
+		memcpy(&hdr, mapping.data, sizeof(hdr));
+	if (mapping.size < sizeof(hdr) || memcmp(hdr.magic, "VSDM", 4) != 0 || hdr.version != demFileVersion ||
+		hdr.sampleType > DEM_UINT16 || hdr.dataOffset < sizeof(hdr) || hdr.dataOffset % 4096 != 0 || hdr.width < 2 || hdr.height < 2) {
+		printf("DemFile::open(): %s is not a DEM file\n", path);
+		close();
+		return 0;
+	}
+
+	width = hdr.width;
+	height = hdr.height;
+	sampleType = (demSampleType)hdr.sampleType;
+	dataOffset = hdr.dataOffset;
+	for (int i = 0; i < 4; i++)
+		imgBounds[i] = hdr.imgBounds[i];
+	elevationRange[0] = hdr.elevationRange[0];
+	elevationRange[1] = hdr.elevationRange[1];
+	quantizationError = hdr.quantizationError;
+
+	size_t sampleBytes = sampleType == DEM_UINT16 ? 2 : 4;
+	if (mapping.size < dataOffset + (size_t)width * height * sampleBytes) {
+		printf("DemFile::open(): %s is truncated\n", path);
+		close();
+		return 0;
+	}
+	return 1;
+}
+
+void DemFile::close()
+{
+	mapping.close();
+	width = height = 0;
+	dataOffset = 0;
+}
+
+/*
+* Heights in meters of rows y0 to y0+rows-1, width floats per row.
+*/
+int DemFile::readRows(unsigned int y0, unsigned int rows, float* out) const
+{
+	if (mapping.data == NULL || (size_t)y0 + rows > height) {
+		printf("DemFile::readRows(): rows outside of the DEM\n");
+		return 0;
+	}
+
+	const size_t first = (size_t)y0 * width, n = (size_t)rows * width;
+	if (sampleType == DEM_FLOAT32) {
+		memcpy(out, (const float*)samples() + first, n * sizeof(float));
+		return 1;
+	}
+
+	const uint16_t* src = (const uint16_t*)samples() + first;
+	const float scale = uint16Scale(elevationRange), offset = elevationRange[0];
+	for (size_t i = 0; i < n; i++)
+		out[i] = (float)src[i] * scale + offset;
+	return 1;
+}
+
+/*
+* Loads the DEM into an engine. A GL engine with the elevation texture
+* in the format of the samples uploads the mapping as it is, float
+* samples go to any engine without a copy on this side, 16-bit
+* samples are converted a band of rows at a time otherwise.
+*/
+int DemFile::load(ViewshedEngine* engine) const
+{
+	if (mapping.data == NULL) {
+		printf("DemFile::load(): no DEM file open\n");
+		return 0;
+	}
+
+	GLViewshedEngine* gl = dynamic_cast<GLViewshedEngine*>(engine);
+	visElevationFormat format = sampleType == DEM_UINT16 ? VIS_ELEVATION_R16UI : VIS_ELEVATION_R32F;
+	if (gl != NULL && gl->options.elevation == format) {
+		if (sampleType == DEM_UINT16) {
+			gl->elevationRange[0] = elevationRange[0];
+			gl->elevationRange[1] = elevationRange[1];
+		}
+		if (!gl->setElevationSamples(samples(), width, height, format))
+			return 0;
+		gl->quantizationError = quantizationError;
+		return 1;
+	}
+
+	if (sampleType == DEM_FLOAT32)
+		return engine->setElevation((const float*)samples(), width, height);
+
+	if (!engine->setElevation(NULL, width, height))
+		return 0;
+	const unsigned int bandRows = 64;
+	std::vector<float> band((size_t)bandRows * width);
+	for (unsigned int y0 = 0; y0 < height; y0 += bandRows) {
+		unsigned int rows = std::min(bandRows, height - y0);
+		if (!readRows(y0, rows, band.data()) || !engine->setElevationRect(band.data(), 0, y0, width, rows, width))
+			return 0;
+	}
+	return 1;
+}
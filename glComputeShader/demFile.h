@@ -0,0 +1,54 @@
+#ifndef DEMFILE_H
+#define DEMFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mappedFile.h"
+#include "viewshed.h"
+#include "demDecode.h"
+
+/*
+* Sample types of a DEM file.
+*/
+enum demSampleType {
+	DEM_FLOAT32 = 0,			/* meters */
+	DEM_UINT16					/* 65535 steps over elevationRange, like VIS_ELEVATION_R16UI */
+};
+
+/*
+* Binary DEM file: a header with the size, bounds and sample type,
+* then the samples at the next 4 KB boundary, row-major and little
+* endian. Opening maps the file, nothing is parsed or copied, and
+* load() hands the mapped samples to the engine as they are: a GL
+* engine whose elevation texture has the same format uploads them
+* straight from the mapping through a pixel unpack buffer.
+*/
+class DemFile {
+public:
+	DemFile();
+	~DemFile();
+
+	static int create(const char* path, const float* elev, unsigned int width, unsigned int height, const double imgBounds[4], demSampleType type);
+	static int createFromPNG(const char* pngPath, const char* path, demEncoding encoding, const double imgBounds[4], demSampleType type);
+
+	int open(const char* path);
+	void close();
+
+	const void* samples() const { return mapping.data ? mapping.data + dataOffset : NULL; }
+	int readRows(unsigned int y0, unsigned int rows, float* out) const;
+	int load(ViewshedEngine* engine) const;
+
+	unsigned int width;			/* DEM width in pixels */
+	unsigned int height;		/* DEM height in pixels */
+	demSampleType sampleType;
+	double imgBounds[4];		/* in radians, lat lon lat lon like viewshedParams */
+	float elevationRange[2];	/* meters of DEM_UINT16 steps 0 and 65535 */
+	float quantizationError;	/* largest error of the DEM_UINT16 samples, in meters */
+
+private:
+	MappedFile mapping;
+	size_t dataOffset;
+};
+
+#endif // !DEMFILE_H
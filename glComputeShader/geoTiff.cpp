@@ -0,0 +1,848 @@
+#include "geoTiff.h"
+#include "lodepng.h"
+#include "threadpool.h"
+#include "timer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* TIFF and GeoTIFF tags */
+enum tiffTag {
+	TAG_IMAGE_WIDTH = 256,
+	TAG_IMAGE_LENGTH = 257,
+	TAG_BITS_PER_SAMPLE = 258,
+	TAG_COMPRESSION = 259,
+	TAG_PHOTOMETRIC = 262,
+	TAG_STRIP_OFFSETS = 273,
+	TAG_SAMPLES_PER_PIXEL = 277,
+	TAG_ROWS_PER_STRIP = 278,
+	TAG_STRIP_BYTE_COUNTS = 279,
+	TAG_PLANAR_CONFIG = 284,
+	TAG_PREDICTOR = 317,
+	TAG_TILE_WIDTH = 322,
+	TAG_TILE_LENGTH = 323,
+	TAG_TILE_OFFSETS = 324,
+	TAG_TILE_BYTE_COUNTS = 325,
+	TAG_SAMPLE_FORMAT = 339,
+	TAG_MODEL_PIXEL_SCALE = 33550,
+	TAG_MODEL_TIEPOINT = 33922,
+	TAG_MODEL_TRANSFORMATION = 34264,
+	TAG_GEO_KEY_DIRECTORY = 34735
+};
+
+/* GeoKeys */
+const unsigned int geoKeyModelType = 1024;		/* 2 geographic lat/lon */
+const unsigned int geoKeyRasterType = 1025;		/* 1 pixel is area, 2 pixel is point */
+
+/*
+* One IFD entry, values points into the mapping.
+*/
+struct tiffEntry {
+	unsigned int type;
+	uint64_t count;
+	const uint8_t* values;
+};
+
+static uint64_t readUint(const uint8_t* p, unsigned int bytes, bool bigEndian)
+{
+	uint64_t v = 0;
+	for (unsigned int i = 0; i < bytes; i++)
+		v |= (uint64_t)p[bigEndian ? bytes - 1 - i : i] << (8 * i);
+	return v;
+}
+
+static unsigned int typeSize(unsigned int type)
+{
+	switch (type) {
+	case 1: case 2: case 6: case 7: return 1;		/* BYTE ASCII SBYTE UNDEFINED */
+	case 3: case 8: return 2;						/* SHORT SSHORT */
+	case 4: case 9: case 11: case 13: return 4;		/* LONG SLONG FLOAT IFD */
+	case 5: case 10: case 12: case 16: case 17: case 18: return 8;	/* RATIONAL SRATIONAL DOUBLE LONG8 SLONG8 IFD8 */
+	default: return 0;
+	}
+}
+
+/* Value k of an entry of any numeric type */
+static double entryValue(const tiffEntry& e, uint64_t k, bool bigEndian)
+{
+	const uint8_t* p = e.values + k * typeSize(e.type);
+	switch (e.type) {
+	case 6: return (double)(int8_t)p[0];
+	case 8: return (double)(int16_t)readUint(p, 2, bigEndian);
+	case 9: return (double)(int32_t)readUint(p, 4, bigEndian);
+	case 17: return (double)(int64_t)readUint(p, 8, bigEndian);
+	case 5: return (double)readUint(p, 4, bigEndian) / std::max((double)readUint(p + 4, 4, bigEndian), 1.0);
+	case 10: return (double)(int32_t)readUint(p, 4, bigEndian) / std::max((double)(int32_t)readUint(p + 4, 4, bigEndian), 1.0);
+	case 11: {
+		uint32_t bits = (uint32_t)readUint(p, 4, bigEndian);
+		float f;
+		memcpy(&f, &bits, 4);
+		return (double)f;
+	}
+	case 12: {
+		uint64_t bits = readUint(p, 8, bigEndian);
+		double d;
+		memcpy(&d, &bits, 8);
+		return d;
+	}
+	default: return (double)readUint(p, typeSize(e.type), bigEndian);
+	}
+}
+
+/* Value k of an unsigned integer entry, SHORT, LONG or LONG8, exact to 64 bits */
+static uint64_t entryUint(const tiffEntry& e, uint64_t k, bool bigEndian)
+{
+	return readUint(e.values + k * typeSize(e.type), typeSize(e.type), bigEndian);
+}
+
+static bool isUnsignedType(unsigned int type)
+{
+	return type == 3 || type == 4 || type == 16;
+}
+
+/*
+* TIFF LZW: MSB first codes of 9 to 12 bits, 256 clears the table,
+* 257 ends the data, the code width grows one code early. Returns the
+* number of bytes written to out.
+*/
+static size_t lzwDecode(const uint8_t* in, size_t inSize, uint8_t* out, size_t outSize)
+{
+	static const unsigned int clearCode = 256, endCode = 257;
+	std::vector<uint16_t> prefix(4096), length(4096);
+	std::vector<uint8_t> suffix(4096), first(4096);
+	for (unsigned int i = 0; i < 256; i++) {
+		suffix[i] = first[i] = (uint8_t)i;
+		length[i] = 1;
+	}
+
+	size_t o = 0;
+	const uint64_t inBits = (uint64_t)inSize * 8;
+	uint64_t pos = 0;
+	unsigned int width = 9, next = 258;
+	int prev = -1;
+	while (pos + width <= inBits) {
+		size_t b = (size_t)(pos >> 3);
+		uint32_t v = (uint32_t)in[b] << 16 | (b + 1 < inSize ? (uint32_t)in[b + 1] << 8 : 0) | (b + 2 < inSize ? (uint32_t)in[b + 2] : 0);
+		unsigned int code = (v >> (24 - (pos & 7) - width)) & ((1u << width) - 1);
+		pos += width;
+
+		if (code == endCode)
+			break;
+		if (code == clearCode) {
+			width = 9;
+			next = 258;
+			prev = -1;
+			continue;
+		}
+
+		if (prev >= 0) {
+			if (code > next || next >= 4096)
+				break;
+			/* A code not in the table yet is the previous string plus its own first byte */
+			prefix[next] = (uint16_t)prev;
+			suffix[next] = code < next ? first[code] : first[prev];
+			first[next] = first[prev];
+			length[next] = (uint16_t)(length[prev] + 1);
+			next++;
+		}
+		else if (code >= 256) {
+			break;
+		}
+
+		/* The string of a code is written back to front along its prefixes */
+		size_t len = length[code];
+		for (size_t k = len, c = code; k > 0; k--, c = prefix[c]) {
+			if (o + k - 1 < outSize)
+				out[o + k - 1] = suffix[c];
+		}
+		o = std::min(o + len, outSize);
+		prev = (int)code;
+
+		if (next + 1 >= (1u << width) && width < 12)
+			width++;
+	}
+	return o;
+}
+
+/*
+* TIFF LZW the way lzwDecode() reads it: a clear code first, codes
+* growing a bit once the next free code reaches the width, a clear
+* code again before the table fills up.
+*/
+static void lzwEncode(const uint8_t* in, size_t inSize, std::vector<uint8_t>& out)
+{
+	static const unsigned int clearCode = 256, endCode = 257;
+	std::vector<uint16_t> child((size_t)4096 * 256, 0);
+	unsigned int width = 9, next = 258;
+	uint32_t bits = 0;
+	unsigned int numBits = 0;
+	auto put = [&](unsigned int code) {
+		bits = bits << width | code;
+		numBits += width;
+		while (numBits >= 8) {
+			numBits -= 8;
+			out.push_back((uint8_t)(bits >> numBits));
+		}
+	};
+
+	out.clear();
+	put(clearCode);
+	if (inSize == 0) {
+		put(endCode);
+		if (numBits > 0)
+			out.push_back((uint8_t)(bits << (8 - numBits)));
+		return;
+	}
+
+	/* child[code*256 + byte] is the code of string code plus byte, 0 when there is none */
+	unsigned int code = in[0];
+	for (size_t i = 1; i < inSize; i++) {
+		uint16_t& c = child[(size_t)code * 256 + in[i]];
+		if (c != 0) {
+			code = c;
+			continue;
+		}
+		put(code);
+		if (next < 4094) {
+			c = (uint16_t)next++;
+			if (next >= (1u << width) && width < 12)
+				width++;
+		}
+		else {
+			put(clearCode);
+			std::fill(child.begin(), child.end(), 0);
+			width = 9;
+			next = 258;
+		}
+		code = in[i];
+	}
+	put(code);
+	put(endCode);
+	if (numBits > 0)
+		out.push_back((uint8_t)(bits << (8 - numBits)));
+}
+
+/* Converts n samples of the file type, in host byte order, to floats */
+static void samplesToFloat(const uint8_t* src, size_t n, unsigned int format, unsigned int bytes, float* out)
+{
+	for (size_t i = 0; i < n; i++, src += bytes) {
+		if (format == 3 && bytes == 4) {
+			memcpy(&out[i], src, 4);
+		}
+		else if (format == 3) {
+			double d;
+			memcpy(&d, src, 8);
+			out[i] = (float)d;
+		}
+		else if (bytes == 2) {
+			uint16_t u;
+			memcpy(&u, src, 2);
+			out[i] = format == 2 ? (float)(int16_t)u : (float)u;
+		}
+		else {
+			uint32_t u;
+			memcpy(&u, src, 4);
+			out[i] = format == 2 ? (float)(int32_t)u : (float)u;
+		}
+	}
+}
+
+/* Adds each sample of a row to the next, samples of the given size in host byte order */
+template <typename T>
+static void undoHorizontalPredictor(uint8_t* row, unsigned int n)
+{
+	T prev;
+	memcpy(&prev, row, sizeof(T));
+	for (unsigned int i = 1; i < n; i++) {
+		T v;
+		memcpy(&v, row + (size_t)i * sizeof(T), sizeof(T));
+		prev = (T)(prev + v);
+		memcpy(row + (size_t)i * sizeof(T), &prev, sizeof(T));
+	}
+}
+
+/* Replaces each sample of a row but the first by its difference to the one before, the inverse of undoHorizontalPredictor() */
+template <typename T>
+static void applyHorizontalPredictor(uint8_t* row, unsigned int n)
+{
+	for (unsigned int i = n - 1; i > 0; i--) {
+		T v, prev;
+		memcpy(&v, row + (size_t)i * sizeof(T), sizeof(T));
+		memcpy(&prev, row + (size_t)(i - 1) * sizeof(T), sizeof(T));
+		v = (T)(v - prev);
+		memcpy(row + (size_t)i * sizeof(T), &v, sizeof(T));
+	}
+}
+
+static void writeUint(uint8_t* p, uint64_t v, unsigned int bytes, bool bigEndian)
+{
+	for (unsigned int i = 0; i < bytes; i++)
+		p[bigEndian ? bytes - 1 - i : i] = (uint8_t)(v >> (8 * i));
+}
+
+/* Appends count host order values of the given size, each byte reversed when the file order is not the host's */
+static void appendValues(std::vector<uint8_t>& dst, const void* src, size_t count, unsigned int size, bool swap)
+{
+	const uint8_t* p = (const uint8_t*)src;
+	for (size_t i = 0; i < count; i++, p += size) {
+		size_t at = dst.size();
+		dst.insert(dst.end(), p, p + size);
+		if (swap)
+			std::reverse(dst.begin() + at, dst.end());
+	}
+}
+
+GeoTiff::GeoTiff()
+	: width(0), height(0), blockWidth(0), blockHeight(0), blocksX(0), blocksY(0), tiled(false), georeferenced(false),
+	blocksRead(0), decodeTime(0),
+	swapBytes(false), bytesPerSample(0), sampleFormat(0), compression(0), predictor(0), pool(nullptr)
+{
+	memset(imgBounds, 0, sizeof(imgBounds));
+}
+
+GeoTiff::~GeoTiff()
+{
+	close();
+	delete pool;
+}
+
+/*
+* Writes a tiled, deflate compressed float32 GeoTIFF in host byte
+* order, georeferenced in lat/lon by a tie point and pixel scale.
+* tileSize must be a multiple of 16, edge tiles are padded with zeros.
+*/
+int GeoTiff::create(const char* path, const float* elev, unsigned int width, unsigned int height, unsigned int tileSize, const double imgBounds[4])
+{
+	geoTiffLayout layout;
+	layout.tileSize = tileSize;
+	layout.rowsPerStrip = 0;
+	layout.sampleFormat = 3;
+	layout.compression = 8;
+	layout.predictor = 1;
+	layout.bigEndian = !hostLittleEndian();
+	return create(path, elev, width, height, layout, imgBounds);
+}
+
+/*
+* Writes a classic GeoTIFF in any layout open() reads, georeferenced
+* like the tiled one. int16 samples are the heights rounded to meters,
+* the last strip holds the rows that are left.
+*/
+int GeoTiff::create(const char* path, const float* elev, unsigned int width, unsigned int height, const geoTiffLayout& layout, const double imgBounds[4])
+{
+	const bool tiled = layout.tileSize != 0;
+	if (width < 2 || height < 2 || (tiled ? layout.tileSize % 16 != 0 : layout.rowsPerStrip == 0)) {
+		printf("GeoTiff::create(): DEM must be at least 2x2, tiles a multiple of 16 and strips not empty\n");
+		return 0;
+	}
+	if ((layout.sampleFormat != 2 && layout.sampleFormat != 3) || (layout.compression != 5 && layout.compression != 8) ||
+		layout.predictor < 1 || layout.predictor > 3 || (layout.predictor == 3 && layout.sampleFormat != 3)) {
+		printf("GeoTiff::create(): only int16 or float32 samples, LZW or deflate, and a floating point predictor of floats only\n");
+		return 0;
+	}
+
+	FILE* f = fopen(path, "wb");
+	if (f == NULL) {
+		printf("GeoTiff::create(): cannot create %s\n", path);
+		return 0;
+	}
+
+	/* Header, the IFD offset is patched in at the end */
+	const bool bigEndian = layout.bigEndian, swap = bigEndian == hostLittleEndian();
+	uint8_t header[8];
+	memcpy(header, bigEndian ? "MM" : "II", 2);
+	writeUint(header + 2, 42, 2, bigEndian);
+	writeUint(header + 4, 0, 4, bigEndian);
+	int status = fwrite(header, 1, 8, f) == 8;
+
+	const unsigned int blockW = tiled ? layout.tileSize : width, blockH = tiled ? layout.tileSize : std::min(layout.rowsPerStrip, height);
+	const unsigned int blocksX = (width + blockW - 1) / blockW, blocksY = (height + blockH - 1) / blockH;
+	const unsigned int bytes = layout.sampleFormat == 2 ? 2 : 4;
+	const size_t rowBytes = (size_t)blockW * bytes;
+	std::vector<uint32_t> offsets, byteCounts;
+	std::vector<uint8_t> block(blockH * rowBytes), planes(rowBytes), compressed;
+	uint64_t fileOffset = 8;
+	for (unsigned int by = 0; status && by < blocksY; by++) {
+		for (unsigned int bx = 0; status && bx < blocksX; bx++) {
+			std::fill(block.begin(), block.end(), 0);
+			unsigned int cols = std::min(blockW, width - bx * blockW), rows = std::min(blockH, height - by * blockH);
+			for (unsigned int y = 0; y < rows; y++) {
+				const float* src = &elev[((size_t)by * blockH + y) * width + (size_t)bx * blockW];
+				uint8_t* row = &block[y * rowBytes];
+				for (unsigned int x = 0; x < cols; x++) {
+					if (bytes == 2) {
+						int16_t v = (int16_t)std::min(std::max(floorf(src[x] + 0.5f), -32768.0f), 32767.0f);
+						memcpy(row + (size_t)x * 2, &v, 2);
+					}
+					else {
+						memcpy(row + (size_t)x * 4, &src[x], 4);
+					}
+				}
+			}
+
+			/* Strips are as long as their rows, tiles are always whole */
+			const size_t size = (tiled ? blockH : rows) * rowBytes;
+			if (layout.predictor == 2) {
+				for (size_t at = 0; at < size; at += rowBytes) {
+					if (bytes == 2)
+						applyHorizontalPredictor<uint16_t>(&block[at], blockW);
+					else
+						applyHorizontalPredictor<uint32_t>(&block[at], blockW);
+				}
+			}
+			else if (layout.predictor == 3) {
+				/* Byte k of every sample, most significant first, then byte k+1, each byte less the one before */
+				const bool little = hostLittleEndian();
+				for (size_t at = 0; at < size; at += rowBytes) {
+					uint8_t* row = &block[at];
+					memcpy(planes.data(), row, rowBytes);
+					for (unsigned int i = 0; i < blockW; i++) {
+						for (unsigned int k = 0; k < bytes; k++)
+							row[(size_t)k * blockW + i] = planes[(size_t)i * bytes + (little ? bytes - 1 - k : k)];
+					}
+					for (size_t k = rowBytes - 1; k > 0; k--)
+						row[k] = (uint8_t)(row[k] - row[k - 1]);
+				}
+			}
+			if (swap && layout.predictor != 3) {
+				for (size_t i = 0; i < size; i += bytes)
+					std::reverse(&block[i], &block[i] + bytes);
+			}
+
+			if (layout.compression == 5) {
+				lzwEncode(block.data(), size, compressed);
+			}
+			else {
+				compressed.clear();
+				status = lodepng::compress(compressed, block.data(), size) == 0;
+			}
+			status = status && fwrite(compressed.data(), 1, compressed.size(), f) == compressed.size();
+			offsets.push_back((uint32_t)fileOffset);
+			byteCounts.push_back((uint32_t)compressed.size());
+			fileOffset += compressed.size();
+		}
+	}
+
+	/* Arrays that do not fit in their entries go ahead of the IFD, word aligned */
+	const double pixelScale[3] = { (imgBounds[3] - imgBounds[1]) * 180 / M_PI / width, (imgBounds[0] - imgBounds[2]) * 180 / M_PI / height, 0 };
+	const double tiepoint[6] = { 0, 0, 0, imgBounds[1] * 180 / M_PI, imgBounds[0] * 180 / M_PI, 0 };
+	const uint16_t geoKeys[16] = { 1, 1, 0, 3, (uint16_t)geoKeyModelType, 0, 1, 2, (uint16_t)geoKeyRasterType, 0, 1, 1, 2048, 0, 1, 4326 };
+
+	std::vector<uint8_t> extra;
+	if (fileOffset % 2)
+		extra.push_back(0);
+	struct entrySpec {
+		uint16_t tag, type;
+		uint32_t count;
+		const void* data;
+	};
+	const uint32_t w32 = width, h32 = height, block32 = blockH, tile32 = layout.tileSize;
+	const uint16_t bits = (uint16_t)(bytes * 8), compression = (uint16_t)layout.compression, blackIsZero = 1, one = 1;
+	const uint16_t predictor = (uint16_t)layout.predictor, sampleFormat = (uint16_t)layout.sampleFormat;
+	const uint32_t numBlocks = (uint32_t)offsets.size();
+
+	/* Entries in ascending tag order */
+	std::vector<entrySpec> specs;
+	const entrySpec head[] = {
+		{ TAG_IMAGE_WIDTH, 4, 1, &w32 }, { TAG_IMAGE_LENGTH, 4, 1, &h32 }, { TAG_BITS_PER_SAMPLE, 3, 1, &bits },
+		{ TAG_COMPRESSION, 3, 1, &compression }, { TAG_PHOTOMETRIC, 3, 1, &blackIsZero }
+	};
+	specs.assign(head, head + sizeof(head) / sizeof(head[0]));
+	if (!tiled)
+		specs.push_back({ TAG_STRIP_OFFSETS, 4, numBlocks, offsets.data() });
+	specs.push_back({ TAG_SAMPLES_PER_PIXEL, 3, 1, &one });
+	if (!tiled) {
+		specs.push_back({ TAG_ROWS_PER_STRIP, 4, 1, &block32 });
+		specs.push_back({ TAG_STRIP_BYTE_COUNTS, 4, numBlocks, byteCounts.data() });
+	}
+	specs.push_back({ TAG_PLANAR_CONFIG, 3, 1, &one });
+	specs.push_back({ TAG_PREDICTOR, 3, 1, &predictor });
+	if (tiled) {
+		const entrySpec tiles[] = {
+			{ TAG_TILE_WIDTH, 4, 1, &tile32 }, { TAG_TILE_LENGTH, 4, 1, &tile32 },
+			{ TAG_TILE_OFFSETS, 4, numBlocks, offsets.data() }, { TAG_TILE_BYTE_COUNTS, 4, numBlocks, byteCounts.data() }
+		};
+		specs.insert(specs.end(), tiles, tiles + sizeof(tiles) / sizeof(tiles[0]));
+	}
+	const entrySpec tail[] = {
+		{ TAG_SAMPLE_FORMAT, 3, 1, &sampleFormat }, { TAG_MODEL_PIXEL_SCALE, 12, 3, pixelScale },
+		{ TAG_MODEL_TIEPOINT, 12, 6, tiepoint }, { TAG_GEO_KEY_DIRECTORY, 3, 16, geoKeys }
+	};
+	specs.insert(specs.end(), tail, tail + sizeof(tail) / sizeof(tail[0]));
+	const uint16_t numEntries = (uint16_t)specs.size();
+
+	std::vector<uint8_t> ifd(2 + 12 * (size_t)numEntries + 4, 0);
+	writeUint(ifd.data(), numEntries, 2, bigEndian);
+	for (uint16_t i = 0; i < numEntries; i++) {
+		const entrySpec& s = specs[i];
+		uint8_t* e = &ifd[2 + 12 * (size_t)i];
+		writeUint(e, s.tag, 2, bigEndian);
+		writeUint(e + 2, s.type, 2, bigEndian);
+		writeUint(e + 4, s.count, 4, bigEndian);
+		std::vector<uint8_t> values;
+		appendValues(values, s.data, s.count, typeSize(s.type), swap);
+		if (values.size() <= 4) {
+			memcpy(e + 8, values.data(), values.size());
+		}
+		else {
+			writeUint(e + 8, fileOffset + extra.size(), 4, bigEndian);
+			extra.insert(extra.end(), values.begin(), values.end());
+		}
+	}
+
+	uint8_t ifdOffset[4];
+	writeUint(ifdOffset, fileOffset + extra.size(), 4, bigEndian);
+	if (fileOffset + extra.size() + ifd.size() > 0xffffffffull) {
+		printf("GeoTiff::create(): %s would exceed 4 GB\n", path);
+		status = 0;
+	}
+	status = status && fwrite(extra.data(), 1, extra.size(), f) == extra.size() && fwrite(ifd.data(), 1, ifd.size(), f) == ifd.size();
+	status = status && fseek(f, 4, SEEK_SET) == 0 && fwrite(ifdOffset, 1, 4, f) == 4;
+
+	if (fclose(f) != 0 || !status) {
+		printf("GeoTiff::create(): write to %s failed\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+* Maps a GeoTIFF and reads its first image, the layout of the tiles
+* or strips and the georeferencing.
+*/
+int GeoTiff::open(const char* path)
+{
+	close();
+
+	if (!mapping.open(path))
+		return 0;
+
+	/* Classic TIFF has 32-bit offsets and 12 byte entries, BigTIFF 64-bit offsets and 20 byte entries */
+	bool bigEndian = mapping.size >= 8 && mapping.data[0] == 'M' && mapping.data[1] == 'M';
+	bool valid = mapping.size >= 8 && (bigEndian || (mapping.data[0] == 'I' && mapping.data[1] == 'I'));
+	unsigned int version = valid ? (unsigned int)readUint(mapping.data + 2, 2, bigEndian) : 0;
+	bool bigTiff = version == 43;
+	valid = valid && (version == 42 || (bigTiff && mapping.size >= 16 && readUint(mapping.data + 4, 2, bigEndian) == 8));
+	const unsigned int offsetBytes = bigTiff ? 8 : 4, countBytes = bigTiff ? 8 : 2, entryBytes = bigTiff ? 20 : 12;
+	uint64_t ifd = valid ? readUint(mapping.data + (bigTiff ? 8 : 4), offsetBytes, bigEndian) : 0;
+	/* Offsets and counts come from the file, bounds are checked by subtraction so nothing can wrap */
+	valid = valid && ifd <= mapping.size && countBytes <= mapping.size - ifd;
+	uint64_t numEntries = valid ? readUint(mapping.data + ifd, countBytes, bigEndian) : 0;
+	valid = valid && numEntries <= (mapping.size - ifd - countBytes) / entryBytes;
+
+	std::map<unsigned int, tiffEntry> entries;
+	for (uint64_t i = 0; valid && i < numEntries; i++) {
+		const uint8_t* e = mapping.data + ifd + countBytes + i * entryBytes;
+		tiffEntry entry;
+		unsigned int tag = (unsigned int)readUint(e, 2, bigEndian);
+		entry.type = (unsigned int)readUint(e + 2, 2, bigEndian);
+		entry.count = readUint(e + 4, offsetBytes, bigEndian);
+		const uint8_t* field = e + 4 + offsetBytes;
+		if (typeSize(entry.type) == 0 || entry.count > mapping.size / typeSize(entry.type))
+			continue;
+		uint64_t bytes = entry.count * typeSize(entry.type);
+		if (bytes <= offsetBytes) {
+			entry.values = field;
+		}
+		else {
+			uint64_t at = readUint(field, offsetBytes, bigEndian);
+			if (at > mapping.size || bytes > mapping.size - at)
+				continue;
+			entry.values = mapping.data + at;
+		}
+		entries[tag] = entry;
+	}
+	if (!valid) {
+		printf("GeoTiff::open(): %s is not a TIFF file\n", path);
+		close();
+		return 0;
+	}
+
+	auto value = [&](unsigned int tag, double defaultValue) {
+		std::map<unsigned int, tiffEntry>::const_iterator it = entries.find(tag);
+		return it != entries.end() && it->second.count > 0 ? entryValue(it->second, 0, bigEndian) : defaultValue;
+	};
+
+	width = (unsigned int)value(TAG_IMAGE_WIDTH, 0);
+	height = (unsigned int)value(TAG_IMAGE_LENGTH, 0);
+	bytesPerSample = (unsigned int)value(TAG_BITS_PER_SAMPLE, 1) / 8;
+	sampleFormat = (unsigned int)value(TAG_SAMPLE_FORMAT, 1);
+	compression = (unsigned int)value(TAG_COMPRESSION, 1);
+	if (compression == 32946)
+		compression = 8;	/* old deflate code */
+	predictor = (unsigned int)value(TAG_PREDICTOR, 1);
+	unsigned int samplesPerPixel = (unsigned int)value(TAG_SAMPLES_PER_PIXEL, 1);
+
+	bool supportedType = (bytesPerSample == 2 && sampleFormat <= 2) || (bytesPerSample == 4 && sampleFormat == 2) ||
+		(bytesPerSample == 4 && sampleFormat == 3) || (bytesPerSample == 8 && sampleFormat == 3);
+	bool supportedCoding = (compression == 1 || compression == 5 || compression == 8) &&
+		(predictor == 1 || predictor == 2 || (predictor == 3 && sampleFormat == 3));
+	if (width < 2 || height < 2 || samplesPerPixel != 1 || !supportedType || !supportedCoding) {
+		printf("GeoTiff::open(): %s is not a single band int16, uint16, int32, float32 or float64 DEM in a supported compression\n", path);
+		close();
+		return 0;
+	}
+
+	tiled = entries.count(TAG_TILE_WIDTH) != 0;
+	blockWidth = tiled ? (unsigned int)value(TAG_TILE_WIDTH, 0) : width;
+	blockHeight = tiled ? (unsigned int)value(TAG_TILE_LENGTH, 0) : std::min((unsigned int)value(TAG_ROWS_PER_STRIP, height), height);
+	if (blockWidth == 0 || blockHeight == 0) {
+		printf("GeoTiff::open(): %s has empty tiles or strips\n", path);
+		close();
+		return 0;
+	}
+	blocksX = (width + blockWidth - 1) / blockWidth;
+	blocksY = (height + blockHeight - 1) / blockHeight;
+
+	std::map<unsigned int, tiffEntry>::const_iterator offsetsIt = entries.find(tiled ? TAG_TILE_OFFSETS : TAG_STRIP_OFFSETS);
+	std::map<unsigned int, tiffEntry>::const_iterator bytesIt = entries.find(tiled ? TAG_TILE_BYTE_COUNTS : TAG_STRIP_BYTE_COUNTS);
+	const uint64_t numBlocks = (uint64_t)blocksX * blocksY;
+	if (offsetsIt == entries.end() || bytesIt == entries.end() || offsetsIt->second.count < numBlocks || bytesIt->second.count < numBlocks ||
+		!isUnsignedType(offsetsIt->second.type) || !isUnsignedType(bytesIt->second.type)) {
+		printf("GeoTiff::open(): %s lacks offsets or byte counts of its %s\n", path, tiled ? "tiles" : "strips");
+		close();
+		return 0;
+	}
+	blockOffsets.resize((size_t)numBlocks);
+	blockBytes.resize((size_t)numBlocks);
+	for (size_t i = 0; i < numBlocks; i++) {
+		blockOffsets[i] = entryUint(offsetsIt->second, i, bigEndian);
+		blockBytes[i] = entryUint(bytesIt->second, i, bigEndian);
+	}
+	swapBytes = bigEndian == hostLittleEndian();
+
+	/* Georeferencing, geographic north-up files only */
+	unsigned int modelType = 0, rasterType = 1;
+	std::map<unsigned int, tiffEntry>::const_iterator keysIt = entries.find(TAG_GEO_KEY_DIRECTORY);
+	if (keysIt != entries.end() && keysIt->second.count >= 4) {
+		const tiffEntry& keys = keysIt->second;
+		uint64_t numKeys = std::min((uint64_t)entryValue(keys, 3, bigEndian), (keys.count - 4) / 4);
+		for (uint64_t k = 0; k < numKeys; k++) {
+			unsigned int id = (unsigned int)entryValue(keys, 4 + 4 * k, bigEndian);
+			bool inlineValue = entryValue(keys, 5 + 4 * k, bigEndian) == 0;
+			unsigned int v = (unsigned int)entryValue(keys, 7 + 4 * k, bigEndian);
+			if (id == geoKeyModelType && inlineValue)
+				modelType = v;
+			if (id == geoKeyRasterType && inlineValue)
+				rasterType = v;
+		}
+	}
+
+	/* lon = a*i + b*j + c, lat = d*i + e*j + f at raster position (i,j) */
+	double a = 0, b = 0, c = 0, d = 0, e = 0, f = 0;
+	bool haveTransform = false;
+	std::map<unsigned int, tiffEntry>::const_iterator it = entries.find(TAG_MODEL_TRANSFORMATION);
+	if (it != entries.end() && it->second.count >= 16) {
+		a = entryValue(it->second, 0, bigEndian);
+		b = entryValue(it->second, 1, bigEndian);
+		c = entryValue(it->second, 3, bigEndian);
+		d = entryValue(it->second, 4, bigEndian);
+		e = entryValue(it->second, 5, bigEndian);
+		f = entryValue(it->second, 7, bigEndian);
+		haveTransform = true;
+	}
+	std::map<unsigned int, tiffEntry>::const_iterator tieIt = entries.find(TAG_MODEL_TIEPOINT), scaleIt = entries.find(TAG_MODEL_PIXEL_SCALE);
+	if (!haveTransform && tieIt != entries.end() && scaleIt != entries.end() && tieIt->second.count >= 6 && scaleIt->second.count >= 2) {
+		double sx = entryValue(scaleIt->second, 0, bigEndian), sy = entryValue(scaleIt->second, 1, bigEndian);
+		a = sx;
+		c = entryValue(tieIt->second, 3, bigEndian) - entryValue(tieIt->second, 0, bigEndian) * sx;
+		e = -sy;
+		f = entryValue(tieIt->second, 4, bigEndian) + entryValue(tieIt->second, 1, bigEndian) * sy;
+		haveTransform = true;
+	}
+
+	/* Pixel is point puts pixel centers on the grid, the corners are half a pixel out */
+	georeferenced = haveTransform && modelType == 2 && b == 0 && d == 0 && a != 0 && e != 0;
+	if (georeferenced) {
+		double shift = rasterType == 2 ? -0.5 : 0.0;
+		imgBounds[0] = (e * shift + f) * M_PI / 180;
+		imgBounds[1] = (a * shift + c) * M_PI / 180;
+		imgBounds[2] = (e * (height + shift) + f) * M_PI / 180;
+		imgBounds[3] = (a * (width + shift) + c) * M_PI / 180;
+	}
+	return 1;
+}
+
+void GeoTiff::close()
+{
+	mapping.close();
+	width = height = 0;
+	blockWidth = blockHeight = blocksX = blocksY = 0;
+	georeferenced = false;
+	memset(imgBounds, 0, sizeof(imgBounds));
+	blockOffsets.clear();
+	blockBytes.clear();
+}
+
+/*
+* Decompresses a tile or strip to buf and undoes its predictor, the
+* samples end up in host byte order, blockWidth per row. Blocks with
+* no data, sparse files, decode to zeros.
+*/
+int GeoTiff::decodeBlock(unsigned int block, std::vector<uint8_t>& buf) const
+{
+	unsigned int rows = tiled ? blockHeight : std::min(blockHeight, height - (block / blocksX) * blockHeight);
+	const size_t rowBytes = (size_t)blockWidth * bytesPerSample, need = rows * rowBytes;
+	const uint64_t offset = blockOffsets[block], bytes = blockBytes[block];
+
+	if (bytes == 0) {
+		buf.assign(need, 0);
+		return 1;
+	}
+	if (offset > mapping.size || bytes > mapping.size - offset)
+		return 0;
+
+	const uint8_t* in = mapping.data + offset;
+	if (compression == 1) {
+		if (bytes < need)
+			return 0;
+		buf.assign(in, in + need);
+	}
+	else if (compression == 8) {
+		buf.clear();
+		if (lodepng::decompress(buf, in, (size_t)bytes) != 0 || buf.size() < need)
+			return 0;
+	}
+	else {
+		buf.resize(need);
+		if (lzwDecode(in, (size_t)bytes, buf.data(), need) < need)
+			return 0;
+	}
+
+	/* The floating point predictor keeps its bytes most significant first, whatever the file byte order */
+	if (swapBytes && predictor != 3) {
+		for (size_t i = 0; i < need; i += bytesPerSample)
+			std::reverse(&buf[i], &buf[i] + bytesPerSample);
+	}
+
+	if (predictor == 2) {
+		for (unsigned int y = 0; y < rows; y++) {
+			uint8_t* row = &buf[y * rowBytes];
+			if (bytesPerSample == 2)
+				undoHorizontalPredictor<uint16_t>(row, blockWidth);
+			else if (bytesPerSample == 4)
+				undoHorizontalPredictor<uint32_t>(row, blockWidth);
+			else
+				undoHorizontalPredictor<uint64_t>(row, blockWidth);
+		}
+	}
+	else if (predictor == 3) {
+		/* Bytes are differenced along the row, which holds byte k of every sample, then byte k+1 */
+		std::vector<uint8_t> planes(rowBytes);
+		const bool little = hostLittleEndian();
+		for (unsigned int y = 0; y < rows; y++) {
+			uint8_t* row = &buf[y * rowBytes];
+			for (size_t k = 1; k < rowBytes; k++)
+				row[k] = (uint8_t)(row[k] + row[k - 1]);
+			memcpy(planes.data(), row, rowBytes);
+			for (unsigned int i = 0; i < blockWidth; i++) {
+				for (unsigned int k = 0; k < bytesPerSample; k++)
+					row[(size_t)i * bytesPerSample + (little ? bytesPerSample - 1 - k : k)] = planes[(size_t)k * blockWidth + i];
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+* Reads the w x h window at (x0,y0) to out, w floats per row, cells
+* outside of the DEM are 0. Every tile or strip the window touches is
+* decoded once, numThreads at a time (0 for all cores) on a pool kept
+* until the thread count changes.
+*/
+int GeoTiff::readWindow(int x0, int y0, unsigned int w, unsigned int h, float* out, unsigned int numThreads)
+{
+	if (mapping.data == NULL) {
+		printf("GeoTiff::readWindow(): no GeoTIFF open\n");
+		return 0;
+	}
+
+	uint64_t startTime = tic();
+	memset(out, 0, (size_t)w * h * sizeof(float));
+
+	int xa = std::max(x0, 0), ya = std::max(y0, 0);
+	int xb = (int)std::min((int64_t)x0 + w, (int64_t)width), yb = (int)std::min((int64_t)y0 + h, (int64_t)height);
+	if (xa >= xb || ya >= yb)
+		return 1;
+
+	std::vector<unsigned int> blocks;
+	for (int by = ya / (int)blockHeight; by <= (yb - 1) / (int)blockHeight; by++) {
+		for (int bx = xa / (int)blockWidth; bx <= (xb - 1) / (int)blockWidth; bx++)
+			blocks.push_back((unsigned int)by * blocksX + bx);
+	}
+
+	/* Blocks write to disjoint parts of the window, only failure is shared */
+	if (numThreads == 0)
+		numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	if (pool == nullptr || pool->size() != numThreads) {
+		delete pool;
+		pool = new ThreadPool(numThreads);
+		scratch.assign(pool->size(), std::vector<uint8_t>());
+	}
+
+	std::mutex lock;
+	bool failed = false;
+	pool->run(blocks.size(), [&](size_t task, unsigned int worker) {
+		unsigned int block = blocks[task];
+		std::vector<uint8_t>& buf = scratch[worker];
+		if (!decodeBlock(block, buf)) {
+			std::lock_guard<std::mutex> guard(lock);
+			failed = true;
+			return;
+		}
+
+		int bx = (int)(block % blocksX) * (int)blockWidth, by = (int)(block / blocksX) * (int)blockHeight;
+		int cx0 = std::max(xa, bx), cx1 = std::min(xb, bx + (int)blockWidth);
+		int cy0 = std::max(ya, by), cy1 = std::min(yb, by + (int)blockHeight);
+		for (int y = cy0; y < cy1; y++) {
+			const uint8_t* src = &buf[((size_t)(y - by) * blockWidth + (cx0 - bx)) * bytesPerSample];
+			samplesToFloat(src, (size_t)(cx1 - cx0), sampleFormat, bytesPerSample, &out[(size_t)(y - y0) * w + (cx0 - x0)]);
+		}
+	});
+
+	blocksRead += blocks.size();
+	decodeTime = toc(startTime);
+	if (failed) {
+		printf("GeoTiff::readWindow(): corrupt %s\n", tiled ? "tile" : "strip");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+* Sizes the engine DEM to w x h and uploads the window at (x0,y0),
+* the window must lie inside of the DEM.
+*/
+int GeoTiff::loadWindow(ViewshedEngine* engine, int x0, int y0, unsigned int w, unsigned int h, unsigned int numThreads)
+{
+	if (mapping.data == NULL || x0 < 0 || y0 < 0 || (int64_t)x0 + w > width || (int64_t)y0 + h > height) {
+		printf("GeoTiff::loadWindow(): window outside of the DEM\n");
+		return 0;
+	}
+
+	std::vector<float> elev((size_t)w * h);
+	if (!readWindow(x0, y0, w, h, elev.data(), numThreads))
+		return 0;
+	return engine->setElevation(elev.data(), w, h);
+}
+
+/*
+* Image bounds of a window, for viewshedParams::imgBounds.
+*/
+void GeoTiff::windowBounds(int x0, int y0, unsigned int w, unsigned int h, double bounds[4]) const
+{
+	bounds[0] = imgBounds[0] + (double)y0 / height * (imgBounds[2] - imgBounds[0]);
+	bounds[1] = imgBounds[1] + (double)x0 / width * (imgBounds[3] - imgBounds[1]);
+	bounds[2] = imgBounds[0] + ((double)y0 + h) / height * (imgBounds[2] - imgBounds[0]);
+	bounds[3] = imgBounds[1] + ((double)x0 + w) / width * (imgBounds[3] - imgBounds[1]);
+}
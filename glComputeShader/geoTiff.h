@@ -0,0 +1,80 @@
+#ifndef GEOTIFF_H
+#define GEOTIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "mappedFile.h"
+#include "viewshed.h"
+#include "threadpool.h"
+
+/*
+* Layout of a GeoTIFF written by GeoTiff::create().
+*/
+struct geoTiffLayout {
+	unsigned int tileSize;		/* tile side, a multiple of 16, 0 for strips */
+	unsigned int rowsPerStrip;	/* of strips */
+	unsigned int sampleFormat;	/* 2 int16 rounded to meters, 3 float32 */
+	unsigned int compression;	/* 5 LZW, 8 deflate */
+	unsigned int predictor;		/* 1 none, 2 horizontal, 3 floating point */
+	bool bigEndian;				/* file byte order */
+};
+
+/*
+* Tiled or stripped GeoTIFF DEM, classic or BigTIFF, either byte
+* order. Single band int16, uint16, int32, float32 or float64 samples,
+* uncompressed, deflate or LZW, with or without a horizontal or
+* floating point predictor.
+*
+* The file is memory mapped. readWindow() and loadWindow() decode only
+* the tiles (or strips) the window touches, in parallel on a thread
+* pool, each straight into its part of the window. imgBounds comes
+* from the ModelTiepoint and ModelPixelScale, or ModelTransformation,
+* tags of geographic (lat/lon) files.
+*/
+class GeoTiff {
+public:
+	GeoTiff();
+	~GeoTiff();
+
+	static int create(const char* path, const float* elev, unsigned int width, unsigned int height, unsigned int tileSize, const double imgBounds[4]);
+	static int create(const char* path, const float* elev, unsigned int width, unsigned int height, const geoTiffLayout& layout, const double imgBounds[4]);
+
+	int open(const char* path);
+	void close();
+
+	int readWindow(int x0, int y0, unsigned int w, unsigned int h, float* out, unsigned int numThreads = 0);
+	int loadWindow(ViewshedEngine* engine, int x0, int y0, unsigned int w, unsigned int h, unsigned int numThreads = 0);
+	void windowBounds(int x0, int y0, unsigned int w, unsigned int h, double bounds[4]) const;
+
+	unsigned int width;			/* DEM width in pixels */
+	unsigned int height;		/* DEM height in pixels */
+	unsigned int blockWidth;	/* tile width, the DEM width for strips */
+	unsigned int blockHeight;	/* tile height or rows per strip */
+	unsigned int blocksX, blocksY;
+	bool tiled;
+	bool georeferenced;			/* imgBounds is known */
+	double imgBounds[4];		/* in radians, lat lon lat lon like viewshedParams */
+	uint64_t blocksRead;		/* tiles or strips decoded so far */
+	double decodeTime;			/* last readWindow(), in ms */
+
+private:
+	int decodeBlock(unsigned int block, std::vector<uint8_t>& buf) const;
+
+	MappedFile mapping;
+
+	bool swapBytes;				/* file byte order is not the host's */
+	unsigned int bytesPerSample;
+	unsigned int sampleFormat;	/* 1 unsigned, 2 signed, 3 float */
+	unsigned int compression;	/* 1 none, 5 LZW, 8 deflate */
+	unsigned int predictor;		/* 1 none, 2 horizontal, 3 floating point */
+	std::vector<uint64_t> blockOffsets;
+	std::vector<uint64_t> blockBytes;
+
+	ThreadPool* pool;			/* decodes tiles, kept across reads */
+	std::vector< std::vector<uint8_t> > scratch;	/* decoded tile of each worker */
+};
+
+#endif // !GEOTIFF_H
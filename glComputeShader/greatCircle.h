@@ -0,0 +1,46 @@
+#ifndef GREATCIRCLE_H
+#define GREATCIRCLE_H
+
+#include <math.h>
+
+/*
+* Host side of shaders/greatCircle.glsl. The shader file is included
+* as is, with just enough of GLSL (vec3 and the built-ins it uses)
+* to compile it as C++. Everything lives in namespace glsl so vec3
+* does not clash with linmath.h.
+*/
+namespace glsl {
+
+struct vec3 {
+	float x, y, z;
+	vec3() : x(0), y(0), z(0) {}
+	vec3(float x, float y, float z) : x(x), y(y), z(z) {}
+};
+
+static inline vec3 operator+(vec3 a, vec3 b) { return vec3(a.x + b.x, a.y + b.y, a.z + b.z); }
+static inline vec3 operator-(vec3 a, vec3 b) { return vec3(a.x - b.x, a.y - b.y, a.z - b.z); }
+static inline vec3 operator*(float s, vec3 a) { return vec3(s * a.x, s * a.y, s * a.z); }
+static inline vec3 operator/(vec3 a, float s) { return vec3(a.x / s, a.y / s, a.z / s); }
+
+static inline float sin(float a) { return sinf(a); }
+static inline float cos(float a) { return cosf(a); }
+static inline float sqrt(float a) { return sqrtf(a); }
+static inline float atan(float y, float x) { return atan2f(y, x); }
+static inline float dot(vec3 a, vec3 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+static inline float length(vec3 a) { return sqrtf(dot(a, a)); }
+
+#define GC_FUNC static inline
+#define GC_INOUT(T) T&
+#include "shaders/greatCircle.glsl"
+#undef GC_FUNC
+#undef GC_INOUT
+
+} // namespace glsl
+
+using glsl::gcTrack;
+using glsl::gcInit;
+using glsl::gcNext;
+using glsl::gcLatitude;
+using glsl::gcLongitude;
+
+#endif // !GREATCIRCLE_H
@@ -7,6 +7,15 @@
 #include "linmath.h"
 
 #include "shader.h"
+#include "timer.h"
+#include "viewshedGL.h"
+#include "viewshedCPU.h"
+#include "viewshedTotal.h"
+#include "viewshedExternal.h"
+#include "tileStore.h"
+#include "demDecode.h"
+#include "demFile.h"
+#include "geoTiff.h"
 
 #define M_PI       3.14159265358979323846 
 
@@ -20,7 +29,10 @@
 #define PERFTIME(funct) {unsigned __int64 freq;  QueryPerformanceFrequency((LARGE_INTEGER*)&freq);  double timerFrequency = (1.0/freq);  unsigned __int64 startTime;  QueryPerformanceCounter((LARGE_INTEGER *)&startTime);  unsigned __int64 endTime;  funct; QueryPerformanceCounter((LARGE_INTEGER *)&endTime);  double timeDifferenceInMilliseconds = ((endTime-startTime) * timerFrequency);  printf("Timing %fms\n",timeDifferenceInMilliseconds);}
 #endif
 #else
-//AIX/Linux gettimeofday() implementation here
+#define PERFTIME_INIT uint64_t startTime; double timeDifferenceInMilliseconds;
+#define PERFTIME_START startTime = tic();
+#define PERFTIME_END timeDifferenceInMilliseconds = toc(startTime);  printf("Timing %fms\n",timeDifferenceInMilliseconds);
+#define PERFTIME(funct) {uint64_t startTime = tic();  funct;  double timeDifferenceInMilliseconds = toc(startTime);  printf("Timing %fms\n",timeDifferenceInMilliseconds);}
 #endif
 
 void glErrorCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam)
@@ -29,13 +41,1118 @@ void glErrorCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLs
 		(type == GL_DEBUG_TYPE_ERROR ? "** GL ERROR **" : ""), type, severity, message);
 }
 
+/* Cells allowed to differ, as fractions of the DEM: float rounding between engines and code paths
+   of the same rays, another visibility model (local projection, exact sweep, adaptive rays, range
+   cut) against the spherical rays, and the approximate XDraw and reference planes */
+static const double engineTolerance = 0.005, modelTolerance = 0.01, approxTolerance = 0.02;
+
+/* What the benchmarks share: the resident GPU engine and the tile store it was loaded from, the
+   observer, the host copy of the DEM, and the packed results of the observer on the GPU and with
+   the scalar CPU rays, spherical and local. Every check is counted, the failed ones too */
+struct benchContext {
+	GLViewshedEngine* engine;
+	TileStore* store;
+	viewshedParams p;
+	const float* elevData;
+	unsigned int inW, inH;
+	int obsX, obsY;
+	int numObservers;
+	size_t numWords;
+	uint32_t* gpuPacked;
+	uint32_t* cpuPacked;
+	uint32_t* localPacked;
+	uint32_t* scratch;
+	int numChecks, numFailed;
+};
+
+static unsigned int popcount(uint32_t bits)
+{
+	unsigned int n = 0;
+	for (; bits; bits &= bits - 1)
+		n++;
+	return n;
+}
+
+/* Number of cells set in only one of two packed bitmaps of numWords words */
+static size_t countDiff(const uint32_t* a, const uint32_t* b, size_t numWords)
+{
+	size_t numDiff = 0;
+	for (size_t i = 0; i < numWords; i++)
+		numDiff += popcount(a[i] ^ b[i]);
+	return numDiff;
+}
+
+/* Number of cells set in a packed bitmap of numWords words */
+static size_t countSet(const uint32_t* a, size_t numWords)
+{
+	size_t numSet = 0;
+	for (size_t i = 0; i < numWords; i++)
+		numSet += popcount(a[i]);
+	return numSet;
+}
+
+/* Counts cells set in only one of two packed bitmaps, the first maxCells of them go to cells as x,y pairs */
+static size_t diffCells(const uint32_t* a, const uint32_t* b, unsigned int wordsPerRow, unsigned int W, unsigned int H, int* cells, size_t maxCells)
+{
+	size_t numDiff = 0;
+	for (unsigned int y = 0; y < H; y++) {
+		for (unsigned int wi = 0; wi < wordsPerRow; wi++) {
+			size_t i = (size_t)y * wordsPerRow + wi;
+			for (uint32_t diff = a[i] ^ b[i]; diff; diff &= diff - 1) {
+				if (numDiff < maxCells) {
+					int bit = 0;
+					while (!(diff & (1u << bit)))
+						bit++;
+					cells[2 * numDiff] = wi * 32 + bit;
+					cells[2 * numDiff + 1] = y;
+				}
+				numDiff++;
+			}
+		}
+	}
+	return numDiff;
+}
+
+/* Counts a check, a failed one is reported */
+static void check(benchContext* b, bool ok, const char* what)
+{
+	b->numChecks++;
+	if (!ok) {
+		b->numFailed++;
+		printf("FAILED: %s\n", what);
+	}
+}
+
+/* Counts a check that at most maxDiff cells differ */
+static void checkDiff(benchContext* b, size_t numDiff, size_t maxDiff, const char* what)
+{
+	b->numChecks++;
+	if (numDiff > maxDiff) {
+		b->numFailed++;
+		printf("FAILED: %s, %zu cells differ, at most %zu allowed\n", what, numDiff, maxDiff);
+	}
+}
+
+/* Cells of the DEM a tolerance allows to differ */
+static size_t maxCells(const benchContext* b, double tolerance)
+{
+	return (size_t)(tolerance * b->inW * b->inH);
+}
+
+/* Terrarium PNG through lodepng then a scalar loop, the reference of the fused decoders */
+static float* decodeTerrariumReference(const char* path, unsigned int* w, unsigned int* h)
+{
+	unsigned char* rgba;
+	if (lodepng_decode32_file(&rgba, w, h, path) != 0)
+		return nullptr;
+	float* elev = (float*)malloc((size_t)*w * *h * sizeof(float));
+	for (size_t i = 0; elev && i < (size_t)*w * *h; i++)
+		elev[i] = ((float)rgba[4 * i] * 256.0f + (float)rgba[4 * i + 1] + (float)rgba[4 * i + 2] / 256.0f) - 32768.0f;
+	free(rgba);
+	return elev;
+}
+
+/* Loads the DEM into an engine and runs the observer once, then returns the wall time per
+   observer of numObservers runs. gpuTime, when given, sums the timer queries of the runs */
+static double timeGpuRuns(benchContext* b, GLViewshedEngine* e, double* gpuTime = nullptr)
+{
+	b->store->loadWindow(e, 0, 0, b->inW, b->inH);
+	e->run(&b->p);
+	glFinish();
+
+	uint64_t start = tic();
+	for (int i = 0; i < b->numObservers; i++) {
+		e->run(&b->p);
+		if (gpuTime)
+			*gpuTime += e->gpuTime();
+	}
+	glFinish();
+	return toc(start) / b->numObservers;
+}
+
+/* PNG decode: RGBA image then floats, against the fused decoder writing floats straight away */
+static void benchPngDecode(benchContext* b)
+{
+	uint64_t startTime = tic();
+	unsigned int w, h;
+	float* ref = decodeTerrariumReference("./elevation/z10_512.png", &w, &h);
+	double refTime = toc(startTime);
+
+	ElevationPNG png;
+	for (unsigned int threads = 1; ref && threads <= 4 && png.open("./elevation/z10_512.png"); threads *= 4) {
+		startTime = tic();
+		if (!png.decode(ref, png.width, DEM_TERRARIUM, threads))
+			break;
+		double fusedTime = toc(startTime);
+		size_t numDiff = 0;
+		for (size_t i = 0; i < (size_t)w * h; i++)
+			numDiff += ref[i] != b->elevData[i];
+		printf("PNG decode: RGBA and scalar loop %f ms, fused %u thread(s) %f ms (inflate %f ms, unfilter and convert %f ms), %zu cells differ\n",
+			refTime, threads, fusedTime, png.inflateTime, png.decodeTime, numDiff);
+		checkDiff(b, numDiff, 0, "fused PNG decode");
+	}
+	free(ref);
+}
+
+/* CPU engine on the same observer, compared with the GPU result, then the ray-packet kernels on one
+   thread compared with the scalar kernel. Leaves the scalar spherical and local rays in the context */
+static void benchCpuKernels(benchContext* b)
+{
+	CPUViewshedEngine cpuEngine;
+	cpuEngine.init(0, SIMD_SCALAR);
+	b->store->loadWindow(&cpuEngine, 0, 0, b->inW, b->inH);
+
+	cpuEngine.run(&b->p);
+	printf("CPU engine: %u threads, rays %f ms, merge %f ms\n", std::thread::hardware_concurrency(), cpuEngine.rayTime, cpuEngine.mergeTime);
+	cpuEngine.readPacked(b->cpuPacked);
+	size_t numDiff = countDiff(b->gpuPacked, b->cpuPacked, b->numWords);
+	printf("CPU engine: %zu of %u cells differ from the GPU result\n", numDiff, b->inW * b->inH);
+	checkDiff(b, numDiff, maxCells(b, engineTolerance), "CPU engine against the GPU");
+
+	cpuEngine.localProjection = true;
+	cpuEngine.run(&b->p);
+	cpuEngine.readPacked(b->localPacked);
+
+	double scalarTime = 0;
+	for (int level = SIMD_SCALAR; level <= detectSimdLevel(); level++) {
+		CPUViewshedEngine simdEngine;
+		simdEngine.init(1, (simdLevel)level);
+		b->store->loadWindow(&simdEngine, 0, 0, b->inW, b->inH);
+		simdEngine.run(&b->p);
+		if (level == SIMD_SCALAR)
+			scalarTime = simdEngine.rayTime;
+
+		simdEngine.readPacked(b->scratch);
+		numDiff = countDiff(b->cpuPacked, b->scratch, b->numWords);
+		printf("CPU %s, 1 thread: rays %f ms (%.2fx), %zu cells differ from scalar\n", simdLevelName(simdEngine.simd),
+			simdEngine.rayTime, scalarTime / simdEngine.rayTime, numDiff);
+		checkDiff(b, numDiff, 0, simdLevelName(simdEngine.simd));
+	}
+}
+
+/* Thread scaling on a 2048x2048 DEM, z10_512 upsampled bilinearly, checked against 1 thread */
+static void benchThreadScaling(benchContext* b)
+{
+	const unsigned int bigW = 2048, bigH = 2048, inW = b->inW, inH = b->inH;
+	const float* elevData = b->elevData;
+	float* bigElev = (float*)malloc((size_t)bigW * bigH * sizeof(float));
+	size_t bigWords = (size_t)(bigW + 31) / 32 * bigH;
+	uint32_t* onePacked = (uint32_t*)malloc(bigWords * sizeof(uint32_t));
+	uint32_t* bigPacked = (uint32_t*)malloc(bigWords * sizeof(uint32_t));
+	for (unsigned int y = 0; bigElev && y < bigH; y++) {
+		float fy = std::min((y + 0.5f) * inH / bigH - 0.5f, (float)(inH - 1));
+		unsigned int y0 = (unsigned int)std::max(fy, 0.0f), y1 = std::min(y0 + 1, inH - 1);
+		float wy = std::max(fy, 0.0f) - y0;
+		for (unsigned int x = 0; x < bigW; x++) {
+			float fx = std::min((x + 0.5f) * inW / bigW - 0.5f, (float)(inW - 1));
+			unsigned int x0 = (unsigned int)std::max(fx, 0.0f), x1 = std::min(x0 + 1, inW - 1);
+			float wx = std::max(fx, 0.0f) - x0;
+			float top = elevData[(size_t)y0 * inW + x0] + wx * (elevData[(size_t)y0 * inW + x1] - elevData[(size_t)y0 * inW + x0]);
+			float bottom = elevData[(size_t)y1 * inW + x0] + wx * (elevData[(size_t)y1 * inW + x1] - elevData[(size_t)y1 * inW + x0]);
+			bigElev[(size_t)y * bigW + x] = top + wy * (bottom - top);
+		}
+	}
+
+	unsigned int maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	double oneTime = 0;
+	for (unsigned int threads = 1; bigElev && onePacked && bigPacked; threads = std::min(2 * threads, maxThreads)) {
+		CPUViewshedEngine bigCpu;
+		bigCpu.init(threads);
+		bigCpu.setElevation(bigElev, bigW, bigH);
+		bigCpu.run(&b->p);
+		if (threads == 1)
+			oneTime = bigCpu.rayTime + bigCpu.mergeTime;
+		bigCpu.readPacked(threads == 1 ? onePacked : bigPacked);
+
+		size_t numDiff = threads > 1 ? countDiff(onePacked, bigPacked, bigWords) : 0;
+		double time = bigCpu.rayTime + bigCpu.mergeTime;
+		printf("CPU %s 2048x2048, %u thread(s): rays %f ms, merge %f ms, %.2fx (%.0f%% of linear), %zu cells differ from 1 thread\n",
+			simdLevelName(bigCpu.simd), threads, bigCpu.rayTime, bigCpu.mergeTime, oneTime / time, 100 * oneTime / time / threads, numDiff);
+		checkDiff(b, numDiff, 0, "2048x2048 threads against 1 thread");
+		if (threads == maxThreads)
+			break;
+	}
+	free(bigPacked);
+	free(onePacked);
+	free(bigElev);
+}
+
+/* Workgroup size sweep, every size is checked against the default one */
+static void benchLocalSizes(benchContext* b)
+{
+	for (unsigned int localSize = 1; localSize <= 256; localSize *= 2) {
+		glViewshedOptions wgOptions;
+		wgOptions.localSize = localSize;
+
+		GLViewshedEngine wgEngine;
+		if (!wgEngine.init("./shaders/visibility.comp", wgOptions))
+			continue;
+		double wgTime = timeGpuRuns(b, &wgEngine);
+		wgEngine.readPacked(b->scratch);
+		size_t numDiff = countDiff(b->gpuPacked, b->scratch, b->numWords);
+		printf("GPU local size %3u: %f ms per observer, %zu cells differ\n", localSize, wgTime, numDiff);
+		checkDiff(b, numDiff, 0, "GPU local size");
+		wgEngine.release();
+	}
+}
+
+/* Output paths, GPU time from timer queries next to wall time */
+static void benchOutputModes(benchContext* b)
+{
+	const char* outputNames[] = { "atomic", "visible", "ballot" };
+	for (int mode = VIS_OUTPUT_ATOMIC; mode <= VIS_OUTPUT_BALLOT; mode++) {
+		glViewshedOptions outOptions;
+		outOptions.output = (visOutputMode)mode;
+
+		GLViewshedEngine outEngine;
+		if (!outEngine.init("./shaders/visibility.comp", outOptions))
+			continue;
+		double outTime = 0;
+		double outWall = timeGpuRuns(b, &outEngine, &outTime);
+		outEngine.readPacked(b->scratch);
+		size_t numDiff = countDiff(b->gpuPacked, b->scratch, b->numWords);
+		printf("GPU %s output: %f ms GPU time, %f ms wall time per observer, %zu cells differ\n", outputNames[mode], outTime / b->numObservers, outWall, numDiff);
+		checkDiff(b, numDiff, 0, outputNames[mode]);
+		outEngine.release();
+	}
+}
+
+/* 16-bit elevation textures against R32F, speed and quantization error. Half floats round
+   heights to 1 m and may flip a few cells, one in a thousand of the DEM is allowed */
+static void benchElevationFormats(benchContext* b)
+{
+	const char* formatNames[] = { "R32F", "R16UI", "R16F" };
+	for (int format = VIS_ELEVATION_R32F; format <= VIS_ELEVATION_R16F; format++) {
+		glViewshedOptions elevOptions;
+		elevOptions.elevation = (visElevationFormat)format;
+
+		GLViewshedEngine elevEngine;
+		if (!elevEngine.init("./shaders/visibility.comp", elevOptions))
+			continue;
+		double elevTime = timeGpuRuns(b, &elevEngine);
+		elevEngine.readPacked(b->scratch);
+		size_t numDiff = countDiff(b->gpuPacked, b->scratch, b->numWords);
+		printf("GPU %s elevation: %f ms per observer, max quantization error %f m, %zu cells differ\n",
+			formatNames[format], elevTime, elevEngine.quantizationError, numDiff);
+		checkDiff(b, numDiff, format == VIS_ELEVATION_R16F ? maxCells(b, 0.001) : 0, formatNames[format]);
+		elevEngine.release();
+	}
+}
+
+/* Mapped DEM files uploaded through a pixel unpack buffer, against decoding the PNG */
+static void benchDemFiles(benchContext* b)
+{
+	const char* demNames[] = { "temp_dem_f32.vsdm", "temp_dem_u16.vsdm" };
+	for (int type = DEM_FLOAT32; type <= DEM_UINT16; type++) {
+		if (!DemFile::createFromPNG("./elevation/z10_512.png", demNames[type], DEM_TERRARIUM, b->p.imgBounds, (demSampleType)type))
+			continue;
+
+		glViewshedOptions demOptions;
+		demOptions.elevation = type == DEM_UINT16 ? VIS_ELEVATION_R16UI : VIS_ELEVATION_R32F;
+		GLViewshedEngine demEngine;
+		if (!demEngine.init("./shaders/visibility.comp", demOptions))
+			continue;
+
+		uint64_t startTime = tic();
+		unsigned int w, h;
+		float* pngElev = decodeTerrariumReference("./elevation/z10_512.png", &w, &h);
+		if (!pngElev)
+			continue;
+		demEngine.setElevation(pngElev, w, h);
+		glFinish();
+		double pngTime = toc(startTime);
+		free(pngElev);
+
+		startTime = tic();
+		DemFile dem;
+		if (!dem.open(demNames[type]) || !dem.load(&demEngine))
+			continue;
+		glFinish();
+		double demTime = toc(startTime);
+
+		demEngine.run(&b->p);
+		demEngine.readPacked(b->scratch);
+		size_t numDiff = countDiff(b->gpuPacked, b->scratch, b->numWords);
+		printf("DEM file %s: lodepng_decode32_file and upload %f ms, map and upload %f ms, max quantization error %f m, %zu cells differ\n",
+			type == DEM_UINT16 ? "uint16" : "float32", pngTime, demTime, dem.quantizationError, numDiff);
+		checkDiff(b, numDiff, 0, demNames[type]);
+		dem.close();
+		demEngine.release();
+	}
+	remove(demNames[DEM_FLOAT32]);
+	remove(demNames[DEM_UINT16]);
+}
+
+/* Tiled GeoTIFF read natively: bounds from its tags, a window decodes only its tiles, the whole DEM in parallel */
+static void benchGeoTiff(benchContext* b)
+{
+	GeoTiff tiff;
+	if (GeoTiff::create("temp_dem.tif", b->elevData, b->inW, b->inH, 64, b->p.imgBounds) && tiff.open("temp_dem.tif")) {
+		double boundsError = 0;
+		for (int i = 0; i < 4; i++)
+			boundsError = std::max(boundsError, fabs(tiff.imgBounds[i] - b->p.imgBounds[i]));
+
+		float* window = (float*)malloc(96 * 96 * sizeof(float));
+		size_t windowDiff = 0;
+		if (window && tiff.readWindow(b->obsX - 48, b->obsY - 48, 96, 96, window)) {
+			for (int y = 0; y < 96; y++) {
+				for (int x = 0; x < 96; x++)
+					windowDiff += window[y * 96 + x] != b->elevData[(size_t)(b->obsY - 48 + y) * b->inW + b->obsX - 48 + x];
+			}
+		}
+		free(window);
+		printf("GeoTIFF: bounds error %g rad, 96x96 window decoded %llu of %u tiles, %zu cells differ\n",
+			boundsError, (unsigned long long)tiff.blocksRead, tiff.blocksX * tiff.blocksY, windowDiff);
+		checkDiff(b, windowDiff, 0, "GeoTIFF window");
+
+		for (unsigned int threads = 1; threads <= 4; threads *= 4) {
+			GLViewshedEngine tiffEngine;
+			if (!tiffEngine.init("./shaders/visibility.comp") || !tiff.loadWindow(&tiffEngine, 0, 0, b->inW, b->inH, threads))
+				break;
+			tiffEngine.run(&b->p);
+			tiffEngine.readPacked(b->scratch);
+			size_t numDiff = countDiff(b->gpuPacked, b->scratch, b->numWords);
+			printf("GeoTIFF whole DEM, %u thread(s): %f ms to decode %u tiles, %zu cells differ\n", threads, tiff.decodeTime, tiff.blocksX * tiff.blocksY, numDiff);
+			checkDiff(b, numDiff, 0, "GeoTIFF whole DEM");
+			tiffEngine.release();
+		}
+		tiff.close();
+	}
+	remove("temp_dem.tif");
+
+	/* LZW strips, 37 rows each so the last one is short: int16 with the horizontal predictor and
+	   float32 with the floating point one, in both byte orders */
+	geoTiffLayout layout;
+	layout.tileSize = 0;
+	layout.rowsPerStrip = 37;
+	layout.compression = 5;
+	float* stripped = (float*)malloc((size_t)b->inW * b->inH * sizeof(float));
+	for (int i = 0; i < 4; i++) {
+		const bool int16 = i < 2;
+		layout.sampleFormat = int16 ? 2 : 3;
+		layout.predictor = int16 ? 2 : 3;
+		layout.bigEndian = i % 2 != 0;
+		int ok = stripped && GeoTiff::create("temp_dem.tif", b->elevData, b->inW, b->inH, layout, b->p.imgBounds) && tiff.open("temp_dem.tif") &&
+			!tiff.tiled && tiff.readWindow(0, 0, b->inW, b->inH, stripped, 1);
+		size_t numDiff = 0;
+		for (size_t k = 0; ok && k < (size_t)b->inW * b->inH; k++)
+			numDiff += stripped[k] != (int16 ? floorf(b->elevData[k] + 0.5f) : b->elevData[k]);
+		printf("GeoTIFF LZW %s strips, predictor %u, %s endian: %s, %u strips in %f ms, %zu cells differ\n", int16 ? "int16" : "float32",
+			layout.predictor, layout.bigEndian ? "big" : "little", ok ? "read" : "not read", tiff.blocksY, tiff.decodeTime, numDiff);
+		check(b, ok != 0, "GeoTIFF LZW strips read");
+		checkDiff(b, numDiff, 0, "GeoTIFF LZW strips");
+		tiff.close();
+		remove("temp_dem.tif");
+	}
+	free(stripped);
+}
+
+/* Rotation recurrence way points against the spherical interpolation, on both engines */
+static void benchRotationWaypoints(benchContext* b)
+{
+	const viewshedParams& p = b->p;
+	glViewshedOptions rotOptions;
+	rotOptions.rotationWaypoints = true;
+
+	GLViewshedEngine rotEngine;
+	if (rotEngine.init("./shaders/visibility.comp", rotOptions)) {
+		double rotTime = timeGpuRuns(b, &rotEngine);
+		rotEngine.readPacked(b->scratch);
+		size_t numDiff = countDiff(b->gpuPacked, b->scratch, b->numWords);
+		printf("GPU rotation way points: %f ms per observer, %zu cells differ\n", rotTime, numDiff);
+		checkDiff(b, numDiff, maxCells(b, engineTolerance), "GPU rotation way points");
+		rotEngine.release();
+	}
+
+	CPUViewshedEngine rotCpu;
+	rotCpu.init(1, SIMD_SCALAR);
+	rotCpu.rotationWaypoints = true;
+	b->store->loadWindow(&rotCpu, 0, 0, b->inW, b->inH);
+	rotCpu.run(&p);
+	rotCpu.readPacked(b->scratch);
+	size_t numDiff = countDiff(b->cpuPacked, b->scratch, b->numWords);
+	printf("CPU rotation way points, 1 thread: rays %f ms, %zu cells differ\n", rotCpu.rayTime, numDiff);
+	checkDiff(b, numDiff, maxCells(b, engineTolerance), "CPU rotation way points");
+
+	/* Largest way point drift over all rays, against the closed form in double */
+	double maxDrift = 0;
+	for (int idx = 0; idx < 2 * ((int)b->inW - 2) + 2 * (int)b->inH; idx++) {
+		int jx, jy;
+		perimeterRayEndpoint(idx, b->inW, b->inH, jx, jy);
+		double lat2 = p.imgBounds[0] + (double)jy / b->inH * (p.imgBounds[2] - p.imgBounds[0]);
+		double lon2 = p.imgBounds[1] + (double)jx / b->inW * (p.imgBounds[3] - p.imgBounds[1]);
+		double d = 2 * asin(sqrt(pow(sin((p.lat1 - lat2) / 2), 2) + cos(p.lat1) * cos(lat2) * pow(sin((p.lon1 - lon2) / 2), 2)));
+
+		gcTrack track = gcInit((float)p.lat1, (float)p.lon1, (float)lat2, (float)lon2, (float)d, 100);
+		for (int k = 1; k <= 100; k++) {
+			gcNext(track);
+			double A = sin((1.0 - k / 100.0) * d) / sin(d), B = sin(k / 100.0 * d) / sin(d);
+			double x = A * cos(p.lat1) * cos(p.lon1) + B * cos(lat2) * cos(lon2);
+			double y = A * cos(p.lat1) * sin(p.lon1) + B * cos(lat2) * sin(lon2);
+			double z = A * sin(p.lat1) + B * sin(lat2);
+			double dist = sqrt(pow(x - track.p.x, 2) + pow(y - track.p.y, 2) + pow(z - track.p.z, 2)) * p.actualRadius * 1e3;
+			if (dist > maxDrift)
+				maxDrift = dist;
+		}
+	}
+	printf("Rotation way points: max drift %f m\n", maxDrift);
+}
+
+/* Observer-local projection, against the spherical rays */
+static void benchLocalProjection(benchContext* b)
+{
+	printf("Local projection: max error %f m\n", viewshedLocalProjectionError(&b->p, b->inW, b->inH));
+
+	glViewshedOptions localOptions;
+	localOptions.localProjection = true;
+
+	GLViewshedEngine localEngine;
+	if (localEngine.init("./shaders/visibility.comp", localOptions)) {
+		double localTime = timeGpuRuns(b, &localEngine);
+		localEngine.readPacked(b->scratch);
+		size_t numDiff = countDiff(b->gpuPacked, b->scratch, b->numWords);
+		printf("GPU local projection: %f ms per observer, %zu cells differ\n", localTime, numDiff);
+		checkDiff(b, numDiff, maxCells(b, modelTolerance), "GPU local projection");
+		localEngine.release();
+	}
+
+	CPUViewshedEngine localCpu;
+	localCpu.init(1);
+	localCpu.localProjection = true;
+	b->store->loadWindow(&localCpu, 0, 0, b->inW, b->inH);
+	localCpu.run(&b->p);
+	localCpu.readPacked(b->scratch);
+	size_t numDiff = countDiff(b->cpuPacked, b->scratch, b->numWords);
+	printf("CPU local projection, %s, 1 thread: rays %f ms, %zu cells differ\n", simdLevelName(localCpu.simd), localCpu.rayTime, numDiff);
+	checkDiff(b, numDiff, maxCells(b, modelTolerance), "CPU local projection");
+}
+
+/* Two-pass (precomputed height field) against single-pass, for both ray geometries */
+static void benchTwoPass(benchContext* b)
+{
+	uint32_t* onePass = (uint32_t*)malloc(b->numWords * sizeof(uint32_t));
+	for (int local = 0; local <= 1 && onePass; local++) {
+		double passTime[2] = { 0, 0 };
+		for (int twoPass = 0; twoPass <= 1; twoPass++) {
+			glViewshedOptions passOptions;
+			passOptions.localProjection = local != 0;
+			passOptions.precomputeHeights = twoPass != 0;
+
+			GLViewshedEngine passEngine;
+			if (!passEngine.init("./shaders/visibility.comp", passOptions))
+				continue;
+			passTime[twoPass] = timeGpuRuns(b, &passEngine);
+			passEngine.readPacked(twoPass ? b->scratch : onePass);
+			passEngine.release();
+		}
+		size_t numDiff = countDiff(onePass, b->scratch, b->numWords);
+		printf("GPU %s rays: single-pass %f ms, two-pass %f ms per observer, %zu cells differ\n",
+			local ? "local" : "spherical", passTime[0], passTime[1], numDiff);
+		checkDiff(b, numDiff, maxCells(b, engineTolerance), "GPU two-pass");
+	}
+	free(onePass);
+}
+
+/* Batched observers in one dispatch against one run per observer, and their cumulative counts */
+static void benchBatched(benchContext* b)
+{
+	GLViewshedEngine& engine = *b->engine;
+	if (engine.maxBatch == 0)
+		return;
+
+	size_t numWords = b->numWords;
+	unsigned int numBatch = b->numObservers < (int)engine.maxBatch ? b->numObservers : engine.maxBatch;
+	viewshedParams* batch = (viewshedParams*)calloc(numBatch, sizeof(viewshedParams));
+	uint32_t* batchPacked = (uint32_t*)malloc(numBatch * numWords * sizeof(uint32_t));
+	if (batch && batchPacked) {
+		for (unsigned int i = 0; i < numBatch; i++) {
+			batch[i] = b->p;
+			batch[i].lon1 = (-117.25 + 0.01 * i) * M_PI / 180;
+			batch[i].observerAltitude = 2.0 + 10.0 * (i % 4);
+		}
+		engine.runBatch(batch, numBatch);
+		glFinish();
+
+		uint64_t batchStart = tic();
+		engine.runBatch(batch, numBatch);
+		glFinish();
+		double batchTime = toc(batchStart);
+		double batchGpu = engine.gpuTime();
+		engine.readPackedBatch(batchPacked);
+
+		uint64_t singleStart = tic();
+		for (unsigned int i = 0; i < numBatch; i++)
+			engine.run(&batch[i]);
+		glFinish();
+		double singleTime = toc(singleStart);
+
+		size_t numDiff = 0;
+		for (unsigned int i = 0; i < numBatch; i++) {
+			engine.run(&batch[i]);
+			engine.readPacked(b->scratch);
+			numDiff += countDiff(&batchPacked[i * numWords], b->scratch, numWords);
+		}
+		printf("Batched observers: %u in one dispatch %f ms (GPU %f ms), one by one %f ms, %zu cells differ\n",
+			numBatch, batchTime, batchGpu, singleTime, numDiff);
+		checkDiff(b, numDiff, 0, "batched observers");
+
+		/* Cumulative counts of the same observers against the sum of the batch layers */
+		uint32_t* counts = (uint32_t*)malloc((size_t)b->inW * b->inH * sizeof(uint32_t));
+		if (counts && engine.runCumulative(batch, numBatch) && engine.readCount(counts)) {
+			size_t numCountDiff = 0;
+			for (unsigned int y = 0; y < b->inH; y++) {
+				for (unsigned int x = 0; x < b->inW; x++) {
+					uint32_t n = 0;
+					for (unsigned int i = 0; i < numBatch; i++)
+						n += (batchPacked[i * numWords + y * engine.wordsPerRow + x / 32] >> (x % 32)) & 1;
+					if (n != counts[(size_t)y * b->inW + x])
+						numCountDiff++;
+				}
+			}
+			printf("Cumulative viewshed: %zu cells differ from the sum of the batch layers\n", numCountDiff);
+			checkDiff(b, numCountDiff, 0, "cumulative viewshed against the batch layers");
+		}
+		free(counts);
+	}
+	free(batchPacked);
+	free(batch);
+}
+
+/* Cumulative viewshed of many observers, on both engines. The counts summed over all cells may
+   differ by what the engines are allowed to differ on one observer, times the observers */
+static void benchCumulative(benchContext* b)
+{
+	const unsigned int numCumulative = 256;
+	const viewshedParams& p = b->p;
+	size_t numCells = (size_t)b->inW * b->inH;
+	viewshedParams* obs = (viewshedParams*)malloc(numCumulative * sizeof(viewshedParams));
+	uint32_t* gpuCount = (uint32_t*)malloc(numCells * sizeof(uint32_t));
+	uint32_t* cpuCount = (uint32_t*)malloc(numCells * sizeof(uint32_t));
+	if (obs && gpuCount && cpuCount) {
+		for (unsigned int i = 0; i < numCumulative; i++) {
+			obs[i] = p;
+			obs[i].lat1 = p.imgBounds[0] + (0.05 + 0.9 * (i / 16) / 15.0) * (p.imgBounds[2] - p.imgBounds[0]);
+			obs[i].lon1 = p.imgBounds[1] + (0.05 + 0.9 * (i % 16) / 15.0) * (p.imgBounds[3] - p.imgBounds[1]);
+		}
+
+		uint64_t cumStart = tic();
+		int gpuOk = b->engine->runCumulative(obs, numCumulative) && b->engine->readCount(gpuCount);
+		double gpuCumTime = toc(cumStart);
+
+		CPUViewshedEngine cumCpu;
+		cumCpu.init(0);
+		b->store->loadWindow(&cumCpu, 0, 0, b->inW, b->inH);
+		cumStart = tic();
+		int cpuOk = cumCpu.runCumulative(obs, numCumulative) && cumCpu.readCount(cpuCount);
+		double cpuCumTime = toc(cumStart);
+
+		check(b, gpuOk && cpuOk, "cumulative viewshed runs");
+		if (gpuOk && cpuOk) {
+			size_t numDiff = 0, countError = 0;
+			uint32_t maxCount = 0;
+			for (size_t i = 0; i < numCells; i++) {
+				if (gpuCount[i] != cpuCount[i])
+					numDiff++;
+				countError += gpuCount[i] > cpuCount[i] ? gpuCount[i] - cpuCount[i] : cpuCount[i] - gpuCount[i];
+				if (gpuCount[i] > maxCount)
+					maxCount = gpuCount[i];
+			}
+			printf("Cumulative viewshed of %u observers: GPU %f ms, CPU %s %f ms (rays %f ms, merge %f ms), max count %u, %zu cells differ, counts off by %zu in all\n",
+				numCumulative, gpuCumTime, simdLevelName(cumCpu.simd), cpuCumTime, cumCpu.rayTime, cumCpu.mergeTime, maxCount, numDiff, countError);
+			checkDiff(b, countError, numCumulative * maxCells(b, engineTolerance), "cumulative viewshed counts");
+		}
+	}
+	free(cpuCount);
+	free(gpuCount);
+	free(obs);
+}
+
+/* Exact radial sweep against the scalar ray engines */
+static void benchExactSweep(benchContext* b)
+{
+	CPUViewshedEngine exactCpu;
+	exactCpu.init(1);
+	exactCpu.algorithm = CPU_RADIAL_SWEEP;
+	b->store->loadWindow(&exactCpu, 0, 0, b->inW, b->inH);
+	exactCpu.run(&b->p);
+	exactCpu.run(&b->p);
+	exactCpu.readPacked(b->scratch);
+
+	CPUViewshedEngine rayCpu;
+	rayCpu.init(1, SIMD_SCALAR);
+	b->store->loadWindow(&rayCpu, 0, 0, b->inW, b->inH);
+	rayCpu.run(&b->p);
+
+	size_t numVisible = countSet(b->scratch, b->numWords);
+	size_t numDiff[2] = { countDiff(b->cpuPacked, b->scratch, b->numWords), countDiff(b->localPacked, b->scratch, b->numWords) };
+	printf("Exact radial sweep, 1 thread: %f ms (scalar rays %f ms), %zu visible, %zu cells differ from spherical rays, %zu from local rays\n",
+		exactCpu.rayTime, rayCpu.rayTime, numVisible, numDiff[0], numDiff[1]);
+	checkDiff(b, numDiff[0], maxCells(b, modelTolerance), "exact radial sweep against spherical rays");
+	checkDiff(b, numDiff[1], maxCells(b, modelTolerance), "exact radial sweep against local rays");
+}
+
+/* XDraw and reference planes against the scalar ray engines, every SIMD level against scalar */
+static void benchApproximations(benchContext* b)
+{
+	double numCells = (double)b->inW * b->inH;
+	uint32_t* scalarRef = (uint32_t*)malloc(b->numWords * sizeof(uint32_t));
+	const cpuAlgorithm algorithms[2] = { CPU_XDRAW, CPU_REFERENCE_PLANE };
+	for (int a = 0; scalarRef && a < 2; a++) {
+		for (int level = SIMD_SCALAR; level < SIMD_AUTO; level++) {
+			CPUViewshedEngine approx;
+			approx.init(1, (simdLevel)level);
+			if (approx.simd != (simdLevel)level)
+				continue;
+			approx.algorithm = algorithms[a];
+			b->store->loadWindow(&approx, 0, 0, b->inW, b->inH);
+			approx.run(&b->p);
+			approx.run(&b->p);
+			uint32_t* out = level == SIMD_SCALAR ? scalarRef : b->scratch;
+			approx.readPacked(out);
+
+			size_t numDiff[3] = { countDiff(b->cpuPacked, out, b->numWords), countDiff(b->localPacked, out, b->numWords), countDiff(scalarRef, out, b->numWords) };
+			printf("%s %s, 1 thread: %f ms, %zu cells (%.2f%%) differ from spherical rays, %zu (%.2f%%) from local rays, %zu from scalar\n",
+				cpuAlgorithmName(approx.algorithm), simdLevelName(approx.simd), approx.rayTime,
+				numDiff[0], 100.0 * numDiff[0] / numCells, numDiff[1], 100.0 * numDiff[1] / numCells, numDiff[2]);
+			checkDiff(b, numDiff[0], maxCells(b, approxTolerance), cpuAlgorithmName(approx.algorithm));
+			checkDiff(b, numDiff[1], maxCells(b, approxTolerance), cpuAlgorithmName(approx.algorithm));
+			checkDiff(b, numDiff[2], 0, cpuAlgorithmName(approx.algorithm));
+		}
+	}
+	free(scalarRef);
+}
+
+/* Observers on the right and bottom bounds round to column W or row H, outside the grid. The
+   octant algorithms move them into the last cell, they have to see what an observer three
+   quarters of a pixel inside sees, and their own cell. Adaptive rays start outside like the
+   perimeter rays, they are held to the local rays of the same observer */
+static void benchBoundaryObservers(benchContext* b)
+{
+	const cpuAlgorithm algorithms[] = { CPU_XDRAW, CPU_REFERENCE_PLANE, CPU_ADAPTIVE_RAYS };
+	const char* boundNames[3] = { "right bound", "bottom bound", "lower-right corner" };
+	const double* imgBounds = b->p.imgBounds;
+	const double pixel[2] = { (imgBounds[3] - imgBounds[1]) / b->inW, (imgBounds[2] - imgBounds[0]) / b->inH };
+	uint32_t* refPacked = (uint32_t*)malloc(b->numWords * sizeof(uint32_t));
+
+	CPUViewshedEngine rayCpu;
+	rayCpu.init(1);
+	rayCpu.localProjection = true;
+	b->store->loadWindow(&rayCpu, 0, 0, b->inW, b->inH);
+
+	for (size_t a = 0; refPacked && a < sizeof(algorithms) / sizeof(algorithms[0]); a++) {
+		const bool octants = algorithms[a] != CPU_ADAPTIVE_RAYS;
+		CPUViewshedEngine boundCpu;
+		boundCpu.init(1);
+		boundCpu.algorithm = algorithms[a];
+		b->store->loadWindow(&boundCpu, 0, 0, b->inW, b->inH);
+		for (int bound = 0; bound < 3; bound++) {
+			viewshedParams q = b->p;
+			if (bound != 1)
+				q.lon1 = imgBounds[3];
+			if (bound != 0)
+				q.lat1 = imgBounds[2];
+			viewshedParams inside = q;
+			if (bound != 1)
+				inside.lon1 -= 0.75 * pixel[0];
+			if (bound != 0)
+				inside.lat1 -= 0.75 * pixel[1];
+
+			int ok = boundCpu.run(&q) && boundCpu.readPacked(b->scratch);
+			ok = ok && (octants ? boundCpu.run(&inside) && boundCpu.readPacked(refPacked) : rayCpu.run(&q) && rayCpu.readPacked(refPacked));
+			check(b, ok != 0, "boundary observer run");
+			if (!ok)
+				continue;
+			size_t numDiff = countDiff(b->scratch, refPacked, b->numWords);
+			if (!octants) {
+				printf("%s observer on the %s: %zu cells differ from the local rays\n", cpuAlgorithmName(boundCpu.algorithm), boundNames[bound], numDiff);
+				checkDiff(b, numDiff, maxCells(b, modelTolerance), "boundary observer against the local rays");
+				continue;
+			}
+			unsigned int x = (unsigned int)std::min((int)round((inside.lon1 - imgBounds[1]) / pixel[0]), (int)b->inW - 1);
+			unsigned int y = (unsigned int)std::min((int)round((inside.lat1 - imgBounds[0]) / pixel[1]), (int)b->inH - 1);
+			bool seen = (b->scratch[(size_t)y * b->engine->wordsPerRow + x / 32] >> (x % 32)) & 1;
+			printf("%s observer on the %s: sees its cell (%u,%u) %s, %zu cells differ from an observer inside the last cell\n",
+				cpuAlgorithmName(boundCpu.algorithm), boundNames[bound], x, y, seen ? "yes" : "no", numDiff);
+			check(b, seen, "boundary observer sees its cell");
+			checkDiff(b, numDiff, 0, "boundary observer against one inside the last cell");
+		}
+	}
+	free(refPacked);
+}
+
+/* Adaptive rays against the scalar ray engines, and their work against the perimeter rays */
+static void benchAdaptive(benchContext* b)
+{
+	CPUViewshedEngine adaptive;
+	adaptive.init(1);
+	adaptive.algorithm = CPU_ADAPTIVE_RAYS;
+	b->store->loadWindow(&adaptive, 0, 0, b->inW, b->inH);
+	adaptive.run(&b->p);
+	adaptive.run(&b->p);
+	adaptive.readPacked(b->scratch);
+	size_t numDiff[2] = { countDiff(b->cpuPacked, b->scratch, b->numWords), countDiff(b->localPacked, b->scratch, b->numWords) };
+
+	cpuRayContext c;
+	rayCoverage perimeter;
+	setupRayContext(&c, &b->p, b->elevData, b->inW, b->inH, true);
+	perimeterRayCoverage(&c, &perimeter);
+	printf("Adaptive rays, 1 thread: %f ms, %zu cells differ from spherical rays, %zu from local rays\n",
+		adaptive.rayTime, numDiff[0], numDiff[1]);
+	printf("    adaptive: %llu rays, %llu steps, %llu cells missed; perimeter: %llu rays, %llu steps, %llu cells missed\n",
+		(unsigned long long)adaptive.coverage.raysLaunched, (unsigned long long)adaptive.coverage.steps, (unsigned long long)adaptive.coverage.cellsMissed,
+		(unsigned long long)perimeter.raysLaunched, (unsigned long long)perimeter.steps, (unsigned long long)perimeter.cellsMissed);
+	checkDiff(b, numDiff[0], maxCells(b, modelTolerance), "adaptive rays against spherical rays");
+	checkDiff(b, numDiff[1], maxCells(b, modelTolerance), "adaptive rays against local rays");
+	checkDiff(b, adaptive.coverage.cellsMissed, 0, "adaptive rays coverage");
+}
+
+/* External-memory sweep with a 1 MB budget against the in-memory radial sweep */
+static void benchExternalSweep(benchContext* b)
+{
+	uint32_t* sweepPacked = (uint32_t*)malloc(b->numWords * sizeof(uint32_t));
+	if (!sweepPacked)
+		return;
+	CPUViewshedEngine sweepCpu;
+	sweepCpu.init(1);
+	sweepCpu.algorithm = CPU_RADIAL_SWEEP;
+	b->store->loadWindow(&sweepCpu, 0, 0, b->inW, b->inH);
+	sweepCpu.run(&b->p);
+	sweepCpu.readPacked(sweepPacked);
+
+	FILE* f = fopen("temp_elev.raw", "wb");
+	if (f) {
+		fwrite(b->elevData, sizeof(float), (size_t)b->inW * b->inH, f);
+		fclose(f);
+	}
+
+	ExternalViewshedEngine ext;
+	ext.memoryBudget = 1 << 20;
+	f = nullptr;
+	int extOk = ext.setElevationFile("temp_elev.raw", b->inW, b->inH) && ext.run(&b->p, "temp_vis.bin") && (f = fopen("temp_vis.bin", "rb"));
+	check(b, extOk != 0, "external sweep run");
+	if (extOk) {
+		size_t numRead = fread(b->scratch, sizeof(uint32_t), b->numWords, f);
+		memset(&b->scratch[numRead], 0, (b->numWords - numRead) * sizeof(uint32_t));
+		size_t numDiff = countDiff(sweepPacked, b->scratch, b->numWords);
+		double mb = (double)(ext.io.bytesRead + ext.io.bytesWritten) / (1 << 20);
+		printf("External sweep, 1 MB budget: %f ms (in memory %f ms), %llu events in %u runs, read %.1f MB, wrote %.1f MB, %.1f MB/s over the run, %.1f MB/s in I/O, %zu cells differ from the in-memory sweep\n",
+			ext.runTime, sweepCpu.rayTime, (unsigned long long)ext.numEvents, ext.numRuns,
+			(double)ext.io.bytesRead / (1 << 20), (double)ext.io.bytesWritten / (1 << 20),
+			mb / (ext.runTime * 1e-3), mb / std::max(ext.io.ioTime * 1e-3, 1e-9), numDiff);
+		checkDiff(b, numDiff, 0, "external sweep");
+	}
+	if (f)
+		fclose(f);
+	remove("temp_elev.raw");
+	remove("temp_vis.bin");
+	free(sweepPacked);
+}
+
+/* Range-limited rays, work should drop with the square of the range. Past all corners the
+   range has to give the full DEM, shorter ones are compared with the GPU */
+static void benchRange(benchContext* b)
+{
+	GLViewshedEngine& engine = *b->engine;
+	double scale[2];
+	localPixelScale(&b->p, b->inW, b->inH, scale);
+	double fullRange = std::max(b->inW * scale[0], b->inH * scale[1]);
+	uint32_t* gpuRange = (uint32_t*)malloc(b->numWords * sizeof(uint32_t));
+	if (!gpuRange)
+		return;
+
+	CPUViewshedEngine rangeCpu;
+	rangeCpu.init(1);
+	b->store->loadWindow(&rangeCpu, 0, 0, b->inW, b->inH);
+	rangeCpu.run(&b->p);
+	double sphericalTime = rangeCpu.rayTime;
+	rangeCpu.localProjection = true;
+	rangeCpu.run(&b->p);
+	printf("Range rays, 1 thread: full DEM %f ms, local projection %f ms\n", sphericalTime, rangeCpu.rayTime);
+
+	for (int div = 0; div <= 16; div = div ? div * 2 : 2) {
+		rangeCpu.maxRange = div ? fullRange / div : 2 * fullRange;
+		rangeCpu.run(&b->p);
+		double localTime = rangeCpu.rayTime;
+		rangeCpu.localProjection = false;
+		rangeCpu.run(&b->p);
+		rangeCpu.readPacked(b->scratch);
+		rangeCpu.localProjection = true;
+		engine.maxRange = rangeCpu.maxRange;
+		engine.run(&b->p);
+		engine.readPacked(gpuRange);
+
+		viewshedRays rays;
+		rangeCpu.raySet(&b->p, &rays);
+		const unsigned int* box = rays.box;
+		size_t numDiff[2] = { countDiff(b->cpuPacked, b->scratch, b->numWords), countDiff(gpuRange, b->scratch, b->numWords) };
+		printf("  range %.0f m: %u rays, box %ux%u, %f ms, local projection %f ms, %zu cells differ from the full DEM, %zu from the GPU\n",
+			rangeCpu.maxRange, rays.numRays ? rays.numRays : 2 * (b->inW - 2) + 2 * b->inH, box[2] - box[0] + 1, box[3] - box[1] + 1,
+			rangeCpu.rayTime, localTime, numDiff[0], numDiff[1]);
+		if (div == 0)
+			checkDiff(b, numDiff[0], 0, "range past all corners against the full DEM");
+		checkDiff(b, numDiff[1], maxCells(b, modelTolerance), "range rays against the GPU");
+	}
+	engine.maxRange = 0;
+	free(gpuRange);
+}
+
+/* 60 degree sector to the south east against the full circle, then elevation limits, which only
+   ever hide cells of the full viewshed. A sector may differ from the full circle on one in a
+   hundred of its visible cells, next to its edges */
+static void benchSectorAndLimits(benchContext* b)
+{
+	GLViewshedEngine& engine = *b->engine;
+	const double deg = M_PI / 180;
+	uint32_t* fullPacked = (uint32_t*)malloc(b->numWords * sizeof(uint32_t));
+	uint32_t* gpuSector = (uint32_t*)malloc(b->numWords * sizeof(uint32_t));
+	if (fullPacked && gpuSector) {
+		CPUViewshedEngine rangeCpu;
+		rangeCpu.init(1);
+		b->store->loadWindow(&rangeCpu, 0, 0, b->inW, b->inH);
+		rangeCpu.localProjection = true;
+		rangeCpu.run(&b->p);
+		double fullTime = rangeCpu.rayTime;
+		rangeCpu.localProjection = false;
+		rangeCpu.run(&b->p);
+		rangeCpu.readPacked(fullPacked);
+		double fullSpherical = rangeCpu.rayTime;
+
+		rangeCpu.azimuthStart = engine.azimuthStart = 105 * deg;
+		rangeCpu.azimuthWidth = engine.azimuthWidth = 60 * deg;
+		rangeCpu.run(&b->p);
+		rangeCpu.readPacked(b->scratch);
+		double sectorSpherical = rangeCpu.rayTime;
+		rangeCpu.localProjection = true;
+		rangeCpu.run(&b->p);
+		double sectorTime = rangeCpu.rayTime;
+		engine.run(&b->p);
+		engine.readPacked(gpuSector);
+
+		/* Cells of the sector seen by the full circle too, within its 60 degrees */
+		const double* imgBounds = b->p.imgBounds;
+		double obsScale[2];
+		localPixelScale(&b->p, b->inW, b->inH, obsScale);
+		double ox = round((b->p.lon1 - imgBounds[1]) / (imgBounds[3] - imgBounds[1]) * b->inW);
+		double oy = round((b->p.lat1 - imgBounds[0]) / (imgBounds[2] - imgBounds[0]) * b->inH);
+		size_t numDiff[3] = { 0, 0, 0 }, numVisible = 0;
+		for (unsigned int y = 0; y < b->inH; y++) {
+			for (unsigned int x = 0; x < b->inW; x++) {
+				size_t w = (size_t)y * engine.wordsPerRow + x / 32;
+				int full = (fullPacked[w] >> (x % 32)) & 1, sector = (b->scratch[w] >> (x % 32)) & 1;
+				double az = atan2((x - ox) * obsScale[0], -(y - oy) * obsScale[1]);
+				if (az < 0)
+					az += 2 * M_PI;
+				bool inside = az > 106 * deg && az < 164 * deg;
+				numVisible += sector;
+				numDiff[0] += inside && full != sector;
+				numDiff[1] += !inside && sector && (az < 104 * deg || az > 166 * deg);
+			}
+		}
+		numDiff[2] = countDiff(b->scratch, gpuSector, b->numWords);
+		printf("Sector rays, 60 degrees, 1 thread: %f ms spherical (full circle %f ms), %f ms local projection (full circle %f ms), %zu visible, %zu cells inside differ from the full circle, %zu seen outside, %zu differ from the GPU\n",
+			sectorSpherical, fullSpherical, sectorTime, fullTime, numVisible, numDiff[0], numDiff[1], numDiff[2]);
+		checkDiff(b, numDiff[0], numVisible / 100, "sector inside against the full circle");
+		checkDiff(b, numDiff[1], numVisible / 100, "sector seen outside");
+		checkDiff(b, numDiff[2], maxCells(b, engineTolerance), "sector rays against the GPU");
+
+		rangeCpu.azimuthWidth = engine.azimuthWidth = 0;
+		rangeCpu.minElevation = engine.minElevation = -2 * deg;
+		rangeCpu.maxElevation = engine.maxElevation = 1 * deg;
+		rangeCpu.localProjection = false;
+		rangeCpu.run(&b->p);
+		rangeCpu.readPacked(b->scratch);
+		engine.run(&b->p);
+		engine.readPacked(gpuSector);
+		size_t numExtra = 0;
+		for (size_t i = 0; i < b->numWords; i++)
+			numExtra += popcount(b->scratch[i] & ~fullPacked[i]);
+		numVisible = countSet(b->scratch, b->numWords);
+		numDiff[1] = countDiff(b->scratch, gpuSector, b->numWords);
+		printf("Elevation limits -2 to 1 degrees: %zu visible, %zu not seen without limits, %zu differ from the GPU\n",
+			numVisible, numExtra, numDiff[1]);
+		checkDiff(b, numExtra, 0, "elevation limits seen without limits");
+		checkDiff(b, numDiff[1], maxCells(b, engineTolerance), "elevation limits against the GPU");
+		engine.minElevation = -M_PI / 2;
+		engine.maxElevation = M_PI / 2;
+	}
+	free(gpuSector);
+	free(fullPacked);
+}
+
+/* Total viewshed of a 128x128 window against the exact radial sweep at 16 of its cells */
+static void benchTotalViewshed(benchContext* b)
+{
+	const viewshedParams& p = b->p;
+	const unsigned int inW = b->inW, inH = b->inH;
+	if (inW < 128 || inH < 128)
+		return;
+
+	const unsigned int n = 128, x0 = inW / 2 - n / 2, y0 = inH / 2 - n / 2;
+	const double maxError = 0.03;	/* of the summed exact areas, 1.2% measured at 64 sectors */
+	float* window = (float*)malloc((size_t)n * n * sizeof(float));
+	float* area = (float*)malloc((size_t)n * n * sizeof(float));
+	size_t exactWords = (size_t)(n + 31) / 32 * n;
+	uint32_t* exactPacked = (uint32_t*)malloc(exactWords * sizeof(uint32_t));
+	for (unsigned int y = 0; window && y < n; y++)
+		memcpy(&window[(size_t)y * n], &b->elevData[(size_t)(y0 + y) * inW + x0], n * sizeof(float));
+
+	viewshedParams wp = p;
+	wp.imgBounds[0] = p.imgBounds[0] + (double)y0 / inH * (p.imgBounds[2] - p.imgBounds[0]);
+	wp.imgBounds[1] = p.imgBounds[1] + (double)x0 / inW * (p.imgBounds[3] - p.imgBounds[1]);
+	wp.imgBounds[2] = p.imgBounds[0] + (double)(y0 + n) / inH * (p.imgBounds[2] - p.imgBounds[0]);
+	wp.imgBounds[3] = p.imgBounds[1] + (double)(x0 + n) / inW * (p.imgBounds[3] - p.imgBounds[1]);
+	viewshedParams center = wp;
+	center.lat1 = 0.5 * (wp.imgBounds[0] + wp.imgBounds[2]);
+	double scale[2];
+	localPixelScale(&center, n, n, scale);
+
+	CPUViewshedEngine exactCpu;
+	exactCpu.init(0);
+	exactCpu.algorithm = CPU_RADIAL_SWEEP;
+	TotalViewshedEngine total;
+	total.init(0);
+	total.numSectors = 64;
+
+	int totalOk = window && area && exactPacked && exactCpu.setElevation(window, n, n) && total.setElevation(window, n, n) &&
+		total.run(&wp) && total.readArea(area);
+	check(b, totalOk != 0, "total viewshed run");
+	if (totalOk) {
+		double sumExact = 0, sumError = 0, maxRelError = 0;
+		for (int i = 0; i < 16; i++) {
+			unsigned int x = n / 8 + (i % 4) * n / 4, y = n / 8 + (i / 4) * n / 4;
+			viewshedParams q = wp;
+			q.lon1 = wp.imgBounds[1] + (double)x / n * (wp.imgBounds[3] - wp.imgBounds[1]);
+			q.lat1 = wp.imgBounds[0] + (double)y / n * (wp.imgBounds[2] - wp.imgBounds[0]);
+			exactCpu.run(&q);
+			exactCpu.readPacked(exactPacked);
+			double exact = countSet(exactPacked, exactWords) * scale[0] * scale[1], error = fabs(area[(size_t)y * n + x] - exact);
+			sumExact += exact;
+			sumError += error;
+			maxRelError = std::max(maxRelError, error / exact);
+		}
+		printf("Total viewshed, %ux%u, %u sectors: %f ms, %.2f%% error against the exact sweep at 16 cells (max %.2f%%), %s %.0f%%\n",
+			n, n, total.numSectors, total.runTime, 100 * sumError / sumExact, 100 * maxRelError,
+			sumError <= maxError * sumExact ? "within" : "OVER", 100 * maxError);
+		check(b, sumError <= maxError * sumExact, "total viewshed error");
+	}
+	free(exactPacked);
+	free(area);
+	free(window);
+
+	/* All of z10_512, at fewer sectors to keep the run short */
+	TotalViewshedEngine full;
+	full.init(0);
+	full.numSectors = 8;
+	float* fullArea = (float*)malloc((size_t)inW * inH * sizeof(float));
+	int fullOk = fullArea && full.setElevation(b->elevData, inW, inH) && full.run(&p) && full.readArea(fullArea);
+	check(b, fullOk != 0, "total viewshed of the whole DEM");
+	if (fullOk) {
+		double sumArea = 0;
+		for (size_t i = 0; i < (size_t)inW * inH; i++)
+			sumArea += fullArea[i];
+		printf("Total viewshed, all of z10_512 (%ux%u), %u sectors: %f ms, %.0f observers per second, mean visible area %.1f km2\n",
+			inW, inH, full.numSectors, full.runTime, (double)inW * inH / (full.runTime * 1e-3), sumArea / ((double)inW * inH) * 1e-6);
+	}
+	free(fullArea);
+}
+
+/* Accuracy gate for the trig-free kernels: reference against tangent comparison on several
+   DEMs, observers and altitudes, on both engines. The first cells that differ are listed, and
+   at most one in 100000 of all the cells compared may differ */
+static void benchTangentCompare(benchContext* b)
+{
+	const unsigned int inW = b->inW, inH = b->inH;
+	const float* elevData = b->elevData;
+	const char* demNames[4] = { "z10_512", "scaled x3", "flipped", "noisy" };
+	const double altitudes[3][2] = { { 2.0, 10.0 }, { 50.0, 0.0 }, { 500.0, 2.0 } };
+	GLfloat* demData = (GLfloat*)malloc((size_t)inW * (size_t)inH * sizeof(GLfloat));
+	uint32_t* refPacked = (uint32_t*)malloc(b->numWords * sizeof(uint32_t));
+
+	glViewshedOptions tanOptions;
+	tanOptions.tangentCompare = true;
+	GLViewshedEngine refEngine, tanEngine;
+	CPUViewshedEngine refCpu, tanCpu;
+	refCpu.init(0, SIMD_SCALAR);
+	tanCpu.init(0);
+	tanCpu.tangentCompare = true;
+
+	if (demData && refPacked && refEngine.init("./shaders/visibility.comp") && tanEngine.init("./shaders/visibility.comp", tanOptions)) {
+		viewshedParams q = b->p;
+		size_t gpuDiff = 0, cpuDiff = 0, numCells = 0;
+		double refTime[2] = { 0, 0 }, tanTime[2] = { 0, 0 };
+		int firstCells[2 * 4];
+
+		for (int dem = 0; dem < 4; dem++) {
+			srand(dem);
+			for (size_t ip = 0; ip < (size_t)inW * (size_t)inH; ip++) {
+				size_t x = ip % inW, y = ip / inW;
+				switch (dem) {
+				case 1: demData[ip] = 3.0f * elevData[ip]; break;
+				case 2: demData[ip] = elevData[(inH - 1 - y) * inW + (inW - 1 - x)]; break;
+				case 3: demData[ip] = elevData[ip] + 20.0f * ((float)rand() / RAND_MAX - 0.5f); break;
+				default: demData[ip] = elevData[ip]; break;
+				}
+			}
+			refEngine.setElevation(demData, inW, inH);
+			tanEngine.setElevation(demData, inW, inH);
+			refCpu.setElevation(demData, inW, inH);
+			tanCpu.setElevation(demData, inW, inH);
+
+			for (int obs = 0; obs < 9; obs++) {
+				for (int alt = 0; alt < 3; alt++) {
+					q.lat1 = b->p.imgBounds[0] + (0.2 + 0.3 * (obs / 3)) * (b->p.imgBounds[2] - b->p.imgBounds[0]);
+					q.lon1 = b->p.imgBounds[1] + (0.2 + 0.3 * (obs % 3)) * (b->p.imgBounds[3] - b->p.imgBounds[1]);
+					q.observerAltitude = altitudes[alt][0];
+					q.targetAltitude = altitudes[alt][1];
+					numCells += (size_t)inW * inH;
+
+					uint64_t start = tic();
+					refEngine.run(&q);
+					glFinish();
+					refTime[0] += toc(start);
+					start = tic();
+					tanEngine.run(&q);
+					glFinish();
+					tanTime[0] += toc(start);
+					refEngine.readPacked(refPacked);
+					tanEngine.readPacked(b->scratch);
+					size_t n = diffCells(refPacked, b->scratch, b->engine->wordsPerRow, inW, inH, firstCells, 4);
+					for (size_t i = 0; i < n && i < 4 && gpuDiff + i < 8; i++)
+						printf("  GPU %s, observer %d, altitude %g: cell (%d,%d) differs\n", demNames[dem], obs, q.observerAltitude, firstCells[2 * i], firstCells[2 * i + 1]);
+					gpuDiff += n;
+
+					refCpu.run(&q);
+					tanCpu.run(&q);
+					refTime[1] += refCpu.rayTime;
+					tanTime[1] += tanCpu.rayTime;
+					refCpu.readPacked(refPacked);
+					tanCpu.readPacked(b->scratch);
+					n = diffCells(refPacked, b->scratch, b->engine->wordsPerRow, inW, inH, firstCells, 4);
+					for (size_t i = 0; i < n && i < 4 && cpuDiff + i < 8; i++)
+						printf("  CPU %s, observer %d, altitude %g: cell (%d,%d) differs\n", demNames[dem], obs, q.observerAltitude, firstCells[2 * i], firstCells[2 * i + 1]);
+					cpuDiff += n;
+				}
+			}
+		}
+		printf("Tangent comparison, GPU: atan %f ms, tangent %f ms, %zu of %zu cells differ\n", refTime[0], tanTime[0], gpuDiff, numCells);
+		printf("Tangent comparison, CPU %s: scalar atan rays %f ms, tangent rays %f ms, %zu of %zu cells differ\n",
+			simdLevelName(tanCpu.simd), refTime[1], tanTime[1], cpuDiff, numCells);
+		checkDiff(b, gpuDiff, numCells / 100000, "GPU tangent comparison");
+		checkDiff(b, cpuDiff, numCells / 100000, "CPU tangent comparison");
+	}
+	refEngine.release();
+	tanEngine.release();
+	free(refPacked);
+	free(demData);
+}
+
 int main()
 {
 	contextInfo ci;
 	if (!startContext(&ci, 4, 3))
 		exit(EXIT_FAILURE);
 
-	gladLoadGL();
+	loadGLFunctions();
 	printf("OpenGL %d.%d\n", GLVersion.major, GLVersion.minor);
 
 
@@ -44,140 +1161,140 @@ int main()
 	glDebugMessageCallback((GLDEBUGPROC)glErrorCallback, 0);
 
 	/* Compile and link compute shaders */
-	GLuint propProg = glCreateProgram();
-	//shaderAttachFromFile(propProg, GL_COMPUTE_SHADER, "./shaders/propagation.comp");
-	//shaderAttachFromFile(propProg, GL_COMPUTE_SHADER, "./shaders/visibility.comp");
-	shaderAttachFromFile(propProg, GL_COMPUTE_SHADER, "./shaders/fft.comp");
-	glLinkProgram(propProg);
-
-	//GLuint coordProg = glCreateProgram();
-	//shaderAttachFromFile(coordProg, GL_COMPUTE_SHADER, "./shaders/coordinates.comp");
-	//glLinkProgram(coordProg);
-
-
-	/* Input elevation data: PNG -> Elevation */
-	unsigned int inW, inH;
-	GLubyte* inData;
-	lodepng_decode32_file(&inData, &inW, &inH, "./elevation/z13_2048.png");
-	
-	GLfloat* elevData = (GLfloat*)malloc((size_t)inW * (size_t)inH * sizeof(GLfloat));
-	for (size_t ip = 0; ip < (size_t)inW * (size_t)inH; ip++) {
-		//(red * 256 + green + blue / 256) - 32768
-		//elevData[ip] = ((GLfloat)inData[ip] * 256.0 + (GLfloat)inData[ip + (size_t)inW * (size_t)inH] + (GLfloat)inData[ip + (size_t)inW * (size_t)inH * 2] / 256.0) - 32768.0;
-		elevData[ip] = ((GLfloat)inData[ip * 4] * 256.0 + (GLfloat)inData[ip * 4 + 1] + (GLfloat)inData[ip * 4 + 2] / 256.0) - 32768.0;
-	}
-
-	/* Input data */
-
-	/* Elevation texture */
-	GLuint inElev;
-	glGenTextures(1, &inElev);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, inElev);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, inW, inH, 0, GL_RED, GL_FLOAT, elevData); /* note GL_R32F ensures that internally data values are not normalized */
-	glBindImageTexture(1, inElev, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32F);
-
-	/* Output image */
-	int tex_w = inW, tex_h = inH;
-	GLuint outTex;
-	glGenTextures(1, &outTex);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, outTex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, tex_w, tex_h, 0, GL_RED, GL_FLOAT, NULL);
-	glBindImageTexture(0, outTex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32F);
+	GLViewshedEngine engine;
+	if (!engine.init("./shaders/visibility.comp"))
+		exit(EXIT_FAILURE);
 
 	/* Setup uniforms */
-	glUseProgram(propProg);
-
-	double observerAltitude = 2.0;
-	double targetAltitude = 10.0;
-	double lat1 = 32.56 * M_PI / 180;
-	double lon1 = -117.25 * M_PI / 180;
-	double actualRadius = 6371.009; /* km */
-	double effectiveRadius = 4.0 / 3.0 * actualRadius;
+	viewshedParams p;
+	p.observerAltitude = 2.0;
+	p.targetAltitude = 10.0;
+	p.lat1 = 32.56 * M_PI / 180;
+	p.lon1 = -117.25 * M_PI / 180;
+	p.actualRadius = 6371.009; /* km */
+	p.effectiveRadius = 4.0 / 3.0 * p.actualRadius;
 	double imgBounds[4] = { 32.73212635384415 * M_PI / 180, -117.29277687517559 * M_PI / 180, 32.44374242183821 * M_PI / 180, -116.91606950256245 * M_PI / 180 };
+	for (int i = 0; i < 4; i++)
+		p.imgBounds[i] = imgBounds[i];
 
+	/* Input elevation data: PNG -> tile store -> Elevation */
+	TileStore store;
+	if (!TileStore::createFromTerrariumPNG("./elevation/z10_512.png", "temp_dem.tiles", 64, imgBounds) || !store.open("temp_dem.tiles", 64)) {
+		printf("Unable to convert elevation PNG\n");
+		exit(EXIT_FAILURE);
+	}
+	unsigned int inW = store.width, inH = store.height;
 
-	glUniform1f(glGetUniformLocation(propProg, "observerAltitude"), (GLfloat)observerAltitude);
-	glUniform1f(glGetUniformLocation(propProg, "targetAltitude"), (GLfloat)targetAltitude);
-	glUniform1f(glGetUniformLocation(propProg, "lat1"), (GLfloat)lat1);
-	glUniform1f(glGetUniformLocation(propProg, "lon1"), (GLfloat)lon1);
-	glUniform1f(glGetUniformLocation(propProg, "actualRadius"), (GLfloat)actualRadius);
-	glUniform1f(glGetUniformLocation(propProg, "effectiveRadius"), (GLfloat)effectiveRadius);
-	glUniform4f(glGetUniformLocation(propProg, "imgBounds"), (GLfloat)imgBounds[0], (GLfloat)imgBounds[1], (GLfloat)imgBounds[2], (GLfloat)imgBounds[3]);
-
-	glUniform2i(glGetUniformLocation(propProg, "imgSize"), (GLint)inH, (GLint)inW);
-	
-
-	/* Determining the Work Group Size */
-	//int work_grp_cnt[3];
-	//glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &work_grp_cnt[0]);
-	//glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 1, &work_grp_cnt[1]);
-	//glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 2, &work_grp_cnt[2]);
-	//printf("Max global (total) work group size x:%i y:%i z:%i\n", work_grp_cnt[0], work_grp_cnt[1], work_grp_cnt[2]);
-
-	//int work_grp_size[3];
-	//glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &work_grp_size[0]);
-	//glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 1, &work_grp_size[1]);
-	//glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 2, &work_grp_size[2]);
-	//printf("Max local (in one shader) work group sizes x:%i y:%i z:%i\n", work_grp_size[0], work_grp_size[1], work_grp_size[2]);
+	/* A 96x96 window around the observer only decodes the tiles it touches */
+	int obsX = (int)round((p.lon1 - imgBounds[1]) / (imgBounds[3] - imgBounds[1]) * inW);
+	int obsY = (int)round((p.lat1 - imgBounds[0]) / (imgBounds[2] - imgBounds[0]) * inH);
+	GLfloat* elevData = (GLfloat*)malloc((size_t)inW * (size_t)inH * sizeof(GLfloat));
+	store.prefetch(obsX, obsY, 48);
+	store.waitPrefetch();
+	store.readWindow(obsX - 48, obsY - 48, 96, 96, elevData);
+	printf("Tile store: 96x96 window at (%d,%d) touched %llu of %u tiles (%llu prefetched, %llu hits, %llu misses)\n",
+		obsX, obsY, (unsigned long long)(store.tilesPrefetched + store.tileMisses), store.tilesX * store.tilesY,
+		(unsigned long long)store.tilesPrefetched, (unsigned long long)store.tileHits, (unsigned long long)store.tileMisses);
 
-	//int work_grp_inv;
-	//glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &work_grp_inv);
-	//printf("Max local work group invocations %i\n", work_grp_inv);
+	/* Every engine loads the DEM tile by tile from the store. The host copy is only the
+	   reference of the file format checks, the source of the GeoTIFF, raw and windowed
+	   DEMs they write, and of the altered DEMs of the accuracy gate */
+	store.loadWindow(&engine, 0, 0, inW, inH);
+	store.readWindow(0, 0, inW, inH, elevData);
 
-	/* Setup job */
-	int numRays = 2 * (inW - 2) + 2 * inH;
+	benchContext b;
+	b.engine = &engine;
+	b.store = &store;
+	b.elevData = elevData;
+	b.inW = inW;
+	b.inH = inH;
+	b.obsX = obsX;
+	b.obsY = obsY;
+	b.numObservers = 16;
+	b.numWords = (size_t)engine.wordsPerRow * inH;
+	b.numChecks = b.numFailed = 0;
 
+	b.p = p;
+	benchPngDecode(&b);
 
 	PERFTIME_INIT
 	PERFTIME_START
 	{ // launch compute shaders!
-		glUseProgram(propProg);
-		glDispatchCompute(numRays, 1, 1);
+		engine.run(&p);
+		glFinish();
 	}
 	PERFTIME_END
 
-	// make sure writing to image has finished before read
-	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-
-	//glUniform1i(glGetUniformLocation(propProg, "procType"), 1);
-
-	//PERFTIME_START
-	//{ // launch compute shaders!
-	//	glUseProgram(propProg);
-	//	glDispatchCompute(360, 100, 1);
-	//}
-	//PERFTIME_END
-
-	//glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-
-
+	/* Many observers over the resident DEM, only uniforms change between runs */
+	PERFTIME_START
+	for (int i = 0; i < b.numObservers; i++) {
+		p.lon1 = (-117.25 + 0.01 * i) * M_PI / 180;
+		engine.run(&p);
+		glFinish();
+	}
+	PERFTIME_END
+	printf("%d observers, %f ms per observer including dispatch\n", b.numObservers, timeDifferenceInMilliseconds / b.numObservers);
 
-	//GLubyte* data = (GLubyte*)malloc((size_t)tex_w * (size_t)tex_h * sizeof(GLfloat));
-	GLubyte* data = (GLubyte*)malloc((size_t)tex_w * (size_t)tex_h);
+	GLubyte* data = (GLubyte*)malloc((size_t)inW * (size_t)inH);
+	unsigned error = 1;
 	if (data) {
-		//glReadPixels(0, 0, tex_w, tex_h, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, data);
-		//glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		//unsigned error = lodepng_encode32_file("temp.png", data, tex_w, tex_h);
-		unsigned error = lodepng_encode_file("temp.png", data, tex_w, tex_h, LCT_GREY, 8);
+		engine.readVisibility(data, false);
+		for (size_t ip = 0; ip < (size_t)inW * (size_t)inH; ip++)
+			data[ip] *= 255;
+		error = lodepng_encode_file("temp.png", data, inW, inH, LCT_GREY, 8);
+		if (error)
+			printf("temp.png: %s\n", lodepng_error_text(error));
 		free(data);
 	}
+	check(&b, error == 0, "temp.png write");
+
+	/* The last of the observers is the one of every benchmark */
+	b.p = p;
+	b.gpuPacked = (uint32_t*)malloc(b.numWords * sizeof(uint32_t));
+	b.cpuPacked = (uint32_t*)malloc(b.numWords * sizeof(uint32_t));
+	b.localPacked = (uint32_t*)malloc(b.numWords * sizeof(uint32_t));
+	b.scratch = (uint32_t*)malloc(b.numWords * sizeof(uint32_t));
+	if (b.gpuPacked && b.cpuPacked && b.localPacked && b.scratch) {
+		engine.readPacked(b.gpuPacked);
+		benchCpuKernels(&b);
+		benchThreadScaling(&b);
+		benchLocalSizes(&b);
+		benchOutputModes(&b);
+		benchElevationFormats(&b);
+		benchDemFiles(&b);
+		benchGeoTiff(&b);
+		benchRotationWaypoints(&b);
+		benchLocalProjection(&b);
+		benchTwoPass(&b);
+		benchBatched(&b);
+		benchCumulative(&b);
+		benchExactSweep(&b);
+		benchApproximations(&b);
+		benchBoundaryObservers(&b);
+		benchAdaptive(&b);
+		benchExternalSweep(&b);
+		benchRange(&b);
+		benchSectorAndLimits(&b);
+		benchTotalViewshed(&b);
+		benchTangentCompare(&b);
+	}
+	else
+		check(&b, false, "packed result buffers");
+	free(b.scratch);
+	free(b.localPacked);
+	free(b.cpuPacked);
+	free(b.gpuPacked);
+
+	if (b.numFailed)
+		printf("%d of %d checks failed\n", b.numFailed, b.numChecks);
+	else
+		printf("All %d checks passed\n", b.numChecks);
 
-	free(inData);
 	free(elevData);
+	store.close();
+	remove("temp_dem.tiles");
 
-	//glfwDestroyWindow(window);
-	//glfwTerminate();
+	engine.release();
 	stopContext(&ci);
-	exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+	exit(b.numFailed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
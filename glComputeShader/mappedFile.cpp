@@ -0,0 +1,91 @@
+#include "mappedFile.h"
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+	: data(NULL), size(0)
+#ifdef _WIN32
+	, fileHandle(NULL), mapHandle(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+/*
+* Maps all of path read only. Empty files cannot be mapped and fail
+* like missing ones.
+*/
+int MappedFile::open(const char* path)
+{
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		printf("MappedFile::open(): cannot open %s\n", path);
+		return 0;
+	}
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	HANDLE mapping = fileSize.QuadPart > 0 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (view == NULL) {
+		printf("MappedFile::open(): cannot map %s\n", path);
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return 0;
+	}
+	fileHandle = file;
+	mapHandle = mapping;
+	size = (size_t)fileSize.QuadPart;
+#else
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("MappedFile::open(): cannot open %s\n", path);
+		return 0;
+	}
+	struct stat st;
+	void* view = fstat(fd, &st) == 0 && st.st_size > 0 ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	::close(fd);
+	if (view == MAP_FAILED) {
+		printf("MappedFile::open(): cannot map %s\n", path);
+		return 0;
+	}
+	size = (size_t)st.st_size;
+#endif
+	data = (const uint8_t*)view;
+	return 1;
+}
+
+void MappedFile::close()
+{
+	if (data == NULL)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+	CloseHandle(mapHandle);
+	CloseHandle(fileHandle);
+	mapHandle = fileHandle = NULL;
+#else
+	munmap((void*)data, size);
+#endif
+	data = NULL;
+	size = 0;
+}
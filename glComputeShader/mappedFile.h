@@ -0,0 +1,43 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+* Read only memory mapping of a whole file, CreateFileMapping on
+* Windows and mmap elsewhere. Pages are loaded as they are read, the
+* tile store, DEM file and GeoTIFF readers parse the file in place.
+*/
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	int open(const char* path);
+	void close();
+
+	const uint8_t* data;		/* NULL when no file is mapped */
+	size_t size;				/* in bytes */
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+#ifdef _WIN32
+	void* fileHandle;
+	void* mapHandle;
+#endif
+};
+
+/* Byte order of the host, file formats here are read in place on little endian hosts */
+inline bool hostLittleEndian()
+{
+	const uint16_t one = 1;
+	uint8_t low;
+	memcpy(&low, &one, 1);
+	return low == 1;
+}
+
+#endif // !MAPPEDFILE_H
@@ -1,6 +1,7 @@
 /* */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "gl/glad.h"
 #include "context.h"
@@ -8,6 +9,9 @@
 #include "linmath.h"
 
 #include "shader.h"
+#include "timer.h"
+#include "viewshedGL.h"
+#include "geoTiff.h"
 
 #include "mex.h"
 #include "matrix.h"
@@ -28,28 +32,9 @@
 // #endif
 
 
-#ifdef _WIN32
-#include <windows.h>
-uint64_t tic() {
-    uint64_t startTime;
-    QueryPerformanceCounter((LARGE_INTEGER *)&startTime);
-    return startTime;
-}
-double toc(uint64_t startTime) {
-    uint64_t freq, endTime;
-    QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
-    QueryPerformanceCounter((LARGE_INTEGER *)&endTime);
-    double timerFrequency = (1.0/freq);
-    double timeDifferenceInMilliseconds = ((endTime-startTime) * timerFrequency);
-    return timeDifferenceInMilliseconds;
-}
-
 uint64_t globalStartTime;
 void ticg() { globalStartTime = tic(); }
 double tocg() { return toc(globalStartTime); }
-#else
-#endif
-
 
 
 #ifdef _TIMING
@@ -64,6 +49,9 @@ double tocg() { return toc(globalStartTime); }
 /* Global variable */
 bool isInit = false;
 contextInfo ci;
+GLViewshedEngine* engine = NULL;
+bool haveFileBounds = false;   /* bounds of the resident DEM from its GeoTIFF, in degrees */
+double fileBounds[4];
 
 /* Inputs */
 #define IN_Z        prhs[0]
@@ -74,15 +62,12 @@ contextInfo ci;
 #define IN_TGT      prhs[5]
 #define IN_RE       prhs[6]
 #define IN_REEFF    prhs[7]
+#define IN_MODE     prhs[8]
 
 /* Outputs */
 #define OUT_VIS     plhs[0]
 
 
-#define FMAX(a,b) ((a>b)?(a):(b))
-#define FMIN(a,b) ((a<b)?(a):(b))
-
-
 
 void mprintf(const char* format, ...)
 {
@@ -102,6 +87,8 @@ static void closeContext(void)
 {
     mprintf("mexViewshed: stopping context...\n");
     pollEvents();
+    delete engine;
+    engine = NULL;
 	stopContext(&ci);
     pollEvents();
     isInit = false;
@@ -114,7 +101,10 @@ void glErrorCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLs
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
-    bool firstTime = false;
+    if (nrhs<8) {
+        mexErrMsgIdAndTxt("mexViewshed:nrhs","Need eight input arguments");
+    }
+
 	if (!isInit) {
         mprintf("mexViewshed: starting context...\n");
         mexAtExit(closeContext);
@@ -123,153 +113,189 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
             return;
         }
         isInit = true;
-        firstTime = true;
-    }
-    
-    if (nrhs<8) {
-        mexErrMsgIdAndTxt("mexViewshed:nrhs","Need eight input arguments");
+
+        loadGLFunctions();
+        mprintf("mexViewshed: OpenGL %d.%d\n", GLVersion.major, GLVersion.minor);
+
+        /* Enable openGL error logging */
+        glEnable(GL_DEBUG_OUTPUT);
+        glDebugMessageCallback((GLDEBUGPROC)glErrorCallback, 0);
+
+        /* Compile and link compute shaders once, the engine keeps them resident */
+        TIC();
+        engine = new GLViewshedEngine();
+        if (!engine->init("../shaders/visibility.comp")) {
+            closeContext();
+            mexErrMsgIdAndTxt("mexViewshed:init","Unable to build visibility compute shader");
+        }
+        TOC("Compile compute shader");
     }
-    
+
     pollEvents();
 
-	gladLoadGL();
-    if (firstTime)
-        mprintf("mexViewshed: OpenGL %d.%d\n", GLVersion.major, GLVersion.minor);
+	/* Input elevation data, Z may name a GeoTIFF, an empty Z reuses the DEM resident from the previous call */
+    if (mxIsChar(IN_Z)) {
+        TIC();
+        char path[4096];
+        GeoTiff tiff;
+        if (mxGetString(IN_Z, path, sizeof(path)) != 0 || !tiff.open(path)) {
+            mexErrMsgIdAndTxt("mexViewshed:elevation","Unable to open GeoTIFF");
+        }
+        if (!tiff.loadWindow(engine, 0, 0, tiff.width, tiff.height)) {
+            mexErrMsgIdAndTxt("mexViewshed:elevation","Unable to upload altitude raster");
+        }
+        haveFileBounds = tiff.georeferenced;
+        for (int k = 0; k < 4; k++)
+            fileBounds[k] = tiff.imgBounds[k] * 180 / M_PI;
+        TOC("Read and upload GeoTIFF");
+    }
+    else if (!mxIsEmpty(IN_Z)) {
+        TIC();
+        unsigned int inW = mxGetN(IN_Z);
+        unsigned int inH = mxGetM(IN_Z);
+        double *inPtr = mxGetPr(IN_Z);
+
+        GLfloat* elevData = (GLfloat*)malloc((size_t)inW * inH * sizeof(GLfloat));
+        for (size_t ix = 0; ix < inW; ix++) {
+            for (size_t iy = 0; iy < inH; iy++) {
+                elevData[iy*inW+ix] = (GLfloat)inPtr[ix*inH+iy];
+            }
+        }
 
-	/* Enable openGL error logging */
-	glEnable(GL_DEBUG_OUTPUT);
-	glDebugMessageCallback((GLDEBUGPROC)glErrorCallback, 0);
-
-	/* Compile and link compute shaders */
-	GLuint propProg = glCreateProgram();
-	shaderAttachFromFile(propProg, GL_COMPUTE_SHADER, "../shaders/visibility.comp");
-    //shaderAttachFromFile(propProg, GL_COMPUTE_SHADER, "../shaders/simple.comp");
-    glLinkProgram(propProg);
-
-	/* Input elevation data */
-	unsigned int inW = mxGetN(IN_Z);
-    unsigned int inH = mxGetM(IN_Z);
-    double *inPtr = mxGetPr(IN_Z);
-	
-	GLfloat* elevData = (GLfloat*)malloc(inW * inH * sizeof(GLfloat));
-    for (size_t ix = 0; ix < inW; ix++) {
-        for (size_t iy = 0; iy < inH; iy++) {
-            elevData[iy*inW+ix] = (GLfloat)inPtr[ix*inH+iy];
+        int status = engine->setElevation(elevData, inW, inH);
+        free(elevData);
+        haveFileBounds = false;
+        if (!status) {
+            mexErrMsgIdAndTxt("mexViewshed:elevation","Unable to upload altitude raster");
         }
+        TOC("Upload altitude raster");
     }
-    
-    unsigned int outW = pow(2,ceil(log2(inW)))/32;
-    unsigned int outH = pow(2,ceil(log2(inH)));
-
-	/* Input data */
-
-	/* Elevation texture */
-	GLuint inElev;
-	glGenTextures(1, &inElev);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, inElev);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, inW, inH, 0, GL_RED, GL_FLOAT, elevData); /* note GL_R32F ensures that internally data values are not normalized */
-	glBindImageTexture(1, inElev, 0, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
-
-	/* Output image */
-	GLuint outTex;
-	glGenTextures(1, &outTex);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, outTex);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, outW, outH, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
-	glBindImageTexture(0, outTex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
-    GLuint clearColor[1] = {0};
-    glClearTexImage(outTex, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, &clearColor);
-
-
-	/* Setup uniforms */
-	glUseProgram(propProg);
-
-	double observerAltitude = mxGetScalar(IN_OBS);
-	double targetAltitude   = mxGetScalar(IN_TGT);
-	double lat1             = mxGetScalar(IN_LAT1) * M_PI / 180;
-	double lon1             = mxGetScalar(IN_LON1) * M_PI / 180;
-	double actualRadius     = mxGetScalar(IN_RE); /* km */
-	double effectiveRadius  = mxGetScalar(IN_REEFF);
-    
-    double *imgBoundsPtr    = mxGetPr(IN_R);
-	double imgBounds[4]     = { imgBoundsPtr[0] * M_PI / 180, imgBoundsPtr[1] * M_PI / 180, imgBoundsPtr[2] * M_PI / 180, imgBoundsPtr[3] * M_PI / 180 };
-    
-    if (lat1>FMAX(imgBounds[0],imgBounds[2]) || lat1<FMIN(imgBounds[0],imgBounds[2]) || 
-            lon1>FMAX(imgBounds[1],imgBounds[3]) || lon1<FMIN(imgBounds[1],imgBounds[3])) {
-        mexErrMsgIdAndTxt("mexViewshed:nrhs","Observer location is outside defined altitude raster");
+    else if (engine->width == 0) {
+        mexErrMsgIdAndTxt("mexViewshed:elevation","No altitude raster has been uploaded yet");
     }
 
+	/* Setup uniforms, lat1 and lon1 may be vectors of N observers */
+    size_t numObservers = mxGetNumberOfElements(IN_LAT1);
+    if (numObservers == 0 || mxGetNumberOfElements(IN_LON1) != numObservers) {
+        mexErrMsgIdAndTxt("mexViewshed:nrhs","lat1 and lon1 must have the same number of elements");
+    }
+    size_t numObsAlt = mxGetNumberOfElements(IN_OBS);
+    size_t numTgtAlt = mxGetNumberOfElements(IN_TGT);
+    if ((numObsAlt != 1 && numObsAlt != numObservers) || (numTgtAlt != 1 && numTgtAlt != numObservers)) {
+        mexErrMsgIdAndTxt("mexViewshed:nrhs","obsAlt and tgtAlt must be scalars or have one element per observer");
+    }
+
+    double *lat1Ptr         = mxGetPr(IN_LAT1);
+    double *lon1Ptr         = mxGetPr(IN_LON1);
+    double *obsPtr          = mxGetPr(IN_OBS);
+    double *tgtPtr          = mxGetPr(IN_TGT);
+
+    /* An empty R takes the bounds of the GeoTIFF */
+    const double *imgBoundsPtr = fileBounds;
+    if (!mxIsEmpty(IN_R)) {
+        if (mxGetNumberOfElements(IN_R) != 4) {
+            mexErrMsgIdAndTxt("mexViewshed:nrhs","R must have four elements");
+        }
+        imgBoundsPtr = mxGetPr(IN_R);
+    }
+    else if (!haveFileBounds) {
+        mexErrMsgIdAndTxt("mexViewshed:nrhs","R may only be empty for a GeoTIFF in geographic coordinates");
+    }
 
-	glUniform1f(glGetUniformLocation(propProg, "observerAltitude"), (GLfloat)observerAltitude);
-	glUniform1f(glGetUniformLocation(propProg, "targetAltitude"), (GLfloat)targetAltitude);
-	glUniform1f(glGetUniformLocation(propProg, "lat1"), (GLfloat)lat1);
-	glUniform1f(glGetUniformLocation(propProg, "lon1"), (GLfloat)lon1);
-	glUniform1f(glGetUniformLocation(propProg, "actualRadius"), (GLfloat)actualRadius);
-	glUniform1f(glGetUniformLocation(propProg, "effectiveRadius"), (GLfloat)effectiveRadius);
-	glUniform4f(glGetUniformLocation(propProg, "imgBounds"), (GLfloat)imgBounds[0], (GLfloat)imgBounds[1], (GLfloat)imgBounds[2], (GLfloat)imgBounds[3]);
-
-	glUniform2i(glGetUniformLocation(propProg, "imgSize"), (GLint)inH, (GLint)inW);
-	
-
-	/* Determining the Work Group Size */
-    // int work_grp_cnt[3];
-    // glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &work_grp_cnt[0]);
-    // glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 1, &work_grp_cnt[1]);
-    // glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 2, &work_grp_cnt[2]);
-    // mprintf("Max global (total) work group size x:%i y:%i z:%i\n", work_grp_cnt[0], work_grp_cnt[1], work_grp_cnt[2]);
-    // 
-    // int work_grp_size[3];
-    // glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &work_grp_size[0]);
-    // glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 1, &work_grp_size[1]);
-    // glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 2, &work_grp_size[2]);
-    // mprintf("Max local (in one shader) work group sizes x:%i y:%i z:%i\n", work_grp_size[0], work_grp_size[1], work_grp_size[2]);
-    // 
-    // int work_grp_inv;
-    // glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &work_grp_inv);
-    // mprintf("Max local work group invocations %i\n", work_grp_inv);
-
-	/* Setup job */
-	int numRays = 2 * (inW - 2) + 2 * inH;
-
-
-	TIC();
- 	{ // Launch compute shaders!
- 		glUseProgram(propProg);
- 		glDispatchCompute(numRays, 1, 1);
- 	}
-    
-	// Make sure writing to image has finished before read
-	glMemoryBarrier(GL_ALL_BARRIER_BITS);
-    TOC("Compute shader");
-
-    {
+    viewshedParams* p = (viewshedParams*)mxMalloc(numObservers * sizeof(viewshedParams));
+    for (size_t i = 0; i < numObservers; i++) {
+        p[i].observerAltitude   = obsPtr[numObsAlt == 1 ? 0 : i];
+        p[i].targetAltitude     = tgtPtr[numTgtAlt == 1 ? 0 : i];
+        p[i].lat1               = lat1Ptr[i] * M_PI / 180;
+        p[i].lon1               = lon1Ptr[i] * M_PI / 180;
+        p[i].actualRadius       = mxGetScalar(IN_RE); /* km */
+        p[i].effectiveRadius    = mxGetScalar(IN_REEFF);
+        for (int k = 0; k < 4; k++)
+            p[i].imgBounds[k] = imgBoundsPtr[k] * M_PI / 180;
+
+        if (!observerInBounds(&p[i])) {
+            mxFree(p);
+            mexErrMsgIdAndTxt("mexViewshed:nrhs","Observer location is outside defined altitude raster");
+        }
+    }
+
+    /* Optional 'count' mode, one cumulative count raster over all observers */
+    bool countMode = false;
+    if (nrhs > 8) {
+        char mode[16];
+        if (!mxIsChar(IN_MODE) || mxGetString(IN_MODE, mode, sizeof(mode)) != 0 || strcmp(mode, "count") != 0) {
+            mxFree(p);
+            mexErrMsgIdAndTxt("mexViewshed:nrhs","Mode must be 'count'");
+        }
+        countMode = true;
+    }
+
+    if (countMode) {
         TIC();
-        GLuint* gldata  = (GLuint*)malloc(outW * outH * sizeof(GLuint));
-        OUT_VIS         = mxCreateNumericMatrix(inH, inW, mxUINT8_CLASS, mxREAL);
+        if (!engine->runCumulative(p, (unsigned int)numObservers)) {
+            mxFree(p);
+            mexErrMsgIdAndTxt("mexViewshed:count","Unable to run cumulative viewshed");
+        }
+        TOC("Compute shader, cumulative");
+
+        TIC();
+        OUT_VIS         = mxCreateNumericMatrix(engine->height, engine->width, mxUINT32_CLASS, mxREAL);
+        uint32_t* data  = (uint32_t*)mxGetData(OUT_VIS);
+        uint32_t* count = (uint32_t*)mxMalloc((size_t)engine->width * engine->height * sizeof(uint32_t));
+        engine->readCount(count);
+        for (size_t ix = 0; ix < engine->width; ix++) {
+            for (size_t iy = 0; iy < engine->height; iy++) {
+                data[ix*engine->height+iy] = count[iy*engine->width+ix];
+            }
+        }
+        mxFree(count);
+        TOC("Transfer count texture");
+    }
+    else if (numObservers == 1) {
+        TIC();
+        engine->run(p);
+        // Make sure writing to image has finished before read
+        glMemoryBarrier(GL_ALL_BARRIER_BITS);
+        TOC("Compute shader");
+
+        TIC();
+        OUT_VIS         = mxCreateNumericMatrix(engine->height, engine->width, mxUINT8_CLASS, mxREAL);
         GLubyte* data   = (GLubyte*)mxGetData(OUT_VIS);
         if (data) {
-            glGetTextureImage(outTex, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, outW * outH * sizeof(GLuint), gldata);
-            
-            for (size_t ix = 0; ix < inW; ix++) {
-                for (size_t iy = 0; iy < inH; iy++) {
-                    data[ix*inH+iy] = (gldata[iy*inW/32+ix/32] >> (ix%32)) & 1;
-                }
-            }
+            engine->readVisibility(data, true);
         }
-        free(gldata);
         TOC("Transfer visibility texture");
     }
-    
-	free(elevData);
+    else {
+        /* H x W x N output, observers go to the GPU maxBatch at a time */
+        mwSize dims[3] = { engine->height, engine->width, numObservers };
+        OUT_VIS         = mxCreateNumericArray(3, dims, mxUINT8_CLASS, mxREAL);
+        GLubyte* data   = (GLubyte*)mxGetData(OUT_VIS);
+        size_t layerWords   = (size_t)engine->wordsPerRow * engine->height;
+        size_t layerCells   = (size_t)engine->width * engine->height;
+        size_t chunk        = numObservers < engine->maxBatch ? numObservers : engine->maxBatch;
+        uint32_t* packed    = (uint32_t*)mxMalloc(chunk * layerWords * sizeof(uint32_t));
+
+        for (size_t first = 0; first < numObservers; first += chunk) {
+            unsigned int n = (unsigned int)(numObservers - first < chunk ? numObservers - first : chunk);
+
+            TIC();
+            if (!engine->runBatch(p + first, n)) {
+                mxFree(packed);
+                mxFree(p);
+                mexErrMsgIdAndTxt("mexViewshed:batch","Unable to run observer batch");
+            }
+            TOC("Compute shader, batch");
+
+            TIC();
+            engine->readPackedBatch(packed);
+            for (unsigned int i = 0; i < n; i++)
+                unpackVisibility(packed + i * layerWords, engine->width, engine->height, data + (first + i) * layerCells, true);
+            TOC("Transfer visibility texture, batch");
+        }
+        mxFree(packed);
+    }
+    mxFree(p);
 
 	return;
-}
\ No newline at end of file
+}
@@ -1,7 +1,25 @@
-function vis = mexViewshed(Z,R,lat1,lon1,obsAlt,tgtAlt,re,reEff)
+function vis = mexViewshed(Z,R,lat1,lon1,obsAlt,tgtAlt,re,reEff,mode)
 %
+%   The compute shader and the altitude raster stay resident on the GPU
+%   between calls. Pass Z = [] to reuse the raster from the previous call.
 %
+%   Z may also be the path of a tiled or stripped GeoTIFF, read without
+%   conversion. R = [] then takes the bounds from its georeferencing.
+%
+%   lat1 and lon1 may be vectors of N observers, obsAlt and tgtAlt then
+%   are scalars or vectors of N. All observers run in one dispatch and
+%   vis is H x W x N.
+%
+%   mexViewshed(...,'count') returns instead an H x W uint32 raster of
+%   how many of the observers see each cell, accumulated on the GPU.
 %
 
-mex mexViewshed.cpp ../context.cpp ../shader.cpp ../gl/glad.c -I.. -lopengl32
+src = {'../context.cpp', '../contextEGL.cpp', '../shader.cpp', '../viewshed.cpp', ...
+       '../viewshedGL.cpp', '../viewshedCPU.cpp', '../viewshedSSE4.cpp', '../viewshedAVX2.cpp', ...
+       '../viewshedAVX512.cpp', '../viewshedSweep.cpp', '../viewshedXDraw.cpp', '../viewshedRefPlane.cpp', '../viewshedAdaptive.cpp', '../geoTiff.cpp', '../lodepng.cpp', '../threadpool.cpp', '../gl/glad.c'};
 
+if ispc
+    mex('mexViewshed.cpp', src{:}, '-I..', '-lopengl32');
+else
+    mex('mexViewshed.cpp', src{:}, '-I..', '-lEGL', '-ldl', '-lpthread');
+end
@@ -5,6 +5,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+static char* loadTextFile(const char* filePath);
+static char* expandIncludes(char* source, const char* filePath, int depth);
+static GLuint shaderCompileFromFile(GLenum type, const char* filePath, const char* defines);
+
 /*
 * Returns a string containing the text in
 * a vertex/fragment shader source file.
@@ -18,7 +22,12 @@ static char* loadTextFile(const char* filePath)
 	size_t tmp, sourceLength = 0;
 
 	/* open file */
+#ifdef _MSC_VER
 	errno_t err = fopen_s(&fp, filePath, "r");
+#else
+	fp = fopen(filePath, "r");
+	int err = (fp == NULL);
+#endif
 	if (err != 0) {
 		printf("loadTextFile(): Unable to open %s for reading\n", filePath);
 		return NULL;
@@ -52,11 +61,78 @@ static char* loadTextFile(const char* filePath)
 	return source;
 }
 
+/*
+* Replaces #include "file" lines with the contents of file,
+* relative to the directory of filePath. GLSL has no #include,
+* this lets shaders share code with each other and the host.
+*/
+static char* expandIncludes(char* source, const char* filePath, int depth)
+{
+	char* inc = strstr(source, "#include \"");
+	if (!inc)
+		return source;
+
+	if (depth > 4) {
+		printf("expandIncludes(): #include nested too deep in %s\n", filePath);
+		free(source);
+		return NULL;
+	}
+
+	char* name = inc + strlen("#include \"");
+	char* nameEnd = strchr(name, '"');
+	if (!nameEnd) {
+		printf("expandIncludes(): malformed #include in %s\n", filePath);
+		free(source);
+		return NULL;
+	}
+
+	/* path of the included file */
+	const char* slash = strrchr(filePath, '/');
+	const char* backslash = strrchr(filePath, '\\');
+	if (backslash > slash) slash = backslash;
+	size_t dirLength = slash ? (size_t)(slash - filePath + 1) : 0;
+	size_t nameLength = (size_t)(nameEnd - name);
+	char* incPath = (char*)malloc(dirLength + nameLength + 1);
+	if (!incPath) {
+		free(source);
+		return NULL;
+	}
+	memcpy(incPath, filePath, dirLength);
+	memcpy(incPath + dirLength, name, nameLength);
+	incPath[dirLength + nameLength] = '\0';
+
+	char* incSource = loadTextFile(incPath);
+	if (incSource)
+		incSource = expandIncludes(incSource, incPath, depth + 1);
+	free(incPath);
+	if (!incSource) {
+		free(source);
+		return NULL;
+	}
+
+	/* splice, the rest of the #include line is dropped */
+	char* lineEnd = strchr(nameEnd, '\n');
+	const char* tail = lineEnd ? lineEnd : "";
+	size_t headLength = (size_t)(inc - source);
+	size_t incLength = strlen(incSource);
+	char* result = (char*)malloc(headLength + incLength + strlen(tail) + 1);
+	if (result) {
+		memcpy(result, source, headLength);
+		memcpy(result + headLength, incSource, incLength);
+		strcpy(result + headLength + incLength, tail);
+	}
+	free(incSource);
+	free(source);
+
+	return result ? expandIncludes(result, filePath, depth) : NULL;
+}
+
 /*
 * Returns a shader object containing a shader
-* compiled from the given GLSL shader file.
+* compiled from the given GLSL shader file. The
+* optional defines are inserted after #version.
 */
-static GLuint shaderCompileFromFile(GLenum type, const char* filePath)
+static GLuint shaderCompileFromFile(GLenum type, const char* filePath, const char* defines)
 {
 	char* source;
 	GLuint shader;
@@ -64,15 +140,31 @@ static GLuint shaderCompileFromFile(GLenum type, const char* filePath)
 
 	/* get shader source */
 	source = loadTextFile(filePath);
+	if (source)
+		source = expandIncludes(source, filePath, 0);
 	if (!source) {
 		printf("shaderCompileFromFile(): Unable to load %s\n", filePath);
 		return 0;
 	}
 
+	/* split after the #version line, it has to stay first */
+	const char* strings[3];
+	GLint lengths[3];
+	char* body = source;
+	if (strncmp(source, "#version", 8) == 0) {
+		char* eol = strchr(source, '\n');
+		body = eol ? eol + 1 : source + strlen(source);
+	}
+	strings[0] = source;
+	lengths[0] = (GLint)(body - source);
+	strings[1] = defines ? defines : "";
+	lengths[1] = (GLint)strlen(strings[1]);
+	strings[2] = body;
+	lengths[2] = (GLint)strlen(body);
+
 	/* create shader object, set the source, and compile */
 	shader = glCreateShader(type);
-	length = strlen(source);
-	glShaderSource(shader, 1, (const char**)&source, &length);
+	glShaderSource(shader, 3, strings, lengths);
 	glCompileShader(shader);
 	free(source);
 
@@ -102,9 +194,19 @@ static GLuint shaderCompileFromFile(GLenum type, const char* filePath)
 * given type to the given program object.
 */
 void shaderAttachFromFile(GLuint program, GLenum type, const char* filePath)
+{
+	shaderAttachFromFileWithDefines(program, type, filePath, NULL);
+}
+
+/*
+* Same as shaderAttachFromFile(), with preprocessor
+* lines (e.g. "#define LOCAL_SIZE_X 64\n") inserted
+* right after the #version directive.
+*/
+void shaderAttachFromFileWithDefines(GLuint program, GLenum type, const char* filePath, const char* defines)
 {
 	/* compile the shader */
-	GLuint shader = shaderCompileFromFile(type, filePath);
+	GLuint shader = shaderCompileFromFile(type, filePath, defines);
 	if (shader != 0) {
 		/* attach the shader to the program */
 		glAttachShader(program, shader);
@@ -117,4 +219,31 @@ void shaderAttachFromFile(GLuint program, GLenum type, const char* filePath)
 	else {
 		printf("shaderCompileFromFile(): did not return a valid shader program id\n");
 	}
-}
\ No newline at end of file
+}
+
+/*
+* Links the given program object and prints
+* the info log if linking failed.
+*/
+int shaderLinkProgram(GLuint program)
+{
+	GLint length, result;
+
+	glLinkProgram(program);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &result);
+	if (result == GL_FALSE) {
+		char* log;
+
+		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+		log = (char*)malloc(length + 1);
+		log[0] = '\0';
+		glGetProgramInfoLog(program, length, &result, log);
+
+		printf("shaderLinkProgram(): Unable to link program: %s\n", log);
+		free(log);
+		return 0;
+	}
+
+	return 1;
+}
@@ -7,8 +7,8 @@
 #include "mex.h"
 #endif
 
-static char* loadTextFile(const char* filePath);
-static GLuint shaderCompileFromFile(GLenum type, const char* filePath);
 void shaderAttachFromFile(GLuint program, GLenum type, const char* filePath);
+void shaderAttachFromFileWithDefines(GLuint program, GLenum type, const char* filePath, const char* defines);
+int shaderLinkProgram(GLuint program);
 
 #endif
\ No newline at end of file
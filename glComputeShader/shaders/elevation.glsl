@@ -0,0 +1,22 @@
+// Elevation texture, the host overrides ELEVATION_MODE with a #define after #version
+//   0: R32F image, imageLoad
+//   1: R16UI texture, texelFetch, meters = value * elevationQuant.x + elevationQuant.y
+//   2: R16F texture, texelFetch, same scale and offset
+// The 16-bit formats halve the bytes read per step and go through the texture cache.
+
+#ifndef ELEVATION_MODE
+#define ELEVATION_MODE 0
+#endif
+
+#if ELEVATION_MODE == 0
+layout(r32f, binding = 1) readonly uniform image2D elData;
+#define elevationAt(p) imageLoad(elData, p).x
+#else
+#if ELEVATION_MODE == 1
+layout(binding = 1) uniform usampler2D elData;
+#else
+layout(binding = 1) uniform sampler2D elData;
+#endif
+uniform vec2 elevationQuant; /* scale and offset to meters */
+#define elevationAt(p) (float(texelFetch(elData, p, 0).x) * elevationQuant.x + elevationQuant.y)
+#endif
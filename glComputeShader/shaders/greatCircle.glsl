@@ -0,0 +1,87 @@
+// Great-circle track generator shared by visibility.comp and the host code
+// (greatCircle.h). Keep it to the common subset of GLSL and C++: the host
+// provides vec3 and the GLSL built-ins used here, GC_FUNC and GC_INOUT
+// expand to nothing/inout in GLSL and to static inline/references in C++.
+//
+// Way point k is p1*cos(k*step) + t1*sin(k*step), with t1 the unit tangent
+// of the track at the start point. cos and sin of k*step come from the
+// angle addition recurrence, so each step is a few multiply-adds instead of
+// two sines per way point. The recurrence runs on 1-cos and sin, which stay
+// small on short tracks and keep their relative precision in float, and is
+// re-anchored with a direct evaluation every GC_RENORM steps to bound drift.
+
+#ifndef GC_FUNC
+#define GC_FUNC
+#define GC_INOUT(T) inout T
+#endif
+
+#define GC_RENORM 16
+
+struct gcTrack {
+	vec3 p1;		// start point, unit vector
+	vec3 t1;		// unit tangent along the track at p1
+	vec3 p;			// current way point, unit vector
+	float v, s;		// 1-cos and sin of the step angle
+	float vk, sk;	// 1-cos and sin of the current angle
+	float step;		// step angle, in radians
+	int k;			// current step
+};
+
+// Unit vector of a lat,lon position (radians)
+GC_FUNC vec3 gcUnitVector(float lat, float lon) {
+	return vec3(cos(lat) * cos(lon), cos(lat) * sin(lon), sin(lat));
+}
+
+// Track from (lat1,lon1) towards (lat2,lon2), d is the distance between
+// both points in radians, each gcNext() advances the track by d/numSteps
+GC_FUNC gcTrack gcInit(float lat1, float lon1, float lat2, float lon2, float d, int numSteps) {
+	gcTrack g;
+	g.p1 = gcUnitVector(lat1, lon1);
+	g.p = g.p1;
+
+	// Component of the endpoint orthogonal to the start point
+	vec3 q = gcUnitVector(lat2, lon2);
+	q = q - dot(q, g.p1) * g.p1;
+	float len = length(q);
+	g.t1 = len > 0.0f ? q / len : vec3(0.0f, 0.0f, 0.0f);
+
+	// 1-cos as 2sin^2(a/2), cos itself rounds to 1 for short steps
+	g.step = d / float(numSteps);
+	float h = sin(0.5f * g.step);
+	g.v = 2.0f * h * h;
+	g.s = sin(g.step);
+	g.vk = 0.0f;
+	g.sk = 0.0f;
+	g.k = 0;
+	return g;
+}
+
+// Advances the track by one step
+GC_FUNC void gcNext(GC_INOUT(gcTrack) g) {
+	g.k = g.k + 1;
+	if (g.k % GC_RENORM == 0) {
+		float a = g.step * float(g.k);
+		float h = sin(0.5f * a);
+		g.vk = 2.0f * h * h;
+		g.sk = sin(a);
+	}
+	else {
+		// cos(a+b) = cos(a)cos(b) - sin(a)sin(b), sin(a+b) = sin(a)cos(b) + cos(a)sin(b)
+		float vk = g.vk + g.v - g.vk * g.v + g.sk * g.s;
+		float sk = g.sk - g.sk * g.v + g.s - g.vk * g.s;
+		g.vk = vk;
+		g.sk = sk;
+	}
+
+	g.p = g.p1 + (g.sk * g.t1 - g.vk * g.p1);
+}
+
+// Latitude (from the equatorial plane) of the current way point
+GC_FUNC float gcLatitude(gcTrack g) {
+	return atan(g.p.z, sqrt(g.p.x * g.p.x + g.p.y * g.p.y));
+}
+
+// Longitude of the current way point
+GC_FUNC float gcLongitude(gcTrack g) {
+	return atan(g.p.y, g.p.x);
+}
@@ -0,0 +1,11 @@
+// Raster registration helpers, needs the imgBounds and imgSize uniforms
+
+void toIntrinsic(float lat, float lon, out ivec2 p) {
+	p = ivec2(round((vec2(lon,lat)-imgBounds.yx)/(imgBounds.wz-imgBounds.yx)*vec2(imgSize.yx)));
+}
+
+void fromInstrinsic(ivec2 j, out float lat, out float lon) {
+	vec2 p = imgBounds.yx + vec2(j)/vec2(imgSize.yx)*(imgBounds.wz-imgBounds.yx);
+	lon = p.x;
+	lat = p.y;
+}
@@ -0,0 +1,123 @@
+#include "threadpool.h"
+
+/*
+* Starts numThreads-1 worker threads, the caller of run() is the
+* remaining worker. numThreads = 0 uses one worker per hardware thread.
+*/
+ThreadPool::ThreadPool(unsigned int numThreads)
+	: queues(0), current(nullptr), generation(0), busy(0), stopping(false)
+{
+	if (numThreads == 0)
+		numThreads = std::thread::hardware_concurrency();
+	if (numThreads == 0)
+		numThreads = 1;
+
+	numWorkers = numThreads;
+	queues = std::vector<workQueue>(numWorkers);
+
+	for (unsigned int w = 1; w < numWorkers; w++)
+		threads.push_back(std::thread(&ThreadPool::workerLoop, this, w));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+/*
+* Runs task(i, worker) for every i in [0, numTasks) and returns
+* once all of them have finished. Not reentrant.
+*/
+void ThreadPool::run(size_t numTasks, const taskFunc& task)
+{
+	if (numTasks == 0)
+		return;
+
+	for (unsigned int w = 0; w < numWorkers; w++) {
+		std::lock_guard<std::mutex> guard(queues[w].lock);
+		queues[w].lo = 0;
+		queues[w].hi = (numTasks > w) ? (numTasks - w + numWorkers - 1) / numWorkers : 0;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		current = &task;
+		busy = numWorkers - 1;
+		generation++;
+	}
+	wake.notify_all();
+
+	drain(0);
+
+	std::unique_lock<std::mutex> guard(lock);
+	done.wait(guard, [this] { return busy == 0; });
+	current = nullptr;
+}
+
+void ThreadPool::workerLoop(unsigned int worker)
+{
+	unsigned long seen = 0;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [this, seen] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+		}
+
+		drain(worker);
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			busy--;
+		}
+		done.notify_one();
+	}
+}
+
+/*
+* Executes tasks until no queue has any left.
+*/
+void ThreadPool::drain(unsigned int worker)
+{
+	size_t task;
+	while (popTask(worker, task))
+		(*current)(task, worker);
+}
+
+/*
+* Takes the next task from the front of the worker's own queue,
+* or steals one from the back of another worker's queue.
+*/
+bool ThreadPool::popTask(unsigned int worker, size_t& task)
+{
+	{
+		workQueue& q = queues[worker];
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (q.lo < q.hi) {
+			task = (q.lo++) * numWorkers + worker;
+			return true;
+		}
+	}
+
+	for (unsigned int i = 1; i < numWorkers; i++) {
+		unsigned int victim = (worker + i) % numWorkers;
+		workQueue& q = queues[victim];
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (q.lo < q.hi) {
+			task = (--q.hi) * numWorkers + victim;
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,54 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+* Persistent pool of worker threads with work stealing.
+*
+* run() deals task indices round-robin to one queue per worker, so
+* every worker starts on the head of the task list (callers sort the
+* most expensive tasks first). A worker takes tasks from the front of
+* its own queue and, once it is empty, steals from the back of the
+* other queues. The calling thread acts as worker 0.
+*/
+class ThreadPool {
+public:
+	typedef std::function<void(size_t task, unsigned int worker)> taskFunc;
+
+	explicit ThreadPool(unsigned int numThreads = 0);
+	~ThreadPool();
+
+	unsigned int size() const { return numWorkers; }
+	void run(size_t numTasks, const taskFunc& task);
+
+private:
+	struct workQueue {
+		std::mutex lock;
+		size_t lo, hi;		/* remaining slots, slot k is task k*numWorkers+worker */
+	};
+
+	void workerLoop(unsigned int worker);
+	void drain(unsigned int worker);
+	bool popTask(unsigned int worker, size_t& task);
+
+	unsigned int numWorkers;
+	std::vector<std::thread> threads;
+	std::vector<workQueue> queues;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const taskFunc* current;
+	unsigned long generation;
+	unsigned int busy;
+	bool stopping;
+};
+
+#endif // !THREADPOOL_H
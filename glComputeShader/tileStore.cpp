@@ -0,0 +1,380 @@
+#include "tileStore.h"
+#include "demDecode.h"
+#include "lodepng.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+
+/*
+* File header, tiles start at the next 4 KB boundary.
+*/
+struct tileStoreHeader {
+	char magic[4];				/* "VSTS" */
+	uint32_t version;
+	uint32_t width, height;
+	uint32_t tileSize;
+	uint32_t reserved;
+	double imgBounds[4];
+};
+
+const uint32_t tileStoreVersion = 1;
+const size_t tileDataOffset = 4096;
+
+/* Fills the Terrarium bytes of one DEM row */
+typedef std::function<void(unsigned int y, uint8_t* rgb)> tileRowFunc;
+
+/*
+* Writes the header and the tiles, reading the DEM a band of
+* tileSize rows at a time.
+*/
+static int writeTiles(const char* path, unsigned int width, unsigned int height, unsigned int tileSize, const double imgBounds[4], const tileRowFunc& row)
+{
+	if (width < 2 || height < 2 || tileSize == 0) {
+		printf("TileStore::create(): DEM must be at least 2x2 and tiles at least 1x1\n");
+		return 0;
+	}
+
+	FILE* f = fopen(path, "wb");
+	if (f == NULL) {
+		printf("TileStore::create(): cannot create %s\n", path);
+		return 0;
+	}
+
+	tileStoreHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "VSTS", 4);
+	hdr.version = tileStoreVersion;
+	hdr.width = width;
+	hdr.height = height;
+	hdr.tileSize = tileSize;
+	for (int i = 0; i < 4; i++)
+		hdr.imgBounds[i] = imgBounds[i];
+
+	std::vector<uint8_t> pad(tileDataOffset, 0);
+	memcpy(pad.data(), &hdr, sizeof(hdr));
+	int status = fwrite(pad.data(), 1, pad.size(), f) == pad.size();
+
+	unsigned int tilesX = (width + tileSize - 1) / tileSize;
+	size_t tileBytes = (size_t)tileSize * tileSize * 3;
+	std::vector<uint8_t> band((size_t)tileSize * width * 3);
+	std::vector<uint8_t> tile(tileBytes);
+
+	for (unsigned int y0 = 0; status && y0 < height; y0 += tileSize) {
+		unsigned int rows = std::min(tileSize, height - y0);
+		for (unsigned int r = 0; r < rows; r++)
+			row(y0 + r, &band[(size_t)r * width * 3]);
+
+		for (unsigned int tx = 0; status && tx < tilesX; tx++) {
+			unsigned int x0 = tx * tileSize, cols = std::min(tileSize, width - x0);
+			std::fill(tile.begin(), tile.end(), 0);
+			for (unsigned int r = 0; r < rows; r++)
+				memcpy(&tile[(size_t)r * tileSize * 3], &band[((size_t)r * width + x0) * 3], (size_t)cols * 3);
+			status = fwrite(tile.data(), 1, tileBytes, f) == tileBytes;
+		}
+	}
+
+	if (fclose(f) != 0 || !status) {
+		printf("TileStore::create(): write to %s failed\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+TileStore::TileStore()
+	: width(0), height(0), tileSize(0), tilesX(0), tilesY(0), tileHits(0), tileMisses(0), tilesPrefetched(0),
+	cacheTiles(0), prefetchBusy(false), stopping(false)
+{
+	memset(imgBounds, 0, sizeof(imgBounds));
+}
+
+TileStore::~TileStore()
+{
+	close();
+}
+
+/*
+* Writes a row-major float DEM (in meters) as a tile store,
+* heights are rounded to the 1/256 m of the Terrarium encoding.
+*/
+int TileStore::create(const char* path, const float* elev, unsigned int width, unsigned int height, unsigned int tileSize, const double imgBounds[4])
+{
+	return writeTiles(path, width, height, tileSize, imgBounds, [=](unsigned int y, uint8_t* rgb) {
+		for (unsigned int x = 0; x < width; x++, rgb += 3) {
+			double v = (double)elev[(size_t)y * width + x] + 32768.0;
+			uint32_t q = (uint32_t)std::min(std::max(floor(v * 256.0 + 0.5), 0.0), 16777215.0);
+			rgb[0] = (uint8_t)(q >> 16);
+			rgb[1] = (uint8_t)(q >> 8);
+			rgb[2] = (uint8_t)q;
+		}
+	});
+}
+
+/*
+* Converts a Terrarium PNG to a tile store, cells are copied
+* as they are encoded so nothing is lost.
+*/
+int TileStore::createFromTerrariumPNG(const char* pngPath, const char* path, unsigned int tileSize, const double imgBounds[4])
+{
+	unsigned int w, h;
+	unsigned char* rgba;
+	if (lodepng_decode32_file(&rgba, &w, &h, pngPath)) {
+		printf("TileStore::createFromTerrariumPNG(): unable to decode %s\n", pngPath);
+		return 0;
+	}
+
+	int status = writeTiles(path, w, h, tileSize, imgBounds, [=](unsigned int y, uint8_t* rgb) {
+		const unsigned char* src = &rgba[(size_t)y * w * 4];
+		for (unsigned int x = 0; x < w; x++, rgb += 3, src += 4) {
+			rgb[0] = src[0];
+			rgb[1] = src[1];
+			rgb[2] = src[2];
+		}
+	});
+
+	free(rgba);
+	return status;
+}
+
+/*
+* Maps a tile store and starts the prefetch thread,
+* at most cacheTiles decoded tiles are kept.
+*/
+int TileStore::open(const char* path, unsigned int numCacheTiles)
+{
+	close();
+
+	if (!mapping.open(path))
+		return 0;
+
+	tileStoreHeader hdr;
+	if (mapping.size >= sizeof(hdr))
+		memcpy(&hdr, mapping.data, sizeof(hdr));
+	if (mapping.size < tileDataOffset || memcmp(hdr.magic, "VSTS", 4) != 0 || hdr.version != tileStoreVersion || hdr.tileSize == 0) {
+		printf("TileStore::open(): %s is not a tile store\n", path);
+		close();
+		return 0;
+	}
+
+	width = hdr.width;
+	height = hdr.height;
+	tileSize = hdr.tileSize;
+	tilesX = (width + tileSize - 1) / tileSize;
+	tilesY = (height + tileSize - 1) / tileSize;
+	for (int i = 0; i < 4; i++)
+		imgBounds[i] = hdr.imgBounds[i];
+
+	if (mapping.size < tileDataOffset + (size_t)tilesX * tilesY * tileSize * tileSize * 3) {
+		printf("TileStore::open(): %s is truncated\n", path);
+		close();
+		return 0;
+	}
+
+	cacheTiles = std::max(1u, numCacheTiles);
+	tileHits = tileMisses = tilesPrefetched = 0;
+	stopping = false;
+	prefetchThread = std::thread(&TileStore::prefetchLoop, this);
+	return 1;
+}
+
+void TileStore::close()
+{
+	if (prefetchThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> guard(cacheLock);
+			stopping = true;
+			prefetchQueue.clear();
+		}
+		prefetchWake.notify_all();
+		prefetchThread.join();
+	}
+
+	lru.clear();
+	cache.clear();
+
+	mapping.close();
+	width = height = tileSize = tilesX = tilesY = 0;
+}
+
+/*
+* Decoded tile id (ty*tilesX + tx), from the cache or from the mapping.
+* Evicted tiles stay valid for whoever still holds them.
+*/
+TileStore::tilePtr TileStore::tile(unsigned int id, bool prefetching)
+{
+	{
+		std::lock_guard<std::mutex> guard(cacheLock);
+		auto it = cache.find(id);
+		if (it != cache.end()) {
+			lru.splice(lru.begin(), lru, it->second);
+			if (!prefetching)
+				tileHits++;
+			return it->second->data;
+		}
+	}
+
+	/* Decode outside of the lock, the mapping is read only */
+	const size_t cells = (size_t)tileSize * tileSize;
+	const uint8_t* src = mapping.data + tileDataOffset + (size_t)id * cells * 3;
+	std::shared_ptr< std::vector<float> > data = std::make_shared< std::vector<float> >(cells);
+	decodeElevationRow(src, 3, (unsigned int)cells, DEM_TERRARIUM, data->data());
+
+	std::lock_guard<std::mutex> guard(cacheLock);
+	auto it = cache.find(id);
+	if (it != cache.end())
+		return it->second->data;
+
+	cacheEntry entry;
+	entry.id = id;
+	entry.data = data;
+	lru.push_front(entry);
+	cache[id] = lru.begin();
+	while (lru.size() > cacheTiles) {
+		cache.erase(lru.back().id);
+		lru.pop_back();
+	}
+
+	if (prefetching)
+		tilesPrefetched++;
+	else
+		tileMisses++;
+	return data;
+}
+
+/*
+* Copies w x h cells at (x0,y0) into out, row-major. Cells
+* outside of the DEM read as 0 like imageLoad() does.
+*/
+int TileStore::readWindow(int x0, int y0, unsigned int w, unsigned int h, float* out)
+{
+	if (mapping.data == NULL) {
+		printf("TileStore::readWindow(): store not open\n");
+		return 0;
+	}
+
+	memset(out, 0, (size_t)w * h * sizeof(float));
+
+	int xa = std::max(x0, 0), ya = std::max(y0, 0);
+	int xb = (int)std::min((int64_t)x0 + w, (int64_t)width), yb = (int)std::min((int64_t)y0 + h, (int64_t)height);
+	if (xa >= xb || ya >= yb)
+		return 1;
+
+	for (int ty = ya / (int)tileSize; ty <= (yb - 1) / (int)tileSize; ty++) {
+		for (int tx = xa / (int)tileSize; tx <= (xb - 1) / (int)tileSize; tx++) {
+			tilePtr t = tile((unsigned int)ty * tilesX + tx, false);
+			int cx0 = std::max(xa, tx * (int)tileSize), cx1 = std::min(xb, (tx + 1) * (int)tileSize);
+			int cy0 = std::max(ya, ty * (int)tileSize), cy1 = std::min(yb, (ty + 1) * (int)tileSize);
+			for (int y = cy0; y < cy1; y++) {
+				const float* src = &(*t)[(size_t)(y - ty * (int)tileSize) * tileSize + (cx0 - tx * (int)tileSize)];
+				memcpy(&out[(size_t)(y - y0) * w + (cx0 - x0)], src, (size_t)(cx1 - cx0) * sizeof(float));
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+* Sizes the engine DEM to w x h and uploads the window at (x0,y0)
+* tile by tile, the window must lie inside of the DEM.
+*/
+int TileStore::loadWindow(ViewshedEngine* engine, int x0, int y0, unsigned int w, unsigned int h)
+{
+	if (mapping.data == NULL || x0 < 0 || y0 < 0 || (int64_t)x0 + w > width || (int64_t)y0 + h > height) {
+		printf("TileStore::loadWindow(): window outside of the DEM\n");
+		return 0;
+	}
+	if (!engine->setElevation(NULL, w, h))
+		return 0;
+
+	int xb = x0 + (int)w, yb = y0 + (int)h;
+	for (int ty = y0 / (int)tileSize; ty <= (yb - 1) / (int)tileSize; ty++) {
+		for (int tx = x0 / (int)tileSize; tx <= (xb - 1) / (int)tileSize; tx++) {
+			tilePtr t = tile((unsigned int)ty * tilesX + tx, false);
+			int cx0 = std::max(x0, tx * (int)tileSize), cx1 = std::min(xb, (tx + 1) * (int)tileSize);
+			int cy0 = std::max(y0, ty * (int)tileSize), cy1 = std::min(yb, (ty + 1) * (int)tileSize);
+			const float* src = &(*t)[(size_t)(cy0 - ty * (int)tileSize) * tileSize + (cx0 - tx * (int)tileSize)];
+			if (!engine->setElevationRect(src, cx0 - x0, cy0 - y0, cx1 - cx0, cy1 - cy0, tileSize))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+* Image bounds of a window, for viewshedParams::imgBounds.
+*/
+void TileStore::windowBounds(int x0, int y0, unsigned int w, unsigned int h, double bounds[4]) const
+{
+	bounds[0] = imgBounds[0] + (double)y0 / height * (imgBounds[2] - imgBounds[0]);
+	bounds[1] = imgBounds[1] + (double)x0 / width * (imgBounds[3] - imgBounds[1]);
+	bounds[2] = imgBounds[0] + ((double)y0 + h) / height * (imgBounds[2] - imgBounds[0]);
+	bounds[3] = imgBounds[1] + ((double)x0 + w) / width * (imgBounds[3] - imgBounds[1]);
+}
+
+/*
+* Queues the tiles within radius pixels of (x,y), nearest first,
+* in place of whatever was still queued.
+*/
+void TileStore::prefetch(int x, int y, unsigned int radius)
+{
+	if (mapping.data == NULL)
+		return;
+
+	int r = (int)radius;
+	int tx0 = std::max(0, (x - r) / (int)tileSize), tx1 = std::min((int)tilesX - 1, (x + r) / (int)tileSize);
+	int ty0 = std::max(0, (y - r) / (int)tileSize), ty1 = std::min((int)tilesY - 1, (y + r) / (int)tileSize);
+
+	std::vector< std::pair<double, unsigned int> > order;
+	for (int ty = ty0; ty <= ty1; ty++) {
+		for (int tx = tx0; tx <= tx1; tx++) {
+			double dx = (tx + 0.5) * tileSize - x, dy = (ty + 0.5) * tileSize - y;
+			order.push_back(std::make_pair(dx * dx + dy * dy, (unsigned int)ty * tilesX + tx));
+		}
+	}
+	std::sort(order.begin(), order.end());
+
+	{
+		std::lock_guard<std::mutex> guard(cacheLock);
+		prefetchQueue.clear();
+		for (size_t i = 0; i < order.size(); i++)
+			prefetchQueue.push_back(order[i].second);
+	}
+	prefetchWake.notify_one();
+}
+
+/*
+* Blocks until the prefetch queue has drained.
+*/
+void TileStore::waitPrefetch()
+{
+	std::unique_lock<std::mutex> guard(cacheLock);
+	prefetchIdle.wait(guard, [this] { return prefetchQueue.empty() && !prefetchBusy; });
+}
+
+void TileStore::prefetchLoop()
+{
+	std::unique_lock<std::mutex> guard(cacheLock);
+	while (true) {
+		prefetchWake.wait(guard, [this] { return stopping || !prefetchQueue.empty(); });
+		if (stopping)
+			break;
+
+		unsigned int id = prefetchQueue.front();
+		prefetchQueue.pop_front();
+		prefetchBusy = true;
+		guard.unlock();
+
+		tile(id, true);
+
+		guard.lock();
+		prefetchBusy = false;
+		if (prefetchQueue.empty())
+			prefetchIdle.notify_all();
+	}
+	prefetchBusy = false;
+	prefetchIdle.notify_all();
+}
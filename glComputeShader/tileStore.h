@@ -0,0 +1,84 @@
+#ifndef TILESTORE_H
+#define TILESTORE_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "mappedFile.h"
+#include "viewshed.h"
+
+/*
+* Tiled DEM backing store. The file holds a header and fixed-size
+* square tiles of Terrarium encoded cells (r*256 + g + b/256 - 32768
+* meters, 3 bytes per cell), row-major by tile, edge tiles padded. It
+* is memory mapped, so only the pages of the tiles that are read are
+* ever loaded.
+*
+* Decoded tiles (floats) are kept in an LRU cache of cacheTiles.
+* prefetch() queues the tiles around an observer, nearest first, for
+* a background thread to decode, like rays leaving the observer would
+* reach them. readWindow() and loadWindow() assemble any rectangle of
+* the DEM from the tiles it touches, the latter straight into an
+* engine with setElevationRect().
+*/
+class TileStore {
+public:
+	TileStore();
+	~TileStore();
+
+	static int create(const char* path, const float* elev, unsigned int width, unsigned int height, unsigned int tileSize, const double imgBounds[4]);
+	static int createFromTerrariumPNG(const char* pngPath, const char* path, unsigned int tileSize, const double imgBounds[4]);
+
+	int open(const char* path, unsigned int cacheTiles);
+	void close();
+
+	int readWindow(int x0, int y0, unsigned int w, unsigned int h, float* out);
+	int loadWindow(ViewshedEngine* engine, int x0, int y0, unsigned int w, unsigned int h);
+	void windowBounds(int x0, int y0, unsigned int w, unsigned int h, double bounds[4]) const;
+
+	void prefetch(int x, int y, unsigned int radius);
+	void waitPrefetch();
+
+	unsigned int width;			/* DEM width in pixels */
+	unsigned int height;		/* DEM height in pixels */
+	unsigned int tileSize;		/* tile side in pixels */
+	unsigned int tilesX, tilesY;
+	double imgBounds[4];		/* in radians, lat lon lat lon like viewshedParams */
+	uint64_t tileHits;			/* tile lookups served from the cache */
+	uint64_t tileMisses;		/* tiles decoded on demand */
+	uint64_t tilesPrefetched;	/* tiles decoded by the prefetch thread */
+
+private:
+	typedef std::shared_ptr< const std::vector<float> > tilePtr;
+
+	tilePtr tile(unsigned int id, bool prefetching);
+	void prefetchLoop();
+
+	MappedFile mapping;
+
+	/* LRU, most recent first */
+	struct cacheEntry {
+		unsigned int id;
+		tilePtr data;
+	};
+	std::list<cacheEntry> lru;
+	std::unordered_map<unsigned int, std::list<cacheEntry>::iterator> cache;
+	unsigned int cacheTiles;
+	std::mutex cacheLock;
+
+	std::thread prefetchThread;
+	std::deque<unsigned int> prefetchQueue;
+	std::condition_variable prefetchWake, prefetchIdle;
+	bool prefetchBusy;
+	bool stopping;
+};
+
+#endif // !TILESTORE_H
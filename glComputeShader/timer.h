@@ -0,0 +1,47 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/*
+* Returns a timestamp from the high resolution
+* monotonic clock, to be passed to toc().
+*/
+static inline uint64_t tic()
+{
+#ifdef _WIN32
+	uint64_t startTime;
+	QueryPerformanceCounter((LARGE_INTEGER*)&startTime);
+	return startTime;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*
+* Returns the time elapsed since startTime in milliseconds.
+*/
+static inline double toc(uint64_t startTime)
+{
+	uint64_t endTime = tic();
+#ifdef _WIN32
+	uint64_t freq;
+	QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
+	return (double)(endTime - startTime) * 1000.0 / (double)freq;
+#else
+	return (double)(endTime - startTime) * 1e-6;
+#endif
+}
+
+#endif // !TIMER_H
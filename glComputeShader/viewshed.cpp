@@ -0,0 +1,316 @@
+#include "viewshed.h"
+#include "viewshedGL.h"
+#include "viewshedCPU.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#define FMAX(a,b) ((a>b)?(a):(b))
+#define FMIN(a,b) ((a<b)?(a):(b))
+
+/*
+* Reads back the last run as one byte per cell (0 or 1),
+* row-major or column-major (MATLAB) order.
+*/
+int ViewshedEngine::readVisibility(uint8_t* vis, bool columnMajor)
+{
+	uint32_t* packed = (uint32_t*)malloc((size_t)wordsPerRow * height * sizeof(uint32_t));
+	if (!packed) {
+		printf("ViewshedEngine::readVisibility(): malloc failed\n");
+		return 0;
+	}
+
+	int status = readPacked(packed);
+	if (status)
+		unpackVisibility(packed, width, height, vis, columnMajor);
+
+	free(packed);
+	return status;
+}
+
+/*
+* Expands packed 1-bit visibility into one byte per cell.
+*/
+void unpackVisibility(const uint32_t* packed, unsigned int width, unsigned int height, uint8_t* vis, bool columnMajor)
+{
+	size_t wordsPerRow = (width + 31) / 32;
+
+	for (size_t iy = 0; iy < height; iy++) {
+		const uint32_t* row = packed + iy * wordsPerRow;
+		for (size_t ix = 0; ix < width; ix++) {
+			uint8_t v = (row[ix / 32] >> (ix % 32)) & 1;
+			if (columnMajor)
+				vis[ix * height + iy] = v;
+			else
+				vis[iy * width + ix] = v;
+		}
+	}
+}
+
+/*
+* Returns 1 if the observer is inside the raster bounds.
+*/
+int observerInBounds(const viewshedParams* p)
+{
+	const double* b = p->imgBounds;
+	return !(p->lat1 > FMAX(b[0], b[2]) || p->lat1 < FMIN(b[0], b[2]) ||
+		p->lon1 > FMAX(b[1], b[3]) || p->lon1 < FMIN(b[1], b[3]));
+}
+
+/*
+* Meters per pixel along x (longitude) and y (latitude) at the
+* observer, the observer-local projection scales pixel offsets
+* by these to get ground ranges.
+*/
+void localPixelScale(const viewshedParams* p, unsigned int width, unsigned int height, double scale[2])
+{
+	const double* b = p->imgBounds;
+	double radius = p->actualRadius * 1e3;
+	scale[0] = radius * cos(p->lat1) * fabs(b[3] - b[1]) / width;
+	scale[1] = radius * fabs(b[2] - b[0]) / height;
+}
+
+/*
+* Rays of a run. Without maxRange and azimuthWidth they go to the
+* perimeter, numRays 0, like they always did. Otherwise they go to the
+* circle of maxRange around the observer, or of the farthest DEM
+* corner without maxRange, one per pixel of its arc inside the sector.
+* A circle holding the whole DEM is no different from the perimeter.
+* box is the part of the DEM the rays can reach.
+*/
+void ViewshedEngine::raySet(const viewshedParams* p, viewshedRays* r) const
+{
+	const float twoPi = 6.28318531f;
+
+	r->numRays = 0;
+	r->range = 0;
+	r->radius[0] = r->radius[1] = 0;
+	r->azimuthStart = r->azimuthStep = 0;
+	r->box[0] = r->box[1] = 0;
+	r->box[2] = width - 1;
+	r->box[3] = height - 1;
+
+	bool sector = azimuthSector();
+	if (maxRange <= 0 && !sector)
+		return;
+
+	/* Observer pixel, toIntrinsic() of visibility.comp */
+	const float b[4] = { (float)p->imgBounds[0], (float)p->imgBounds[1], (float)p->imgBounds[2], (float)p->imgBounds[3] };
+	int x1 = (int)roundf(((float)p->lon1 - b[1]) / (b[3] - b[1]) * (float)width);
+	int y1 = (int)roundf(((float)p->lat1 - b[0]) / (b[2] - b[0]) * (float)height);
+
+	/* Same single precision math as the shader */
+	double scale[2];
+	localPixelScale(p, width, height, scale);
+	float farthest = 0;
+	for (int i = 0; i < 4; i++) {
+		float dx = (float)((i & 1) ? (int)width - 1 - x1 : x1) * (float)scale[0];
+		float dy = (float)((i & 2) ? (int)height - 1 - y1 : y1) * (float)scale[1];
+		farthest = FMAX(farthest, sqrtf(dx * dx + dy * dy));
+	}
+	if (!sector && (float)maxRange >= farthest)
+		return;
+
+	r->range = (maxRange > 0 && (float)maxRange < farthest) ? (float)maxRange : farthest;
+	r->radius[0] = (b[3] > b[1] ? 1.0f : -1.0f) * FMAX(r->range / (float)scale[0], 1.0f);
+	r->radius[1] = (b[2] > b[0] ? 1.0f : -1.0f) * FMAX(r->range / (float)scale[1], 1.0f);
+	float arc = FMAX(fabsf(r->radius[0]), fabsf(r->radius[1]));
+	if (sector) {
+		r->numRays = (unsigned int)ceilf((float)azimuthWidth * arc) + 1;
+		r->azimuthStart = (float)azimuthStart;
+		r->azimuthStep = (float)azimuthWidth / (float)(r->numRays - 1);
+	}
+	else {
+		r->numRays = (unsigned int)ceilf(twoPi * arc);
+		r->azimuthStep = twoPi / (float)r->numRays;
+	}
+
+	/* Observer, both ends of the arc and the compass points on it */
+	float box[4] = { (float)x1, (float)y1, (float)x1, (float)y1 };
+	auto extend = [&](float az) {
+		float x = (float)x1 + r->radius[0] * sinf(az), y = (float)y1 + r->radius[1] * cosf(az);
+		box[0] = FMIN(box[0], x);
+		box[1] = FMIN(box[1], y);
+		box[2] = FMAX(box[2], x);
+		box[3] = FMAX(box[3], y);
+	};
+	float span = sector ? (float)azimuthWidth : twoPi;
+	extend(r->azimuthStart);
+	extend(r->azimuthStart + span);
+	for (int k = (int)ceilf(r->azimuthStart / (twoPi / 4)); k * (twoPi / 4) <= r->azimuthStart + span; k++)
+		extend(k * (twoPi / 4));
+
+	/* One pixel of slack for rounding and the bulge of the great-circle tracks */
+	r->box[0] = (unsigned int)FMAX((int)floorf(box[0]) - 1, 0);
+	r->box[1] = (unsigned int)FMAX((int)floorf(box[1]) - 1, 0);
+	r->box[2] = (unsigned int)FMIN((int)ceilf(box[2]) + 1, (int)width - 1);
+	r->box[3] = (unsigned int)FMIN((int)ceilf(box[3]) + 1, (int)height - 1);
+}
+
+/*
+* Whether the rays are limited to a sector
+* narrower than the full circle.
+*/
+bool ViewshedEngine::azimuthSector() const
+{
+	return azimuthWidth > 0 && azimuthWidth < 6.283185307179586;
+}
+
+/*
+* Whether elevation limits are set, otherwise
+* every elevation angle is in the field of view.
+*/
+bool ViewshedEngine::verticalFOV() const
+{
+	return minElevation > -1.5707963267948966 || maxElevation < 1.5707963267948966;
+}
+
+/*
+* Largest error, in meters, of the observer-local projection
+* against the spherical rays for this observer and DEM. Samples
+* every ray and takes the worse of the ground range error and
+* the distance of the straight pixel ray from the great circle.
+*/
+double viewshedLocalProjectionError(const viewshedParams* p, unsigned int width, unsigned int height)
+{
+	const double* b = p->imgBounds;
+	const double radius = p->actualRadius * 1e3;
+	const int numSamples = 64;
+
+	double scale[2];
+	localPixelScale(p, width, height, scale);
+
+	/* Observer in continuous pixel units */
+	double x1 = (p->lon1 - b[1]) / (b[3] - b[1]) * width;
+	double y1 = (p->lat1 - b[0]) / (b[2] - b[0]) * height;
+
+	double maxError = 0;
+	int numRays = 2 * ((int)width - 2) + 2 * (int)height;
+	for (int idx = 0; idx < numRays; idx++) {
+		int jx, jy;
+		if (idx < (int)width - 2) { jx = 1 + idx; jy = 0; }
+		else if (idx < (int)width - 2 + (int)height) { jx = width - 1; jy = idx - width + 2; }
+		else if (idx < 2 * ((int)width - 2) + (int)height) { jx = 3 + idx - width - height; jy = height - 1; }
+		else { jx = 0; jy = idx - 2 * width - height + 4; }
+
+		double lat2 = b[0] + (double)jy / height * (b[2] - b[0]);
+		double lon2 = b[1] + (double)jx / width * (b[3] - b[1]);
+		double len = sqrt(pow((jx - x1) * scale[0], 2) + pow((jy - y1) * scale[1], 2));
+		double bearing12 = atan2(sin(lon2 - p->lon1) * cos(lat2), cos(p->lat1) * sin(lat2) - sin(p->lat1) * cos(lat2) * cos(lon2 - p->lon1));
+
+		for (int k = 1; k <= numSamples; k++) {
+			double t = (double)k / numSamples;
+			double lat = b[0] + (y1 + t * (jy - y1)) / height * (b[2] - b[0]);
+			double lon = b[1] + (x1 + t * (jx - x1)) / width * (b[3] - b[1]);
+
+			// Ground range, closed form against haversine
+			double d13 = 2 * asin(sqrt(pow(sin((p->lat1 - lat) / 2), 2) + cos(p->lat1) * cos(lat) * pow(sin((p->lon1 - lon) / 2), 2)));
+			double rangeError = fabs(t * len - d13 * radius);
+
+			// Cross track distance from the great circle through the observer and the endpoint
+			double bearing13 = atan2(sin(lon - p->lon1) * cos(lat), cos(p->lat1) * sin(lat) - sin(p->lat1) * cos(lat) * cos(lon - p->lon1));
+			double trackError = fabs(asin(sin(d13) * sin(bearing13 - bearing12))) * radius;
+
+			maxError = FMAX(maxError, FMAX(rangeError, trackError));
+		}
+	}
+
+	return maxError;
+}
+
+
+/* C interface */
+
+ViewshedEngine* viewshedCreate(const char* shaderPath)
+{
+	GLViewshedEngine* engine = new GLViewshedEngine();
+	if (!engine->init(shaderPath)) {
+		delete engine;
+		return NULL;
+	}
+	return engine;
+}
+
+ViewshedEngine* viewshedCreateCPU(unsigned int numThreads)
+{
+	CPUViewshedEngine* engine = new CPUViewshedEngine();
+	if (!engine->init(numThreads)) {
+		delete engine;
+		return NULL;
+	}
+	return engine;
+}
+
+int viewshedSetElevation(ViewshedEngine* engine, const float* elev, unsigned int width, unsigned int height)
+{
+	return engine->setElevation(elev, width, height);
+}
+
+int viewshedRun(ViewshedEngine* engine, const viewshedParams* p)
+{
+	return engine->run(p);
+}
+
+int viewshedReadPacked(ViewshedEngine* engine, uint32_t* packed)
+{
+	return engine->readPacked(packed);
+}
+
+int viewshedReadVisibility(ViewshedEngine* engine, uint8_t* vis, int columnMajor)
+{
+	return engine->readVisibility(vis, columnMajor != 0);
+}
+
+int viewshedRunCumulative(ViewshedEngine* engine, const viewshedParams* p, unsigned int numObservers)
+{
+	return engine->runCumulative(p, numObservers);
+}
+
+int viewshedReadCount(ViewshedEngine* engine, uint32_t* count)
+{
+	return engine->readCount(count);
+}
+
+/*
+* Picks the algorithm of a CPU engine, one of cpuAlgorithm:
+* 0 rays, 1 radial sweep, 2 XDraw, 3 reference plane, 4 adaptive rays.
+*/
+int viewshedSetCPUAlgorithm(ViewshedEngine* engine, int algorithm)
+{
+	CPUViewshedEngine* cpu = dynamic_cast<CPUViewshedEngine*>(engine);
+	if (cpu == NULL || algorithm < CPU_RAYS || algorithm > CPU_ADAPTIVE_RAYS) {
+		printf("viewshedSetCPUAlgorithm(): not a CPU engine or unknown algorithm %d\n", algorithm);
+		return 0;
+	}
+	cpu->algorithm = (cpuAlgorithm)algorithm;
+	return 1;
+}
+
+int viewshedSetMaxRange(ViewshedEngine* engine, double maxRange)
+{
+	if (maxRange < 0) {
+		printf("viewshedSetMaxRange(): range must not be negative\n");
+		return 0;
+	}
+	engine->maxRange = maxRange;
+	return 1;
+}
+
+int viewshedSetFieldOfView(ViewshedEngine* engine, double azimuthStart, double azimuthWidth, double minElevation, double maxElevation)
+{
+	if (azimuthWidth < 0 || minElevation > maxElevation) {
+		printf("viewshedSetFieldOfView(): negative sector width or empty elevation range\n");
+		return 0;
+	}
+	engine->azimuthStart = azimuthStart;
+	engine->azimuthWidth = azimuthWidth;
+	engine->minElevation = minElevation;
+	engine->maxElevation = maxElevation;
+	return 1;
+}
+
+void viewshedDestroy(ViewshedEngine* engine)
+{
+	delete engine;
+}
@@ -0,0 +1,124 @@
+#ifndef VIEWSHED_H
+#define VIEWSHED_H
+
+#include <stdint.h>
+
+#ifdef MATLAB_MEX_FILE
+#include "mex.h"
+#endif
+
+/*
+* Per-observer inputs, these map one to one onto
+* the uniforms of shaders/visibility.comp.
+*/
+struct viewshedParams {
+	double lat1;				/* in radians */
+	double lon1;				/* in radians */
+	double observerAltitude;	/* in meters */
+	double targetAltitude;		/* in meters */
+	double actualRadius;		/* in km */
+	double effectiveRadius;		/* in km */
+	double imgBounds[4];		/* in radians, lat lon lat lon of the upper left and lower right corners */
+};
+
+/*
+* Rays of one run when they do not go to the DEM perimeter, see
+* ViewshedEngine::raySet(). Ray k has azimuth azimuthStart +
+* k*azimuthStep and ends at range, shortened to the DEM edge.
+*/
+struct viewshedRays {
+	unsigned int numRays;		/* 0 casts one ray per perimeter pixel */
+	float range;				/* in meters */
+	float radius[2];			/* range in pixels, x y, negative where pixels run west or south */
+	float azimuthStart;			/* in radians, clockwise from north */
+	float azimuthStep;			/* in radians */
+	unsigned int box[4];		/* cells the rays can reach, x0 y0 x1 y1 inclusive */
+};
+
+#ifdef __cplusplus
+
+/*
+* Common interface of the viewshed engines. An engine keeps the DEM
+* resident between runs, so running another observer over the same
+* DEM only costs the viewshed computation itself.
+*
+* Output is packed 1 bit per cell, row-major, with (W+31)/32 words
+* per row and bit (x%32) of word x/32 holding cell x.
+*
+* setElevation() with elev NULL only sizes the DEM, setElevationRect()
+* then fills it a rectangle at a time, e.g. tile by tile from a
+* TileStore without a full copy on the host.
+*
+* maxRange limits a run to a circle around the observer. Rays end on
+* the circle instead of the DEM perimeter, one per pixel of its
+* circumference, so work drops with the square of the range, and only
+* the bounding box of the circle is cleared and read back.
+*
+* azimuthWidth limits the rays to a sector, like the field of view
+* of a camera or a directional antenna, and minElevation and
+* maxElevation the elevation angles under which targets are seen.
+* Cells outside of them are not visible, they still hide the cells
+* behind them.
+*
+* runCumulative() instead counts, for every cell, how many of a list
+* of observers see it. The count raster stays with the engine until
+* read back with readCount(), row-major, one uint32 per cell.
+*/
+class ViewshedEngine {
+public:
+	ViewshedEngine() : width(0), height(0), wordsPerRow(0), maxRange(0), azimuthStart(0), azimuthWidth(0),
+		minElevation(-1.5707963267948966), maxElevation(1.5707963267948966) {}
+	virtual ~ViewshedEngine() {}
+
+	virtual int setElevation(const float* elev, unsigned int width, unsigned int height) = 0;
+	virtual int setElevationRect(const float* elev, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned int stride) = 0;
+	virtual int run(const viewshedParams* p) = 0;
+	virtual int readPacked(uint32_t* packed) = 0;
+	virtual int runCumulative(const viewshedParams* p, unsigned int numObservers) = 0;
+	virtual int readCount(uint32_t* count) = 0;
+	virtual void release() = 0;
+	int readVisibility(uint8_t* vis, bool columnMajor);
+	void raySet(const viewshedParams* p, viewshedRays* r) const;
+	bool azimuthSector() const;
+	bool verticalFOV() const;
+
+	unsigned int width;			/* DEM width in pixels */
+	unsigned int height;		/* DEM height in pixels */
+	unsigned int wordsPerRow;	/* packed output words per row */
+	double maxRange;			/* in meters, 0 sees to the DEM edge */
+	double azimuthStart;		/* first azimuth of the sector, in radians clockwise from north */
+	double azimuthWidth;		/* sector width, in radians, 0 sees all around */
+	double minElevation;		/* lowest elevation angle of a target, in radians, -pi/2 for none */
+	double maxElevation;		/* highest elevation angle of a target, in radians, pi/2 for none */
+};
+
+void unpackVisibility(const uint32_t* packed, unsigned int width, unsigned int height, uint8_t* vis, bool columnMajor);
+int observerInBounds(const viewshedParams* p);
+void localPixelScale(const viewshedParams* p, unsigned int width, unsigned int height, double scale[2]);
+
+extern "C" {
+#else
+typedef struct ViewshedEngine ViewshedEngine;
+typedef struct viewshedParams viewshedParams;
+#endif
+
+/* Plain C interface to the viewshed engines */
+ViewshedEngine* viewshedCreate(const char* shaderPath);
+ViewshedEngine* viewshedCreateCPU(unsigned int numThreads);
+int viewshedSetElevation(ViewshedEngine* engine, const float* elev, unsigned int width, unsigned int height);
+int viewshedRun(ViewshedEngine* engine, const viewshedParams* p);
+int viewshedReadPacked(ViewshedEngine* engine, uint32_t* packed);
+int viewshedReadVisibility(ViewshedEngine* engine, uint8_t* vis, int columnMajor);
+int viewshedRunCumulative(ViewshedEngine* engine, const viewshedParams* p, unsigned int numObservers);
+int viewshedReadCount(ViewshedEngine* engine, uint32_t* count);
+int viewshedSetCPUAlgorithm(ViewshedEngine* engine, int algorithm);
+int viewshedSetMaxRange(ViewshedEngine* engine, double maxRange);
+int viewshedSetFieldOfView(ViewshedEngine* engine, double azimuthStart, double azimuthWidth, double minElevation, double maxElevation);
+void viewshedDestroy(ViewshedEngine* engine);
+double viewshedLocalProjectionError(const viewshedParams* p, unsigned int width, unsigned int height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !VIEWSHED_H
@@ -0,0 +1,103 @@
+#include "viewshedCPU.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+
+// AVX2 is enabled for this file only, callers check detectSimdLevel() first
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC target("avx2")
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include <immintrin.h>
+
+struct vecAVX2 {
+	enum { N = 8 };
+	typedef __m256 f;
+	typedef __m256i i;
+	typedef __m256 m;
+
+	static inline f set1(float a) { return _mm256_set1_ps(a); }
+	static inline f load(const float* p) { return _mm256_load_ps(p); }
+	static inline void store(float* p, f a) { _mm256_store_ps(p, a); }
+	static inline f add(f a, f b) { return _mm256_add_ps(a, b); }
+	static inline f sub(f a, f b) { return _mm256_sub_ps(a, b); }
+	static inline f mul(f a, f b) { return _mm256_mul_ps(a, b); }
+	static inline f div(f a, f b) { return _mm256_div_ps(a, b); }
+	static inline f sqrt(f a) { return _mm256_sqrt_ps(a); }
+	static inline f fand(f a, f b) { return _mm256_and_ps(a, b); }
+	static inline f fxor(f a, f b) { return _mm256_xor_ps(a, b); }
+	static inline f itof(i a) { return _mm256_cvtepi32_ps(a); }
+	static inline f castf(i a) { return _mm256_castsi256_ps(a); }
+	static inline f select(m k, f a, f b) { return _mm256_blendv_ps(b, a, k); }
+	static inline m gt(f a, f b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	static inline m lt(f a, f b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+
+	static inline i iset1(int a) { return _mm256_set1_epi32(a); }
+	static inline i iload(const int* p) { return _mm256_load_si256((const __m256i*)p); }
+	static inline void istore(int* p, i a) { _mm256_store_si256((__m256i*)p, a); }
+	static inline i iadd(i a, i b) { return _mm256_add_epi32(a, b); }
+	static inline i isub(i a, i b) { return _mm256_sub_epi32(a, b); }
+	static inline i imul(i a, i b) { return _mm256_mullo_epi32(a, b); }
+	static inline i iand(i a, i b) { return _mm256_and_si256(a, b); }
+	static inline i iandnot(i a, i b) { return _mm256_andnot_si256(b, a); }
+	static inline i islli29(i a) { return _mm256_slli_epi32(a, 29); }
+	static inline i isrli5(i a) { return _mm256_srai_epi32(a, 5); }
+	static inline i ftoi(f a) { return _mm256_cvttps_epi32(a); }
+	static inline i iselect(m k, i a, i b) { return _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b), _mm256_castsi256_ps(a), k)); }
+	static inline m ieq(i a, i b) { return _mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b)); }
+	static inline m igt(i a, i b) { return _mm256_castsi256_ps(_mm256_cmpgt_epi32(a, b)); }
+	static inline m ige(i a, i b) { return _mm256_xor_ps(igt(b, a), _mm256_castsi256_ps(_mm256_set1_epi32(-1))); }
+
+	static inline m mand(m a, m b) { return _mm256_and_ps(a, b); }
+	static inline m mandnot(m a, m b) { return _mm256_andnot_ps(b, a); }
+	static inline m mor(m a, m b) { return _mm256_or_ps(a, b); }
+	static inline int bits(m a) { return _mm256_movemask_ps(a); }
+
+	static inline f gather(const float* base, i idx, m k)
+	{
+		return _mm256_mask_i32gather_ps(_mm256_setzero_ps(), base, idx, k, 4);
+	}
+};
+
+#include "viewshedPacket.h"
+
+void traceRayPacketAVX2(const cpuRayContext* c, const int* rays, int numRays, uint32_t* vis)
+{
+	traceRayPacket<vecAVX2>(c, rays, numRays, vis);
+}
+
+void xdrawOctantAVX2(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis)
+{
+	xdrawOctantKernel<vecAVX2>(c, o, ring, vis);
+}
+
+void refPlaneOctantAVX2(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis)
+{
+	refPlaneOctantKernel<vecAVX2>(c, o, elevT, ring, vis);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#else
+
+void traceRayPacketAVX2(const cpuRayContext* c, const int* rays, int numRays, uint32_t* vis)
+{
+	for (int r = 0; r < numRays; r++)
+		traceRayScalar(c, rays[r], vis);
+}
+
+void xdrawOctantAVX2(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis)
+{
+	xdrawOctantScalar(c, o, ring, vis);
+}
+
+void refPlaneOctantAVX2(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis)
+{
+	refPlaneOctantScalar(c, o, elevT, ring, vis);
+}
+
+#endif
@@ -0,0 +1,106 @@
+#include "viewshedCPU.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+
+// AVX-512F is enabled for this file only, callers check detectSimdLevel() first
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC target("avx512f")
+#pragma GCC optimize("fp-contract=off")
+// GCC 12 flags the _mm512_undefined_*() pass-through of its own unmasked intrinsics
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+#include <immintrin.h>
+
+struct vecAVX512 {
+	enum { N = 16 };
+	typedef __m512 f;
+	typedef __m512i i;
+	typedef __mmask16 m;
+
+	static inline f set1(float a) { return _mm512_set1_ps(a); }
+	static inline f load(const float* p) { return _mm512_load_ps(p); }
+	static inline void store(float* p, f a) { _mm512_store_ps(p, a); }
+	static inline f add(f a, f b) { return _mm512_add_ps(a, b); }
+	static inline f sub(f a, f b) { return _mm512_sub_ps(a, b); }
+	static inline f mul(f a, f b) { return _mm512_mul_ps(a, b); }
+	static inline f div(f a, f b) { return _mm512_div_ps(a, b); }
+	static inline f sqrt(f a) { return _mm512_sqrt_ps(a); }
+	/* Float and/xor need AVX512DQ, go through the integer domain */
+	static inline f fand(f a, f b) { return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_castps_si512(b))); }
+	static inline f fxor(f a, f b) { return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_castps_si512(b))); }
+	static inline f itof(i a) { return _mm512_cvtepi32_ps(a); }
+	static inline f castf(i a) { return _mm512_castsi512_ps(a); }
+	static inline f select(m k, f a, f b) { return _mm512_mask_blend_ps(k, b, a); }
+	static inline m gt(f a, f b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+	static inline m lt(f a, f b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+
+	static inline i iset1(int a) { return _mm512_set1_epi32(a); }
+	static inline i iload(const int* p) { return _mm512_load_si512((const void*)p); }
+	static inline void istore(int* p, i a) { _mm512_store_si512((void*)p, a); }
+	static inline i iadd(i a, i b) { return _mm512_add_epi32(a, b); }
+	static inline i isub(i a, i b) { return _mm512_sub_epi32(a, b); }
+	static inline i imul(i a, i b) { return _mm512_mullo_epi32(a, b); }
+	static inline i iand(i a, i b) { return _mm512_and_si512(a, b); }
+	static inline i iandnot(i a, i b) { return _mm512_andnot_si512(b, a); }
+	static inline i islli29(i a) { return _mm512_slli_epi32(a, 29); }
+	static inline i isrli5(i a) { return _mm512_srai_epi32(a, 5); }
+	static inline i ftoi(f a) { return _mm512_cvttps_epi32(a); }
+	static inline i iselect(m k, i a, i b) { return _mm512_mask_blend_epi32(k, b, a); }
+	static inline m ieq(i a, i b) { return _mm512_cmpeq_epi32_mask(a, b); }
+	static inline m igt(i a, i b) { return _mm512_cmpgt_epi32_mask(a, b); }
+	static inline m ige(i a, i b) { return _mm512_cmpge_epi32_mask(a, b); }
+
+	static inline m mand(m a, m b) { return (m)(a & b); }
+	static inline m mandnot(m a, m b) { return (m)(a & ~b); }
+	static inline m mor(m a, m b) { return (m)(a | b); }
+	static inline int bits(m a) { return (int)a; }
+
+	static inline f gather(const float* base, i idx, m k)
+	{
+		return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), k, idx, base, 4);
+	}
+};
+
+#include "viewshedPacket.h"
+
+void traceRayPacketAVX512(const cpuRayContext* c, const int* rays, int numRays, uint32_t* vis)
+{
+	traceRayPacket<vecAVX512>(c, rays, numRays, vis);
+}
+
+void xdrawOctantAVX512(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis)
+{
+	xdrawOctantKernel<vecAVX512>(c, o, ring, vis);
+}
+
+void refPlaneOctantAVX512(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis)
+{
+	refPlaneOctantKernel<vecAVX512>(c, o, elevT, ring, vis);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#else
+
+void traceRayPacketAVX512(const cpuRayContext* c, const int* rays, int numRays, uint32_t* vis)
+{
+	for (int r = 0; r < numRays; r++)
+		traceRayScalar(c, rays[r], vis);
+}
+
+void xdrawOctantAVX512(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis)
+{
+	xdrawOctantScalar(c, o, ring, vis);
+}
+
+void refPlaneOctantAVX512(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis)
+{
+	refPlaneOctantScalar(c, o, elevT, ring, vis);
+}
+
+#endif
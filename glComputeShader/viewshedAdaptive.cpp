@@ -0,0 +1,130 @@
+#include "viewshedCPU.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+/*
+* Adaptive ray spawning, after the adaptive ray casting of the voxel
+* and radio propagation literature. Rays are straight lines in pixel
+* space, marched one square ring around the observer at a time by all
+* rays of a sector together. Whenever two neighbouring rays are more
+* than a cell apart along the ring, a child ray is spawned halfway
+* between them, so every cell of every ring is sampled, once or twice,
+* instead of the many times the perimeter rays cross the cells near
+* the observer.
+*
+* A child starts where it is spawned, with the steeper horizon of its
+* two neighbours, the terrain behind it has been sampled by them.
+* Visibility and the earth curvature are those of the local projection.
+*/
+void adaptiveRaySector(const cpuRayContext* c, float a0, float a1, float maxRange, adaptiveScratch* s, uint32_t* vis, uint32_t* touched, rayCoverage* cov)
+{
+	const float sx = c->pixelScale[0], sy = c->pixelScale[1];
+	const float invTwoR = 0.5f / (c->effectiveRadius * 1e3f);
+	const float range2 = maxRange * maxRange;
+
+	auto makeRay = [](float angle, float horizon, bool ghost) {
+		adaptiveRay r;
+		r.angle = angle;
+		float cx = cosf(angle), cy = sinf(angle);
+		float m = std::max(fabsf(cx), fabsf(cy));
+		r.ux = cx / m;
+		r.uy = cy / m;
+		r.horizon = horizon;
+		r.live = true;
+		r.ghost = ghost;
+		return r;
+	};
+
+	/* The a1 ray belongs to the next sector, it only bounds the spawning */
+	s->rays.clear();
+	s->rays.push_back(makeRay(a0, -INFINITY, false));
+	s->rays.push_back(makeRay(a1, -INFINITY, true));
+	cov->raysLaunched += 1;
+
+	bool anyLive = true;
+	for (int t = 1; anyLive; t++) {
+		/* Spawn between neighbours more than a cell apart along ring t, drop rays dead on both sides */
+		s->next.clear();
+		for (size_t i = 0; i < s->rays.size(); i++) {
+			const adaptiveRay& r = s->rays[i];
+			bool last = i + 1 == s->rays.size();
+			bool deadLeft = i == 0 || !s->rays[i - 1].live;
+			bool deadRight = last || !s->rays[i + 1].live;
+			if (r.live || i == 0 || last || !deadLeft || !deadRight)
+				s->next.push_back(r);
+			if (last)
+				break;
+
+			const adaptiveRay& n = s->rays[i + 1];
+			if ((r.live || n.live) && (fabsf(n.ux - r.ux) + fabsf(n.uy - r.uy)) * (float)t > 1.0f) {
+				s->next.push_back(makeRay(0.5f * (r.angle + n.angle), std::max(r.horizon, n.horizon), false));
+				cov->raysLaunched++;
+			}
+		}
+		s->rays.swap(s->next);
+
+		anyLive = false;
+		for (size_t i = 0; i < s->rays.size(); i++) {
+			adaptiveRay& r = s->rays[i];
+			if (!r.live)
+				continue;
+
+			int x = c->x1 + (int)floorf((float)t * r.ux + 0.5f);
+			int y = c->y1 + (int)floorf((float)t * r.uy + 0.5f);
+			float dx = (float)(x - c->x1) * sx, dy = (float)(y - c->y1) * sy;
+			float d2 = dx * dx + dy * dy;
+			if (x < 0 || y < 0 || x >= c->W || y >= c->H || d2 > range2) {
+				r.live = false;
+				continue;
+			}
+			anyLive = true;
+
+			float d = sqrtf(d2);
+			float z = c->elev[(size_t)y * c->W + x] - d2 * invTwoR - c->h1;
+			if (!r.ghost) {
+				size_t word = (size_t)y * c->wordsPerRow + x / 32;
+				uint32_t bit = 1u << (x % 32);
+				cov->steps++;
+				touched[word] |= bit;
+				if (z + c->targetAltitude > r.horizon * d && inVerticalFOV(c, z, d))
+					vis[word] |= bit;
+			}
+			r.horizon = std::max(r.horizon, z / d);
+		}
+	}
+}
+
+/*
+* Work of the perimeter rays of this context in the local projection,
+* straight lines from the observer to every perimeter pixel, for
+* comparison with the adaptive mode.
+*/
+void perimeterRayCoverage(const cpuRayContext* c, rayCoverage* cov)
+{
+	std::vector<uint32_t> touched((size_t)c->wordsPerRow * c->H, 0);
+	cov->raysLaunched = cov->steps = cov->cellsMissed = 0;
+
+	for (int idx = 0; idx < c->numRays; idx++) {
+		int jx, jy;
+		rayEndpoint(c, idx, jx, jy);
+		int n = std::max(abs(jx - c->x1), abs(jy - c->y1));
+		cov->raysLaunched++;
+		for (int k = 1; k <= n; k++) {
+			int x = c->x1 + (int)floorf((float)(k * (jx - c->x1)) / (float)n + 0.5f);
+			int y = c->y1 + (int)floorf((float)(k * (jy - c->y1)) / (float)n + 0.5f);
+			/* An observer on the right or bottom bound starts outside the grid */
+			if (x < c->W && y < c->H)
+				touched[(size_t)y * c->wordsPerRow + x / 32] |= 1u << (x % 32);
+			cov->steps++;
+		}
+	}
+	if (c->x1 >= 0 && c->y1 >= 0 && c->x1 < c->W && c->y1 < c->H)
+		touched[(size_t)c->y1 * c->wordsPerRow + c->x1 / 32] |= 1u << (c->x1 % 32);
+
+	for (int y = 0; y < c->H; y++) {
+		for (int x = 0; x < c->W; x++) {
+			cov->cellsMissed += inRangeCircle(c, x, y) && !((touched[(size_t)y * c->wordsPerRow + x / 32] >> (x % 32)) & 1);
+		}
+	}
+}
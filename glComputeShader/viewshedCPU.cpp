@@ -0,0 +1,949 @@
+#include "viewshedCPU.h"
+#include "timer.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define VIEWSHED_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+const float PI = 3.1415926535897932384626433832795f;
+
+static inline void toIntrinsic(const cpuRayContext* c, float lat, float lon, int& px, int& py)
+{
+	px = (int)roundf((lon - c->imgBounds[1]) / (c->imgBounds[3] - c->imgBounds[1]) * (float)c->W);
+	py = (int)roundf((lat - c->imgBounds[0]) / (c->imgBounds[2] - c->imgBounds[0]) * (float)c->H);
+}
+
+static inline void fromInstrinsic(const cpuRayContext* c, int jx, int jy, float& lat, float& lon)
+{
+	lon = c->imgBounds[1] + (float)jx / (float)c->W * (c->imgBounds[3] - c->imgBounds[1]);
+	lat = c->imgBounds[0] + (float)jy / (float)c->H * (c->imgBounds[2] - c->imgBounds[0]);
+}
+
+/* imageLoad() returns zero outside of the image */
+static inline float loadElevation(const cpuRayContext* c, int x, int y)
+{
+	if (x < 0 || y < 0 || x >= c->W || y >= c->H)
+		return 0.0f;
+	return c->elev[(size_t)y * c->W + x];
+}
+
+/* length() of an ivec2 difference */
+static inline float pixelDistance(int dx, int dy)
+{
+	float fx = (float)dx, fy = (float)dy;
+	return sqrtf(fx * fx + fy * fy);
+}
+
+/* earthSinCos() of visibility.comp */
+static inline void earthSinCos(float phi, float& s, float& c)
+{
+	if (fabsf(phi) < 0.1f) {
+		float p2 = phi * phi;
+		s = phi * (1.0f - p2 * (1.0f / 6.0f - p2 * (1.0f / 120.0f)));
+		c = 1.0f - p2 * (0.5f - p2 * (1.0f / 24.0f - p2 * (1.0f / 720.0f)));
+	}
+	else {
+		s = sinf(phi);
+		c = cosf(phi);
+	}
+}
+
+/*
+* Fills the per-run constants, including the
+* observer pixel and height like visibility.comp.
+* With elev NULL the caller adds the ground height
+* at the observer pixel to h1.
+*/
+void setupRayContext(cpuRayContext* c, const viewshedParams* p, const float* elev, int W, int H, bool localProjection)
+{
+	c->elev = elev;
+	c->W = W;
+	c->H = H;
+	c->wordsPerRow = (W + 31) / 32;
+
+	c->lat1 = (float)p->lat1;
+	c->lon1 = (float)p->lon1;
+	c->observerAltitude = (float)p->observerAltitude;
+	c->targetAltitude = (float)p->targetAltitude;
+	c->actualRadius = (float)p->actualRadius;
+	c->effectiveRadius = (float)p->effectiveRadius;
+	for (int i = 0; i < 4; i++)
+		c->imgBounds[i] = (float)p->imgBounds[i];
+
+	toIntrinsic(c, c->lat1, c->lon1, c->x1, c->y1);
+	c->h1 = (elev ? loadElevation(c, c->x1, c->y1) : 0.0f) + c->observerAltitude;
+	c->sinLat1 = sinf(c->lat1);
+	c->rotationWaypoints = false;
+	c->tangentCompare = false;
+
+	/* One straight segment per ray in the observer-local projection */
+	c->localProjection = localProjection;
+	c->waypointStep = localProjection ? 1.0f : 0.01f;
+	double scale[2];
+	localPixelScale(p, W, H, scale);
+	c->pixelScale[0] = (float)scale[0];
+	c->pixelScale[1] = (float)scale[1];
+
+	c->numRays = perimeterRayCount(W, H);
+	c->rangeRadius[0] = c->rangeRadius[1] = 0;
+	c->azimuthStart = c->azimuthStep = 0;
+	c->verticalFOV = false;
+	c->elevationTan[0] = -FLT_MAX;
+	c->elevationTan[1] = FLT_MAX;
+}
+
+/*
+* Moves an observer on the right or bottom bound, which rounds
+* to column W or row H, into the last cell of the grid. The
+* octant algorithms grow their rings from the observer cell.
+*/
+static void clampObserverCell(cpuRayContext* c)
+{
+	int x1 = std::min(std::max(c->x1, 0), c->W - 1);
+	int y1 = std::min(std::max(c->y1, 0), c->H - 1);
+	if (x1 == c->x1 && y1 == c->y1)
+		return;
+
+	c->h1 += loadElevation(c, x1, y1) - loadElevation(c, c->x1, c->y1);
+	c->x1 = x1;
+	c->y1 = y1;
+}
+
+/*
+* Elevation limits of the context, a limit
+* at +-pi/2 or beyond stands for none.
+*/
+void setupRayFOV(cpuRayContext* c, double minElevation, double maxElevation)
+{
+	const double halfPi = 1.5707963267948966;
+	c->verticalFOV = minElevation > -halfPi || maxElevation < halfPi;
+	c->elevationTan[0] = minElevation > -halfPi ? (float)tan(minElevation) : -FLT_MAX;
+	c->elevationTan[1] = maxElevation < halfPi ? (float)tan(maxElevation) : FLT_MAX;
+}
+
+/*
+* Per-ray constants of the great-circle track from the
+* observer to the endpoint of ray idx.
+*/
+void setupRay(const cpuRayContext* c, int idx, cpuRay* ray)
+{
+	const float lat1 = c->lat1, lon1 = c->lon1;
+
+	// Job index to endpoint (intrinsic)
+	int jx, jy;
+	rayEndpoint(c, idx, jx, jy);
+	ray->jx = jx;
+	ray->jy = jy;
+
+	if (c->localProjection) {
+		// Closed-form length of the straight segment, in radians
+		float mx = (float)(jx - c->x1) * c->pixelScale[0];
+		float my = (float)(jy - c->y1) * c->pixelScale[1];
+		ray->d = sqrtf(mx * mx + my * my) / (c->actualRadius * 1e3f);
+		return;
+	}
+
+	// Ray endpoints from instrinsic units to lat,lon
+	float lat2, lon2;
+	fromInstrinsic(c, jx, jy, lat2, lon2);
+
+	// Distance between origin and endpoint, in units of radians
+	float sdlat = sinf((lat1 - lat2) / 2);
+	float sdlon = sinf((lon1 - lon2) / 2);
+	ray->d = 2 * asinf(sqrtf(sdlat * sdlat + cosf(lat1) * cosf(lat2) * sdlon * sdlon));
+	ray->sinD = sinf(ray->d);
+
+	ray->p1a = cosf(lat1) * cosf(lon1);
+	ray->p1b = cosf(lat2) * cosf(lon2);
+	ray->p2a = cosf(lat1) * sinf(lon1);
+	ray->p2b = cosf(lat2) * sinf(lon2);
+	ray->sinLat2 = sinf(lat2);
+
+	if (c->rotationWaypoints)
+		ray->track = gcInit(lat1, lon1, lat2, lon2, ray->d, 100);
+}
+
+/*
+* Great-circle track way point at fractional f (f=0 is the
+* observer, f=1 is the endpoint), in intrinsic units. With
+* rotationWaypoints the track is stepped instead, so way
+* points have to be asked for in order, f = 0.01, 0.02, ...
+*/
+void rayWaypoint(const cpuRayContext* c, cpuRay* ray, float f, int& xf, int& yf)
+{
+	if (c->localProjection) {
+		xf = ray->jx;
+		yf = ray->jy;
+		return;
+	}
+
+	if (c->rotationWaypoints) {
+		gcNext(ray->track);
+		toIntrinsic(c, gcLatitude(ray->track), gcLongitude(ray->track), xf, yf);
+		return;
+	}
+
+	float A = sinf((1.0f - f) * ray->d) / ray->sinD;
+	float B = sinf(f * ray->d) / ray->sinD;
+	float x = A * ray->p1a + B * ray->p1b;
+	float y = A * ray->p2a + B * ray->p2b;
+	float z = A * c->sinLat1 + B * ray->sinLat2;
+
+	// Segment end location
+	float latf = atan2f(z, sqrtf(x * x + y * y));
+	float lonf = atan2f(y, x);
+
+	// Convert segment end location to intrinsic units (pixels)
+	toIntrinsic(c, latf, lonf, xf, yf);
+}
+
+/*
+* Scalar reference kernel, one ray of visibility.comp. Follows the
+* shader statement by statement so both produce the same bits.
+*/
+void traceRayScalar(const cpuRayContext* c, int idx, uint32_t* vis)
+{
+	cpuRay ray;
+	setupRay(c, idx, &ray);
+	const float d = ray.d;
+
+	const float reff = c->effectiveRadius * 1e3f;
+	const float invReff = 1.0f / reff;
+
+	int xp = c->x1, yp = c->y1;
+	float maxAng = -PI;
+	float flast = 0.0f;
+
+	/* tangentCompare, steepest slope as maxNum/maxDen, maxDen == 0 stands for -infinity */
+	float maxNum = -1.0f, maxDen = 0.0f;
+
+	for (float f = c->waypointStep; f <= 1.0f; f += c->waypointStep) {
+		// Compute great-circle track way point at fractional f
+		int xf, yf;
+		rayWaypoint(c, &ray, f, xf, yf);
+
+		// Number of pixels in the segment being drawn
+		float npix = pixelDistance(xf - xp, yf - yp);
+
+		// Total segment length in meters
+		float drpix = (f - flast) * d * c->actualRadius * 1e3f;
+
+		// Bresenham Algorithm to draw a line between xp,yp and xf,yf
+		int dx = abs(xf - xp);
+		int sx = xp < xf ? 1 : -1;
+		int dy = -abs(yf - yp);
+		int sy = yp < yf ? 1 : -1;
+		int err = dx + dy; /* error value e_xy */
+		float invNpix = 1.0f / npix;
+
+		while (true) {
+			bool visible;
+			if (c->tangentCompare) {
+				// ANGLE_MODE 1, no atan or division per step
+				float drng = (1 - pixelDistance(xf - xp, yf - yp) * invNpix) * drpix;
+				float gndRng = (d * flast * c->actualRadius * 1e3f + drng);
+
+				float r = reff + loadElevation(c, xp, yp);
+				float sinPhi, cosPhi;
+				earthSinCos(gndRng * invReff, sinPhi, cosPhi);
+				float rng = r * sinPhi;
+				float el = r * cosPhi - reff;
+				el = el - c->h1;
+
+				// rng >= 0, so a/rng > maxNum/maxDen is a*maxDen > maxNum*rng
+				visible = (el + c->targetAltitude) * maxDen > maxNum * rng || maxDen == 0.0f;
+				visible = visible && inVerticalFOV(c, el, rng);
+				if (el * maxDen > maxNum * rng || maxDen == 0.0f) {
+					maxNum = el;
+					maxDen = rng;
+				}
+			}
+			else {
+				// Range distance within the segment traversed by line drawing algorithm so far
+				float drng = (1 - pixelDistance(xf - xp, yf - yp) / npix) * drpix;
+
+				// Compute the total distance along the ray so far
+				float gndRng = (d * flast * c->actualRadius * 1e3f + drng);
+
+				// Adjust Earth profile altitude to take into account effective radius of the Earth
+				float r = reff + loadElevation(c, xp, yp);
+				float phi = gndRng / reff;
+				float rng = r * sinf(phi);
+				float el = r * cosf(phi) - reff;
+				el = el - c->h1;
+
+				// Compute angles of sight to the terrain and to the elevation above ground level
+				float elAng = atanf(el / rng);
+				float testAng = atanf((el + c->targetAltitude) / rng);
+				visible = testAng > maxAng && inVerticalFOV(c, el, rng);
+
+				// GLSL max(x,y) returns x when y is NaN
+				maxAng = (maxAng < elAng) ? elAng : maxAng;
+			}
+
+			// Pack into 32-bit words, out of range stores are dropped like imageAtomicOr
+			if (xp >= 0 && yp >= 0 && (unsigned int)xp < c->wordsPerRow * 32 && yp < c->H)
+				vis[(size_t)yp * c->wordsPerRow + xp / 32] |= (uint32_t)visible << (xp % 32);
+
+			if (xp == xf && yp == yf) break;
+			int e2 = 2 * err;
+			if (e2 >= dy) { err += dy; xp += sx; }  /* e_xy+e_x > 0 */
+			if (e2 <= dx) { err += dx; yp += sy; } /* e_xy+e_y < 0 */
+		}
+
+		flast = f;
+	}
+}
+
+#ifdef VIEWSHED_X86
+static void cpuidex(unsigned int leaf, unsigned int subleaf, unsigned int r[4])
+{
+#ifdef _MSC_VER
+	__cpuidex((int*)r, (int)leaf, (int)subleaf);
+#else
+	__cpuid_count(leaf, subleaf, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+static uint64_t xgetbv0()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((uint64_t)hi << 32) | lo;
+#endif
+}
+#endif
+
+/*
+* Best instruction set supported by both the CPU and the OS.
+*/
+simdLevel detectSimdLevel()
+{
+#ifdef VIEWSHED_X86
+	unsigned int r[4];
+
+	cpuidex(0, 0, r);
+	unsigned int maxLeaf = r[0];
+
+	cpuidex(1, 0, r);
+	bool sse41 = (r[2] >> 19) & 1;
+	bool osxsave = (r[2] >> 27) & 1;
+	bool avx = (r[2] >> 28) & 1;
+	if (!sse41)
+		return SIMD_SCALAR;
+	if (!osxsave || !avx || maxLeaf < 7)
+		return SIMD_SSE4;
+
+	/* The OS has to save the YMM (and ZMM) state on context switches */
+	uint64_t xcr0 = xgetbv0();
+	if ((xcr0 & 0x6) != 0x6)
+		return SIMD_SSE4;
+
+	cpuidex(7, 0, r);
+	bool avx2 = (r[1] >> 5) & 1;
+	bool avx512f = (r[1] >> 16) & 1;
+	if (avx512f && (xcr0 & 0xe0) == 0xe0)
+		return SIMD_AVX512;
+	if (avx2)
+		return SIMD_AVX2;
+	return SIMD_SSE4;
+#else
+	return SIMD_SCALAR;
+#endif
+}
+
+const char* simdLevelName(simdLevel level)
+{
+	switch (level) {
+	case SIMD_SSE4: return "SSE4";
+	case SIMD_AVX2: return "AVX2";
+	case SIMD_AVX512: return "AVX-512";
+	case SIMD_AUTO: return "auto";
+	default: return "scalar";
+	}
+}
+
+const char* cpuAlgorithmName(cpuAlgorithm algorithm)
+{
+	switch (algorithm) {
+	case CPU_RADIAL_SWEEP: return "radial sweep";
+	case CPU_XDRAW: return "XDraw";
+	case CPU_REFERENCE_PLANE: return "reference plane";
+	case CPU_ADAPTIVE_RAYS: return "adaptive rays";
+	default: return "rays";
+	}
+}
+
+static rayPacketFunc packetKernel(simdLevel level, int& lanes)
+{
+	switch (level) {
+	case SIMD_SSE4: lanes = 4; return traceRayPacketSSE4;
+	case SIMD_AVX2: lanes = 8; return traceRayPacketAVX2;
+	case SIMD_AVX512: lanes = 16; return traceRayPacketAVX512;
+	default: lanes = 1; return nullptr;
+	}
+}
+
+
+CPUViewshedEngine::CPUViewshedEngine()
+	: rayTime(0), mergeTime(0), simd(SIMD_SCALAR), rotationWaypoints(false), localProjection(false), tangentCompare(false),
+	algorithm(CPU_RAYS), pool(nullptr)
+{
+	coverage.raysLaunched = coverage.steps = coverage.cellsMissed = 0;
+}
+
+CPUViewshedEngine::~CPUViewshedEngine()
+{
+	release();
+}
+
+/*
+* Starts the worker threads, numThreads = 0 uses one thread per
+* hardware thread. The SIMD level is capped to what the CPU supports.
+*/
+int CPUViewshedEngine::init(unsigned int numThreads, simdLevel level)
+{
+	simdLevel best = detectSimdLevel();
+	simd = (level == SIMD_AUTO || level > best) ? best : level;
+
+	delete pool;
+	pool = new ThreadPool(numThreads);
+	threadVis.assign(pool->size(), std::vector<uint32_t>());
+	return 1;
+}
+
+/*
+* Keeps a copy of the row-major DEM (in meters)
+* and sizes the per-thread output bitmaps. elev NULL
+* zeroes the DEM for setElevationRect().
+*/
+int CPUViewshedEngine::setElevation(const float* e, unsigned int w, unsigned int h)
+{
+	if (pool == nullptr) {
+		printf("CPUViewshedEngine::setElevation(): engine not initialized\n");
+		return 0;
+	}
+	if (w < 2 || h < 2) {
+		printf("CPUViewshedEngine::setElevation(): DEM must be at least 2x2\n");
+		return 0;
+	}
+
+	width = w;
+	height = h;
+	wordsPerRow = (w + 31) / 32;
+
+	if (e)
+		elev.assign(e, e + (size_t)w * h);
+	else
+		elev.assign((size_t)w * h, 0.0f);
+	elevT.clear();
+	vis.assign((size_t)wordsPerRow * h, 0);
+	for (size_t t = 0; t < threadVis.size(); t++)
+		threadVis[t].assign((size_t)wordsPerRow * h, 0);
+	for (size_t t = 0; t < threadTouched.size(); t++)
+		threadTouched[t].assign((size_t)wordsPerRow * h, 0);
+
+	return 1;
+}
+
+/*
+* Copies w x h cells to (x,y) of the DEM, rows of the
+* source are stride floats apart.
+*/
+int CPUViewshedEngine::setElevationRect(const float* e, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned int stride)
+{
+	if (elev.empty() || x + w > width || y + h > height) {
+		printf("CPUViewshedEngine::setElevationRect(): rectangle outside of the DEM\n");
+		return 0;
+	}
+
+	for (unsigned int r = 0; r < h; r++)
+		memcpy(&elev[(size_t)(y + r) * width + x], &e[(size_t)r * stride], w * sizeof(float));
+	elevT.clear();
+
+	return 1;
+}
+
+/*
+* Computes the viewshed for one observer.
+*/
+int CPUViewshedEngine::run(const viewshedParams* p)
+{
+	if (pool == nullptr || elev.empty()) {
+		printf("CPUViewshedEngine::run(): engine has no elevation data\n");
+		return 0;
+	}
+
+	if (!observerInBounds(p)) {
+		printf("CPUViewshedEngine::run(): observer location is outside defined altitude raster\n");
+		return 0;
+	}
+
+	if (!traceRays(p))
+		return 0;
+
+	uint64_t startTime = tic();
+
+	mergeThreadResults(false);
+
+	mergeTime = toc(startTime);
+
+	return 1;
+}
+
+/*
+* Counts, for every cell, the observers p[0..numObservers) that
+* see it. rayTime and mergeTime add up over all observers.
+*/
+int CPUViewshedEngine::runCumulative(const viewshedParams* p, unsigned int numObservers)
+{
+	if (pool == nullptr || elev.empty()) {
+		printf("CPUViewshedEngine::runCumulative(): engine has no elevation data\n");
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < numObservers; i++) {
+		if (!observerInBounds(&p[i])) {
+			printf("CPUViewshedEngine::runCumulative(): observer %u location is outside defined altitude raster\n", i);
+			return 0;
+		}
+	}
+
+	count.assign((size_t)width * height, 0);
+
+	double totalRayTime = 0, totalMergeTime = 0;
+	for (unsigned int i = 0; i < numObservers; i++) {
+		if (!traceRays(&p[i]))
+			return 0;
+		totalRayTime += rayTime;
+
+		uint64_t startTime = tic();
+		mergeThreadResults(true);
+		totalMergeTime += toc(startTime);
+	}
+
+	rayTime = totalRayTime;
+	mergeTime = totalMergeTime;
+
+	return 1;
+}
+
+/*
+* Traces all rays of one observer into the per-thread bitmaps.
+*/
+int CPUViewshedEngine::traceRays(const viewshedParams* p)
+{
+	cpuRayContext c;
+	setupRayContext(&c, p, elev.data(), width, height, localProjection);
+	c.rotationWaypoints = rotationWaypoints;
+	c.tangentCompare = tangentCompare;
+
+	if ((algorithm != CPU_RAYS && azimuthSector()) || (algorithm != CPU_RAYS && algorithm != CPU_ADAPTIVE_RAYS && verticalFOV())) {
+		printf("CPUViewshedEngine::run(): azimuth sector and elevation limits need a ray algorithm\n");
+		return 0;
+	}
+
+	/* Rays to the range circle, the other algorithms only take its radius and box */
+	viewshedRays rays;
+	raySet(p, &rays);
+	if (rays.numRays > 0) {
+		c.numRays = (int)rays.numRays;
+		c.rangeRadius[0] = rays.radius[0];
+		c.rangeRadius[1] = rays.radius[1];
+		c.azimuthStart = rays.azimuthStart;
+		c.azimuthStep = rays.azimuthStep;
+		memcpy(rangeBox, rays.box, sizeof(rangeBox));
+	}
+	else {
+		rangeBox[0] = rangeBox[1] = 0;
+		rangeBox[2] = width - 1;
+		rangeBox[3] = height - 1;
+	}
+	setupRayFOV(&c, minElevation, maxElevation);
+
+	uint64_t startTime = tic();
+
+	if (algorithm == CPU_RADIAL_SWEEP) {
+		/* Sweep events keep the cell in 30 bits */
+		if ((size_t)width * height >= ((size_t)1 << 30)) {
+			printf("CPUViewshedEngine::run(): DEM too large for the exact mode\n");
+			return 0;
+		}
+		sweepSectors(&c);
+		rayTime = toc(startTime);
+		return 1;
+	}
+
+	if (algorithm == CPU_XDRAW || algorithm == CPU_REFERENCE_PLANE) {
+		clampObserverCell(&c);
+		if (algorithm == CPU_XDRAW)
+			xdrawOctants(&c);
+		else
+			refPlaneOctants(&c);
+		clipToRange(&c);
+		rayTime = toc(startTime);
+		return 1;
+	}
+
+	if (algorithm == CPU_ADAPTIVE_RAYS) {
+		adaptiveRays(&c, rays.numRays > 0 ? rays.range : INFINITY);
+		rayTime = toc(startTime);
+		return 1;
+	}
+
+	int lanes;
+	rayPacketFunc kernel = packetKernel(simd, lanes);
+
+	/* Gathers use 32-bit indices */
+	if (kernel != nullptr && (size_t)width * height < ((size_t)1 << 31)) {
+		const int blockSize = 4 * lanes;
+		const int numRays = c.numRays;
+
+		sortRayBlocks(&c, blockSize);
+		pool->run(blockOrder.size(), [&](size_t task, unsigned int worker) {
+			int first = blockOrder[task] * blockSize;
+			kernel(&c, &rayOrder[first], std::min(blockSize, numRays - first), threadVis[worker].data());
+		});
+	}
+	else {
+		sortRays(&c);
+		pool->run(rayOrder.size(), [&](size_t task, unsigned int worker) {
+			traceRayScalar(&c, rayOrder[task], threadVis[worker].data());
+		});
+	}
+
+	rayTime = toc(startTime);
+
+	return 1;
+}
+
+/*
+* Exact mode, radial sweep of the DEM in range. Cell angles and slopes
+* are set up by row bands, the events of all cells are sorted once,
+* then the circle is cut into sectors that sweep their run of the
+* events independently, several per worker for load balance.
+*/
+void CPUViewshedEngine::sweepSectors(const cpuRayContext* c)
+{
+	const int rowsPerBand = 16;
+	sweepCells.resize((size_t)width * height);
+	pool->run((height + rowsPerBand - 1) / rowsPerBand, [&](size_t band, unsigned int worker) {
+		int y0 = (int)band * rowsPerBand;
+		setupSweepCells(c, y0, std::min((int)height, y0 + rowsPerBand), sweepCells.data());
+	});
+	rankSweepCells(c, sweepCells.data(), sweepOrder, sweepEvents);
+	sortSweepEvents(c, sweepCells.data(), sweepEvents, sweepOrder);
+
+	unsigned int numSectors = pool->size() > 1 ? 4 * pool->size() : 1;
+	std::vector<size_t> first(numSectors + 1);
+	for (unsigned int s = 1; s < numSectors; s++)
+		first[s] = firstSweepEvent(sweepEvents, (float)(2 * PI * s / numSectors));
+	first[numSectors] = sweepEvents.size();
+
+	sweepWork.resize(pool->size());
+	pool->run(numSectors, [&](size_t s, unsigned int worker) {
+		float a0 = s == 0 ? 0.0f : (float)(2 * PI * s / numSectors);
+		radialSweepSector(c, sweepCells.data(), sweepEvents.data() + first[s], first[s + 1] - first[s], a0, &sweepWork[worker], threadVis[worker].data());
+	});
+
+	/* The observer sees its own cell */
+	if (c->x1 >= 0 && c->y1 >= 0 && c->x1 < c->W && c->y1 < c->H)
+		threadVis[0][(size_t)c->y1 * wordsPerRow + c->x1 / 32] |= 1u << (c->x1 % 32);
+}
+
+/*
+* XDraw mode, the eight octants around the observer grow their rings
+* independently, cells on the octant borders are done twice.
+*/
+void CPUViewshedEngine::xdrawOctants(const cpuRayContext* c)
+{
+	xdrawOctantFunc kernel;
+	switch (simd) {
+	case SIMD_SSE4: kernel = xdrawOctantSSE4; break;
+	case SIMD_AVX2: kernel = xdrawOctantAVX2; break;
+	case SIMD_AVX512: kernel = xdrawOctantAVX512; break;
+	default: kernel = xdrawOctantScalar; break;
+	}
+	/* Gathers use 32-bit indices */
+	if ((size_t)width * height >= ((size_t)1 << 31))
+		kernel = xdrawOctantScalar;
+
+	xdrawWork.resize(pool->size());
+	pool->run(8, [&](size_t o, unsigned int worker) {
+		xdrawOctant oct;
+		setupXDrawOctant(c, (int)o, &oct);
+		xdrawWork[worker].resize(xdrawScratchSize(c->W, c->H));
+		kernel(c, &oct, xdrawWork[worker].data(), threadVis[worker].data());
+	});
+
+	/* The observer sees its own cell */
+	if (c->x1 >= 0 && c->y1 >= 0 && c->x1 < c->W && c->y1 < c->H)
+		threadVis[0][(size_t)c->y1 * wordsPerRow + c->x1 / 32] |= 1u << (c->x1 % 32);
+}
+
+/*
+* Clears the cells of the range box outside the range circle, the
+* octants reach its corners.
+*/
+void CPUViewshedEngine::clipToRange(const cpuRayContext* c)
+{
+	if (c->rangeRadius[0] == 0)
+		return;
+
+	for (unsigned int y = rangeBox[1]; y <= rangeBox[3]; y++) {
+		for (unsigned int x = rangeBox[0]; x <= rangeBox[2]; x++) {
+			if (inRangeCircle(c, (int)x, (int)y))
+				continue;
+			for (size_t t = 0; t < threadVis.size(); t++)
+				threadVis[t][(size_t)y * wordsPerRow + x / 32] &= ~(1u << (x % 32));
+		}
+	}
+}
+
+/*
+* Reference-plane mode, the XDraw octants swept row by row. The
+* transposed DEM for the east and west octants is built by the first
+* run after setElevation().
+*/
+void CPUViewshedEngine::refPlaneOctants(const cpuRayContext* c)
+{
+	refPlaneOctantFunc kernel;
+	switch (simd) {
+	case SIMD_SSE4: kernel = refPlaneOctantSSE4; break;
+	case SIMD_AVX2: kernel = refPlaneOctantAVX2; break;
+	case SIMD_AVX512: kernel = refPlaneOctantAVX512; break;
+	default: kernel = refPlaneOctantScalar; break;
+	}
+
+	if (elevT.empty()) {
+		const unsigned int colsPerBand = 16;
+		elevT.resize((size_t)width * height);
+		pool->run((width + colsPerBand - 1) / colsPerBand, [&](size_t band, unsigned int worker) {
+			unsigned int x0 = (unsigned int)band * colsPerBand, x1 = std::min(width, x0 + colsPerBand);
+			for (unsigned int y = 0; y < height; y++) {
+				for (unsigned int x = x0; x < x1; x++)
+					elevT[(size_t)x * height + y] = elev[(size_t)y * width + x];
+			}
+		});
+	}
+
+	xdrawWork.resize(pool->size());
+	pool->run(8, [&](size_t o, unsigned int worker) {
+		xdrawOctant oct;
+		setupXDrawOctant(c, (int)o, &oct);
+		xdrawWork[worker].resize(xdrawScratchSize(c->W, c->H));
+		kernel(c, &oct, elevT.data(), xdrawWork[worker].data(), threadVis[worker].data());
+	});
+
+	/* The observer sees its own cell */
+	if (c->x1 >= 0 && c->y1 >= 0 && c->x1 < c->W && c->y1 < c->H)
+		threadVis[0][(size_t)c->y1 * wordsPerRow + c->x1 / 32] |= 1u << (c->x1 % 32);
+}
+
+/*
+* Adaptive mode, the circle is cut into sectors that spawn their rays
+* independently, several per worker for load balance. The cells no
+* ray sampled are counted from the per-thread sample bitmaps, in the
+* range box and within maxRange (in meters, INFINITY for none).
+*/
+void CPUViewshedEngine::adaptiveRays(const cpuRayContext* c, float maxRange)
+{
+	unsigned int numSectors = std::max(8u, 4 * pool->size());
+	std::vector<rayCoverage> sectorCoverage(numSectors);
+	adaptiveWork.resize(pool->size());
+	threadTouched.resize(pool->size());
+	for (size_t t = 0; t < threadTouched.size(); t++) {
+		if (threadTouched[t].size() != (size_t)wordsPerRow * height)
+			threadTouched[t].assign((size_t)wordsPerRow * height, 0);
+	}
+
+	pool->run(numSectors, [&](size_t s, unsigned int worker) {
+		float a0 = (float)(2 * PI * s / numSectors);
+		float a1 = (float)(2 * PI * (s + 1) / numSectors);
+		rayCoverage* cov = &sectorCoverage[s];
+		cov->raysLaunched = cov->steps = cov->cellsMissed = 0;
+		adaptiveRaySector(c, a0, a1, maxRange, &adaptiveWork[worker], threadVis[worker].data(), threadTouched[worker].data(), cov);
+	});
+
+	/* The observer sees its own cell */
+	if (c->x1 >= 0 && c->y1 >= 0 && c->x1 < c->W && c->y1 < c->H) {
+		threadVis[0][(size_t)c->y1 * wordsPerRow + c->x1 / 32] |= 1u << (c->x1 % 32);
+		threadTouched[0][(size_t)c->y1 * wordsPerRow + c->x1 / 32] |= 1u << (c->x1 % 32);
+	}
+
+	coverage.raysLaunched = coverage.steps = 0;
+	for (unsigned int s = 0; s < numSectors; s++) {
+		coverage.raysLaunched += sectorCoverage[s].raysLaunched;
+		coverage.steps += sectorCoverage[s].steps;
+	}
+
+	/* Missed cells by rows of the range box, clearing the sample bitmaps on the way */
+	const float sx = c->pixelScale[0], sy = c->pixelScale[1];
+	const float range2 = maxRange * maxRange;
+	std::vector<uint64_t> rowMissed(rangeBox[3] - rangeBox[1] + 1);
+	pool->run(rowMissed.size(), [&](size_t r, unsigned int worker) {
+		unsigned int y = rangeBox[1] + (unsigned int)r;
+		float dy = (float)((int)y - c->y1) * sy;
+
+		uint64_t missed = 0;
+		for (unsigned int x = rangeBox[0]; x <= rangeBox[2]; x++) {
+			float dx = (float)((int)x - c->x1) * sx;
+			bool sampled = false;
+			for (size_t t = 0; t < threadTouched.size() && !sampled; t++)
+				sampled = (threadTouched[t][(size_t)y * wordsPerRow + x / 32] >> (x % 32)) & 1;
+			missed += !sampled && dx * dx + dy * dy <= range2;
+		}
+		for (size_t t = 0; t < threadTouched.size(); t++)
+			memset(&threadTouched[t][(size_t)y * wordsPerRow], 0, wordsPerRow * sizeof(uint32_t));
+		rowMissed[r] = missed;
+	});
+
+	coverage.cellsMissed = 0;
+	for (size_t r = 0; r < rowMissed.size(); r++)
+		coverage.cellsMissed += rowMissed[r];
+}
+
+/*
+* Orders the rays by their length in pixels, longest first, so the
+* expensive rays start early and short ones fill in at the end.
+*/
+void CPUViewshedEngine::sortRays(const cpuRayContext* c)
+{
+	int numRays = c->numRays;
+	std::vector<int> len(numRays);
+
+	rayOrder.resize(numRays);
+	for (int i = 0; i < numRays; i++) {
+		int jx, jy;
+		rayEndpoint(c, i, jx, jy);
+		len[i] = std::max(abs(jx - c->x1), abs(jy - c->y1));
+		rayOrder[i] = i;
+	}
+
+	std::stable_sort(rayOrder.begin(), rayOrder.end(), [&](int a, int b) { return len[a] > len[b]; });
+}
+
+/*
+* Splits the rays into blocks of adjacent azimuths for the packet
+* kernels and orders the blocks by their longest ray, longest first.
+*/
+void CPUViewshedEngine::sortRayBlocks(const cpuRayContext* c, int blockSize)
+{
+	int numRays = c->numRays;
+	int numBlocks = (numRays + blockSize - 1) / blockSize;
+	std::vector<int> len(numBlocks, 0);
+
+	rayOrder.resize(numRays);
+	for (int i = 0; i < numRays; i++) {
+		int jx, jy;
+		rayEndpoint(c, i, jx, jy);
+		int b = i / blockSize;
+		len[b] = std::max(len[b], std::max(abs(jx - c->x1), abs(jy - c->y1)));
+		rayOrder[i] = i;
+	}
+
+	blockOrder.resize(numBlocks);
+	for (int b = 0; b < numBlocks; b++)
+		blockOrder[b] = b;
+
+	std::stable_sort(blockOrder.begin(), blockOrder.end(), [&](int a, int b) { return len[a] > len[b]; });
+}
+
+/*
+* ORs the per-thread bitmaps into the result by row bands, and
+* clears them on the way for the next run. With addCount, every
+* visible cell of the result is also added to the count raster.
+* Only the rows of the range box can have been written.
+*/
+void CPUViewshedEngine::mergeThreadResults(bool addCount)
+{
+	const size_t rowsPerBand = 16;
+	const size_t y0 = rangeBox[1], y1 = (size_t)rangeBox[3] + 1;
+	const size_t numBands = (y1 - y0 + rowsPerBand - 1) / rowsPerBand;
+
+	memset(vis.data(), 0, y0 * wordsPerRow * sizeof(uint32_t));
+	memset(vis.data() + y1 * wordsPerRow, 0, (height - y1) * wordsPerRow * sizeof(uint32_t));
+
+	pool->run(numBands, [&](size_t band, unsigned int worker) {
+		size_t begin = (y0 + band * rowsPerBand) * wordsPerRow;
+		size_t end = std::min(y1, y0 + (band + 1) * rowsPerBand) * wordsPerRow;
+
+		memset(&vis[begin], 0, (end - begin) * sizeof(uint32_t));
+		for (size_t t = 0; t < threadVis.size(); t++) {
+			uint32_t* src = threadVis[t].data();
+			for (size_t i = begin; i < end; i++) {
+				vis[i] |= src[i];
+				src[i] = 0;
+			}
+		}
+
+		if (addCount) {
+			for (size_t i = begin; i < end; i++) {
+				uint32_t* row = &count[(i / wordsPerRow) * width + (i % wordsPerRow) * 32];
+				for (uint32_t bits = vis[i]; bits; bits &= bits - 1)
+					row[lowestBit(bits)]++;
+			}
+		}
+	});
+}
+
+/*
+* Copies out the packed result of the last run.
+*/
+int CPUViewshedEngine::readPacked(uint32_t* packed)
+{
+	if (vis.empty())
+		return 0;
+
+	memcpy(packed, vis.data(), vis.size() * sizeof(uint32_t));
+	return 1;
+}
+
+/*
+* Copies out the count raster of the last runCumulative().
+*/
+int CPUViewshedEngine::readCount(uint32_t* c)
+{
+	if (count.empty())
+		return 0;
+
+	memcpy(c, count.data(), count.size() * sizeof(uint32_t));
+	return 1;
+}
+
+void CPUViewshedEngine::release()
+{
+	delete pool;
+	pool = nullptr;
+
+	elev.clear();
+	vis.clear();
+	count.clear();
+	threadVis.clear();
+	rayOrder.clear();
+	blockOrder.clear();
+	sweepCells.clear();
+	sweepOrder.clear();
+	sweepEvents.clear();
+	sweepWork.clear();
+	xdrawWork.clear();
+	adaptiveWork.clear();
+	threadTouched.clear();
+	elevT.clear();
+	width = height = wordsPerRow = 0;
+}
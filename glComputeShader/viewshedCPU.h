@@ -0,0 +1,504 @@
+#ifndef VIEWSHEDCPU_H
+#define VIEWSHEDCPU_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "viewshed.h"
+#include "threadpool.h"
+#include "greatCircle.h"
+
+/*
+* Per-run constants of the CPU ray kernel, the host side
+* equivalent of the uniforms of shaders/visibility.comp.
+* All math is done in single precision like on the GPU.
+*/
+struct cpuRayContext {
+	const float* elev;			/* row-major DEM */
+	int W, H;					/* DEM size in pixels */
+	unsigned int wordsPerRow;	/* packed output words per row */
+
+	float lat1, lon1;			/* observer, in radians */
+	float observerAltitude;		/* in meters */
+	float targetAltitude;		/* in meters */
+	float actualRadius;			/* in km */
+	float effectiveRadius;		/* in km */
+	float imgBounds[4];			/* in radians, lat lon lat lon */
+
+	int x1, y1;					/* observer, in pixels */
+	float h1;					/* observer height above the ellipsoid, in meters */
+	float sinLat1;
+	bool rotationWaypoints;		/* WAYPOINT_MODE 1 of visibility.comp */
+	bool tangentCompare;		/* ANGLE_MODE 1 of visibility.comp */
+	bool localProjection;		/* PROJECTION_MODE 1 of visibility.comp */
+	float pixelScale[2];		/* meters per pixel at the observer, x y */
+	float waypointStep;			/* f increment between way points */
+	int numRays;				/* perimeter or range rays */
+	float rangeRadius[2];		/* range circle in pixels, x y, 0 for perimeter rays, see viewshedRays */
+	float azimuthStart;			/* of range ray 0, in radians */
+	float azimuthStep;			/* between range rays, in radians */
+	bool verticalFOV;			/* targets only seen between the elevation limits */
+	float elevationTan[2];		/* tan of the lowest and highest elevation angle seen */
+};
+
+/*
+* Per-ray constants of the great-circle track.
+*/
+struct cpuRay {
+	float d;					/* observer to endpoint distance, in radians */
+	float sinD;
+	float p1a, p1b, p2a, p2b;
+	float sinLat2;
+	gcTrack track;				/* way point generator, with rotationWaypoints */
+	int jx, jy;					/* endpoint, in pixels */
+};
+
+/*
+* Number of rays cast by visibility.comp, one per perimeter pixel.
+*/
+static inline int perimeterRayCount(int W, int H)
+{
+	return 2 * (W - 2) + 2 * H;
+}
+
+/*
+* Ray index to perimeter endpoint (intrinsic), same enumeration as visibility.comp.
+*/
+static inline void perimeterRayEndpoint(int idx, int W, int H, int& jx, int& jy)
+{
+	if (idx < W - 2) { jx = 1 + idx; jy = 0; }
+	else if (idx < W - 2 + H) { jx = W - 1; jy = idx - W + 2; }
+	else if (idx < W - 2 + H + W - 2) { jx = 3 + idx - W - H; jy = H - 1; }
+	else { jx = 0; jy = idx - 2 * W - H + 4; }
+}
+
+/*
+* Ray index to endpoint on the range circle, shortened to the
+* DEM edge along the ray, same as rangeEndpoint() of visibility.comp.
+*/
+static inline void rangeRayEndpoint(const cpuRayContext* c, int idx, int& jx, int& jy)
+{
+	const int x1 = c->x1, y1 = c->y1, W = c->W, H = c->H;
+	float az = c->azimuthStart + c->azimuthStep * (float)idx;
+	float ex = c->rangeRadius[0] * sinf(az), ey = c->rangeRadius[1] * cosf(az);
+
+	float t = 1.0f;
+	if ((float)x1 + ex < 0.0f) t = std::min(t, -(float)x1 / ex);
+	if ((float)x1 + ex > (float)(W - 1)) t = std::min(t, (float)(W - 1 - x1) / ex);
+	if ((float)y1 + ey < 0.0f) t = std::min(t, -(float)y1 / ey);
+	if ((float)y1 + ey > (float)(H - 1)) t = std::min(t, (float)(H - 1 - y1) / ey);
+
+	jx = x1 + (int)floorf(t * ex + 0.5f);
+	jy = y1 + (int)floorf(t * ey + 0.5f);
+}
+
+/*
+* Ray index to endpoint of this run, perimeter or range circle.
+*/
+static inline void rayEndpoint(const cpuRayContext* c, int idx, int& jx, int& jy)
+{
+	if (c->rangeRadius[0] != 0)
+		rangeRayEndpoint(c, idx, jx, jy);
+	else
+		perimeterRayEndpoint(idx, c->W, c->H, jx, jy);
+}
+
+/* Cell (x,y) is inside the range circle, every cell is without maxRange */
+static inline bool inRangeCircle(const cpuRayContext* c, int x, int y)
+{
+	float u = c->rangeRadius[0] != 0 ? (float)(x - c->x1) / c->rangeRadius[0] : 0.0f;
+	float v = c->rangeRadius[1] != 0 ? (float)(y - c->y1) / c->rangeRadius[1] : 0.0f;
+	return u * u + v * v <= 1.0f;
+}
+
+/* Target between the elevation limits, rng >= 0 */
+static inline bool inVerticalFOV(const cpuRayContext* c, float el, float rng)
+{
+	float a = el + c->targetAltitude;
+	return !c->verticalFOV || (a >= c->elevationTan[0] * rng && a <= c->elevationTan[1] * rng);
+}
+
+/* Index of the lowest set bit of a lane mask or output word */
+static inline int lowestBit(uint32_t bits)
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, (unsigned long)bits);
+	return (int)idx;
+#else
+	return __builtin_ctz(bits);
+#endif
+}
+
+/*
+* SIMD instruction sets for the ray-packet kernels, picked at runtime.
+*/
+enum simdLevel {
+	SIMD_SCALAR = 0,
+	SIMD_SSE4,
+	SIMD_AVX2,
+	SIMD_AVX512,
+	SIMD_AUTO
+};
+
+/*
+* Algorithms of the CPU engine, all of them write the packed output
+* of visibility.comp.
+*/
+enum cpuAlgorithm {
+	CPU_RAYS = 0,				/* perimeter rays, a port of visibility.comp */
+	CPU_RADIAL_SWEEP,			/* exact radial sweep, Van Kreveld */
+	CPU_XDRAW,					/* ring growth with interpolated horizon slopes */
+	CPU_REFERENCE_PLANE,		/* octant row sweeps with reference planes, Wang et al. */
+	CPU_ADAPTIVE_RAYS			/* rays that spawn children as they spread apart */
+};
+
+/*
+* One cell of the exact radial sweep: the angles at which the sweep
+* line enters it, crosses its center and leaves it, in [0, 2pi), and
+* its elevation and target slopes as seen from the observer. enter >
+* exit for the cells straddling angle 0.
+*/
+struct sweepCell {
+	float enter, center, exit;
+	int rank;					/* in the cells sorted by distance */
+	int nearer;					/* cells strictly nearer than this one */
+	double slope;				/* terrain, el/rng */
+	double target;				/* target above the terrain, (el+targetAltitude)/rng */
+};
+
+/*
+* Node of the max-slope treap of the external sweep.
+*/
+struct sweepNode {
+	uint64_t key;				/* distance and cell */
+	uint32_t prio;
+	int left, right;
+	double slope, max;			/* of this cell, of the subtree */
+};
+
+/*
+* Ray of the adaptive mode, a straight line in pixel space.
+*/
+struct adaptiveRay {
+	float angle;				/* in pixel space, from +x towards +y */
+	float ux, uy;				/* direction, one ring per step: max(|ux|,|uy|) = 1 */
+	float horizon;				/* steepest terrain slope so far, el/rng */
+	bool live;					/* still inside the DEM and range */
+	bool ghost;					/* border ray of the next sector, marched but not counted */
+};
+
+/*
+* Per-worker rays of the adaptive mode, before and after spawning.
+*/
+struct adaptiveScratch {
+	std::vector<adaptiveRay> rays;
+	std::vector<adaptiveRay> next;
+};
+
+/*
+* Work and coverage of a ray run.
+*/
+struct rayCoverage {
+	uint64_t raysLaunched;		/* initial and spawned rays */
+	uint64_t steps;				/* cells sampled */
+	uint64_t cellsMissed;		/* cells in reach no ray sampled */
+};
+
+/*
+* Per-worker state of a radial sweep sector.
+*/
+struct sweepScratch {
+	std::vector<double> rankMax;	/* max tree over the distance ranks */
+	std::vector<int> inserted;		/* ranks set in it by this sector */
+	std::vector<sweepNode> nodes;	/* max-slope treap of the external sweep */
+	std::vector<int> freeNodes;
+};
+
+/*
+* One of the eight octants of the XDraw ring growth. Cell k of ring r
+* is at (x1 + r*mx + k*nx, y1 + r*my + k*ny), 0 <= k <= min(r, maxK),
+* its inward neighbours are cells of ring r-1 of the same octant.
+*/
+struct xdrawOctant {
+	int mx, my;					/* outwards, along an axis */
+	int nx, ny;					/* along the ring */
+	int numRings;				/* rings inside the DEM */
+	int maxK;					/* last cell along a ring inside the DEM */
+};
+
+static inline void setupXDrawOctant(const cpuRayContext* c, int o, xdrawOctant* oct)
+{
+	static const int axis[4][2] = { { 1, 0 }, { 0, 1 }, { -1, 0 }, { 0, -1 } };
+	int side = o / 2, sign = (o % 2) ? -1 : 1;
+	oct->mx = axis[side][0];
+	oct->my = axis[side][1];
+	oct->nx = -oct->my * sign;
+	oct->ny = oct->mx * sign;
+
+	/* Cells from the observer to the DEM edge in direction (dx,dy), or to the range box */
+	auto toEdge = [c](int dx, int dy) {
+		int n = dx > 0 ? c->W - 1 - c->x1 : dx < 0 ? c->x1 : dy > 0 ? c->H - 1 - c->y1 : c->y1;
+		if (c->rangeRadius[0] != 0)
+			n = std::min(n, (int)ceilf(fabsf(c->rangeRadius[dx != 0 ? 0 : 1])));
+		return n;
+	};
+	oct->numRings = toEdge(oct->mx, oct->my);
+	oct->maxK = toEdge(oct->nx, oct->ny);
+}
+
+/* Floats of ring scratch the XDraw kernels need, two aligned rings */
+static inline size_t xdrawScratchSize(int W, int H)
+{
+	return 2 * (size_t)((W > H ? W : H) + 48) + 16;
+}
+
+/*
+* Treap over the cells the sweep line crosses, keyed by distance to
+* the observer, every node keeps the max slope of its subtree. The
+* external sweep has no ranks of all cells to index an array with.
+*/
+struct maxSlopeTree {
+	std::vector<sweepNode>& nodes;
+	std::vector<int>& freeNodes;
+	int root;
+
+	maxSlopeTree(sweepScratch* s) : nodes(s->nodes), freeNodes(s->freeNodes), root(-1)
+	{
+		nodes.clear();
+		freeNodes.clear();
+	}
+
+	double maxOf(int t) const { return t < 0 ? -INFINITY : nodes[t].max; }
+
+	void pull(int t)
+	{
+		sweepNode& n = nodes[t];
+		n.max = std::max(n.slope, std::max(maxOf(n.left), maxOf(n.right)));
+	}
+
+	/* Keys < key to l, the others to r */
+	void split(int t, uint64_t key, int& l, int& r)
+	{
+		if (t < 0) {
+			l = r = -1;
+		}
+		else if (nodes[t].key < key) {
+			split(nodes[t].right, key, nodes[t].right, r);
+			l = t;
+			pull(t);
+		}
+		else {
+			split(nodes[t].left, key, l, nodes[t].left);
+			r = t;
+			pull(t);
+		}
+	}
+
+	int merge(int l, int r)
+	{
+		if (l < 0) return r;
+		if (r < 0) return l;
+		if (nodes[l].prio > nodes[r].prio) {
+			nodes[l].right = merge(nodes[l].right, r);
+			pull(l);
+			return l;
+		}
+		nodes[r].left = merge(l, nodes[r].left);
+		pull(r);
+		return r;
+	}
+
+	void insert(uint64_t key, double slope)
+	{
+		int t;
+		if (!freeNodes.empty()) {
+			t = freeNodes.back();
+			freeNodes.pop_back();
+		}
+		else {
+			t = (int)nodes.size();
+			nodes.push_back(sweepNode());
+		}
+		sweepNode& n = nodes[t];
+		n.key = key;
+		n.prio = (uint32_t)(key ^ (key >> 32)) * 2654435761u;
+		n.left = n.right = -1;
+		n.slope = n.max = slope;
+
+		int l, r;
+		split(root, key, l, r);
+		root = merge(merge(l, t), r);
+	}
+
+	void erase(uint64_t key)
+	{
+		int l, m, r;
+		split(root, key, l, r);
+		split(r, key + 1, m, r);
+		if (m >= 0)
+			freeNodes.push_back(m);
+		root = merge(l, r);
+	}
+
+	/* Max slope over keys < key */
+	double prefixMax(uint64_t key) const
+	{
+		double m = -INFINITY;
+		for (int t = root; t >= 0;) {
+			const sweepNode& n = nodes[t];
+			if (n.key < key) {
+				m = std::max(m, std::max(n.slope, maxOf(n.left)));
+				t = n.right;
+			}
+			else {
+				t = n.left;
+			}
+		}
+		return m;
+	}
+};
+
+typedef void (*rayPacketFunc)(const cpuRayContext* c, const int* rays, int numRays, uint32_t* vis);
+typedef void (*xdrawOctantFunc)(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis);
+typedef void (*refPlaneOctantFunc)(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis);
+
+void setupRayContext(cpuRayContext* c, const viewshedParams* p, const float* elev, int W, int H, bool localProjection = false);
+void setupRayFOV(cpuRayContext* c, double minElevation, double maxElevation);
+void setupRay(const cpuRayContext* c, int idx, cpuRay* ray);
+void rayWaypoint(const cpuRayContext* c, cpuRay* ray, float f, int& xf, int& yf);
+void traceRayScalar(const cpuRayContext* c, int idx, uint32_t* vis);
+
+void traceRayPacketSSE4(const cpuRayContext* c, const int* rays, int numRays, uint32_t* vis);
+void traceRayPacketAVX2(const cpuRayContext* c, const int* rays, int numRays, uint32_t* vis);
+void traceRayPacketAVX512(const cpuRayContext* c, const int* rays, int numRays, uint32_t* vis);
+
+void xdrawOctantScalar(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis);
+void xdrawOctantSSE4(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis);
+void xdrawOctantAVX2(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis);
+void xdrawOctantAVX512(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis);
+
+void refPlaneOctantScalar(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis);
+void refPlaneOctantSSE4(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis);
+void refPlaneOctantAVX2(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis);
+void refPlaneOctantAVX512(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis);
+
+void adaptiveRaySector(const cpuRayContext* c, float a0, float a1, float maxRange, adaptiveScratch* s, uint32_t* vis, uint32_t* touched, rayCoverage* cov);
+void perimeterRayCoverage(const cpuRayContext* c, rayCoverage* cov);
+
+void setupSweepCell(const cpuRayContext* c, int x, int y, float h, sweepCell* cell);
+void setupSweepCells(const cpuRayContext* c, int y0, int y1, sweepCell* cells);
+void rankSweepCells(const cpuRayContext* c, sweepCell* cells, std::vector<uint64_t>& order, std::vector<uint64_t>& tmp);
+void sortSweepEvents(const cpuRayContext* c, const sweepCell* cells, std::vector<uint64_t>& events, std::vector<uint64_t>& tmp);
+size_t firstSweepEvent(const std::vector<uint64_t>& events, float a);
+void radialSweepSector(const cpuRayContext* c, const sweepCell* cells, const uint64_t* events, size_t numEvents, float a0, sweepScratch* s, uint32_t* vis);
+
+simdLevel detectSimdLevel();
+const char* simdLevelName(simdLevel level);
+const char* cpuAlgorithmName(cpuAlgorithm algorithm);
+
+/*
+* Multithreaded CPU viewshed engine, a host port of visibility.comp.
+*
+* Rays are sorted longest first and run on a work-stealing pool.
+* Every worker ORs into its own packed bitmap, the bitmaps are merged
+* by row bands at the end of the run, so no atomics are needed.
+*
+* With a SIMD level other than SIMD_SCALAR, blocks of adjacent rays
+* are traced as packets that advance in lockstep, one ray per lane.
+* traceRayScalar() stays the reference for those kernels.
+*
+* runCumulative() adds each observer to the count raster while
+* merging the per-thread bitmaps, nothing is unpacked in between.
+*
+* algorithm picks how run() computes a viewshed. CPU_RADIAL_SWEEP is
+* the radial sweep of Van Kreveld, see viewshedSweep.cpp. It is exact
+* for the cell-center heights in the observer-local projection, and
+* split into angular sectors over the worker threads. It takes about
+* twice the time of the scalar rays (CPU_RAYS, SIMD_SCALAR).
+*
+* CPU_XDRAW grows the viewshed ring by ring from the observer instead
+* (Franklin's XDraw): the horizon of a cell is interpolated from the
+* two cells of the previous ring on its line of sight, so every cell
+* is visited once. It is approximate, fast, and meant for interactive
+* use. The eight octants are independent and run in parallel, each
+* ring is vectorized with the SIMD level.
+*
+* CPU_REFERENCE_PLANE sweeps the same octants row by row, every cell
+* is tested against the plane through the observer and its two inward
+* neighbours (Wang et al.), see viewshedRefPlane.cpp. East and west
+* octants read a transposed copy of the DEM so all rows are
+* sequential in memory.
+*
+* With maxRange, rays end on the range circle and only the rows of
+* its bounding box are merged. The radial sweep has events for the
+* cells inside the circle only, the octant algorithms stop at the
+* bounding box and clear its corners outside the circle.
+*
+* CPU_ADAPTIVE_RAYS starts a few rays and spawns a child between two
+* neighbours as soon as they are more than a cell apart, see
+* viewshedAdaptive.cpp. It samples every cell about once where the
+* perimeter rays oversample the near field, coverage reports its work.
+*
+* The azimuth sector is for CPU_RAYS only, the elevation limits for
+* both ray algorithms, the other algorithms refuse to run with them.
+*/
+class CPUViewshedEngine : public ViewshedEngine {
+public:
+	CPUViewshedEngine();
+	~CPUViewshedEngine();
+
+	int init(unsigned int numThreads, simdLevel simd = SIMD_AUTO);
+	int setElevation(const float* elev, unsigned int width, unsigned int height);
+	int setElevationRect(const float* elev, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned int stride);
+	int run(const viewshedParams* p);
+	int readPacked(uint32_t* packed);
+	int runCumulative(const viewshedParams* p, unsigned int numObservers);
+	int readCount(uint32_t* count);
+	void release();
+
+	double rayTime;				/* ray phase of the last run, in ms */
+	double mergeTime;			/* merge phase of the last run, in ms */
+	simdLevel simd;				/* kernel used by run() */
+	bool rotationWaypoints;		/* great-circle way points by rotation recurrence */
+	bool localProjection;		/* straight rays in pixel space, see viewshedLocalProjectionError() */
+	bool tangentCompare;		/* slopes compared without atan, ANGLE_MODE 1 of visibility.comp */
+	cpuAlgorithm algorithm;		/* used by run() and runCumulative() */
+	rayCoverage coverage;		/* of the last CPU_ADAPTIVE_RAYS run */
+
+private:
+	void sortRays(const cpuRayContext* c);
+	void sortRayBlocks(const cpuRayContext* c, int blockSize);
+	int traceRays(const viewshedParams* p);
+	void sweepSectors(const cpuRayContext* c);
+	void xdrawOctants(const cpuRayContext* c);
+	void refPlaneOctants(const cpuRayContext* c);
+	void clipToRange(const cpuRayContext* c);
+	void adaptiveRays(const cpuRayContext* c, float maxRange);
+	void mergeThreadResults(bool addCount);
+
+	ThreadPool* pool;
+	unsigned int rangeBox[4];	/* cells reached by the last run, x0 y0 x1 y1 */
+	std::vector<float> elev;
+	std::vector<float> elevT;	/* transposed DEM, built on demand */
+	std::vector<uint32_t> vis;
+	std::vector<uint32_t> count;
+	std::vector< std::vector<uint32_t> > threadVis;
+	std::vector<int> rayOrder;
+	std::vector<int> blockOrder;
+	std::vector<sweepCell> sweepCells;
+	std::vector<uint64_t> sweepOrder;
+	std::vector<uint64_t> sweepEvents;	/* of the whole circle, sorted by angle */
+	std::vector<sweepScratch> sweepWork;
+	std::vector< std::vector<float> > xdrawWork;
+	std::vector<adaptiveScratch> adaptiveWork;
+	std::vector< std::vector<uint32_t> > threadTouched;	/* cells sampled by the adaptive rays */
+};
+
+#endif // !VIEWSHEDCPU_H
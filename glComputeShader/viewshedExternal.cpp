@@ -0,0 +1,522 @@
+#include "viewshedExternal.h"
+#include "viewshedCPU.h"
+#include "timer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+#ifdef _MSC_VER
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+/* Smallest block of a sequential read or write */
+const size_t minBlockBytes = 64 << 10;
+
+static int readFile(FILE* f, void* dst, size_t bytes, externalIOStats* io)
+{
+	uint64_t startTime = tic();
+	size_t n = fread(dst, 1, bytes, f);
+	io->ioTime += toc(startTime);
+	io->bytesRead += n;
+	return n == bytes;
+}
+
+static int writeFile(FILE* f, const void* src, size_t bytes, externalIOStats* io)
+{
+	uint64_t startTime = tic();
+	size_t n = fwrite(src, 1, bytes, f);
+	io->ioTime += toc(startTime);
+	io->bytesWritten += n;
+	return n == bytes;
+}
+
+static int seekFile(FILE* f, uint64_t offset)
+{
+	return fseek64(f, (int64_t)offset, SEEK_SET) == 0;
+}
+
+/*
+* K-way merge of sorted runs of T stored back to back in one file,
+* run k holding records [starts[k], starts[k+1]). Every run is read
+* through its own buffer of bufferRecords. A failed read ends the
+* merge early, failed() tells it from the end of the runs.
+*/
+template<class T>
+class runMerger {
+public:
+	runMerger() : file(nullptr), io(nullptr), bufferRecords(0), readError(0) {}
+
+	int open(FILE* f, const uint64_t* starts, size_t numRuns, size_t numBuffered, externalIOStats* stats)
+	{
+		file = f;
+		io = stats;
+		bufferRecords = std::max((size_t)1, numBuffered);
+		readError = 0;
+		runs.assign(numRuns, run());
+		buffers.resize(numRuns * bufferRecords);
+		heap = std::priority_queue<entry, std::vector<entry>, entryGreater>();
+
+		for (size_t k = 0; k < numRuns; k++) {
+			runs[k].pos = starts[k];
+			runs[k].end = starts[k + 1];
+			if (!refill(k))
+				return 0;
+			if (runs[k].count > 0)
+				heap.push(entry(buffers[k * bufferRecords], k));
+		}
+		return 1;
+	}
+
+	/* Next record in sorted order, 0 once all runs are done or a read failed */
+	int next(T& r)
+	{
+		if (heap.empty())
+			return 0;
+
+		size_t k = heap.top().second;
+		r = heap.top().first;
+		heap.pop();
+
+		run& rk = runs[k];
+		if (++rk.head == rk.count && !refill(k))
+			return 0;
+		if (rk.head < rk.count)
+			heap.push(entry(buffers[k * bufferRecords + rk.head], k));
+		return 1;
+	}
+
+	int failed() const { return readError; }
+
+	void release()
+	{
+		std::vector<run>().swap(runs);
+		std::vector<T>().swap(buffers);
+		heap = std::priority_queue<entry, std::vector<entry>, entryGreater>();
+	}
+
+private:
+	struct run {
+		uint64_t pos, end;		/* next record to read, end of the run */
+		size_t head, count;		/* in the buffer */
+	};
+	typedef std::pair<T, size_t> entry;
+	struct entryGreater {
+		bool operator()(const entry& a, const entry& b) const { return b.first < a.first; }
+	};
+
+	int refill(size_t k)
+	{
+		run& rk = runs[k];
+		rk.head = 0;
+		rk.count = (size_t)std::min((uint64_t)bufferRecords, rk.end - rk.pos);
+		if (rk.count == 0)
+			return 1;
+		if (!seekFile(file, rk.pos * sizeof(T)) || !readFile(file, &buffers[k * bufferRecords], rk.count * sizeof(T), io)) {
+			printf("runMerger::refill(): read failed\n");
+			readError = 1;
+			return 0;
+		}
+		rk.pos += rk.count;
+		return 1;
+	}
+
+	FILE* file;
+	externalIOStats* io;
+	size_t bufferRecords;
+	int readError;
+	std::vector<run> runs;
+	std::vector<T> buffers;
+	std::priority_queue<entry, std::vector<entry>, entryGreater> heap;
+};
+
+/*
+* Sorts more records of T than fit in memoryBytes: push() all of them,
+* finish(), then next() returns them in order. Full buffers are
+* sorted and spilled as runs to a temporary file, runs are merged in
+* passes until one merge with buffers of minBlockBytes fits. Nothing
+* touches the disk when all records fit. next() returns 0 on a read
+* error too, failed() tells it from the end of the records.
+*/
+template<class T>
+class externalSorter {
+public:
+	externalSorter(size_t memoryBytes, externalIOStats* stats)
+		: memory(memoryBytes), io(stats), file(nullptr), numRuns(0), pos(0)
+	{
+		capacity = std::max((size_t)1, memory / sizeof(T));
+		starts.push_back(0);
+	}
+
+	~externalSorter()
+	{
+		merger.release();
+		if (file)
+			fclose(file);
+	}
+
+	int push(const T& r)
+	{
+		if (buf.size() == capacity && !spill())
+			return 0;
+		if (buf.size() == buf.capacity())
+			buf.reserve(std::min(capacity, 2 * buf.capacity() + 1024));
+		buf.push_back(r);
+		return 1;
+	}
+
+	int finish()
+	{
+		if (file == nullptr) {
+			std::sort(buf.begin(), buf.end());
+			return 1;
+		}
+		if (!buf.empty() && !spill())
+			return 0;
+		std::vector<T>().swap(buf);
+
+		/* One buffer per run and one for the output of a pass */
+		size_t fanIn = std::max((size_t)2, memory / minBlockBytes - 1);
+		while (starts.size() - 1 > fanIn) {
+			FILE* out = tmpfile();
+			if (out == nullptr) {
+				printf("externalSorter::finish(): cannot create a temporary file\n");
+				return 0;
+			}
+			std::vector<uint64_t> merged(1, 0);
+			std::vector<T> outBuf(std::max((size_t)1, minBlockBytes / sizeof(T)));
+			size_t numOut = 0;
+			uint64_t total = 0;
+
+			for (size_t first = 0; first + 1 < starts.size(); first += fanIn) {
+				size_t n = std::min(fanIn, starts.size() - 1 - first);
+				if (!merger.open(file, &starts[first], n, (memory - minBlockBytes) / n / sizeof(T), io))
+					return 0;
+				T r;
+				while (merger.next(r)) {
+					outBuf[numOut++] = r;
+					if (numOut == outBuf.size()) {
+						if (!writeFile(out, outBuf.data(), numOut * sizeof(T), io))
+							return 0;
+						numOut = 0;
+					}
+					total++;
+				}
+				if (merger.failed())
+					return 0;
+				if (numOut > 0 && !writeFile(out, outBuf.data(), numOut * sizeof(T), io))
+					return 0;
+				numOut = 0;
+				merged.push_back(total);
+			}
+
+			merger.release();
+			fclose(file);
+			file = out;
+			starts.swap(merged);
+		}
+
+		size_t n = starts.size() - 1;
+		return merger.open(file, starts.data(), n, memory / n / sizeof(T), io);
+	}
+
+	int next(T& r)
+	{
+		if (file != nullptr)
+			return merger.next(r);
+		if (pos == buf.size())
+			return 0;
+		r = buf[pos++];
+		return 1;
+	}
+
+	unsigned int runs() const { return numRuns; }
+	int failed() const { return file != nullptr && merger.failed(); }
+
+private:
+	int spill()
+	{
+		if (file == nullptr && (file = tmpfile()) == nullptr) {
+			printf("externalSorter::spill(): cannot create a temporary file\n");
+			return 0;
+		}
+		std::sort(buf.begin(), buf.end());
+		if (!seekFile(file, starts.back() * sizeof(T)) || !writeFile(file, buf.data(), buf.size() * sizeof(T), io)) {
+			printf("externalSorter::spill(): write failed\n");
+			return 0;
+		}
+		starts.push_back(starts.back() + buf.size());
+		numRuns++;
+		buf.clear();
+		return 1;
+	}
+
+	size_t memory;
+	externalIOStats* io;
+	size_t capacity;
+	std::vector<T> buf;
+	FILE* file;
+	std::vector<uint64_t> starts;
+	unsigned int numRuns;
+	size_t pos;
+	runMerger<T> merger;
+};
+
+enum externalEventType {
+	EXTERNAL_ENTER = 0,
+	EXTERNAL_CENTER,
+	EXTERNAL_EXIT
+};
+
+/* Sweep event on disk, sorted like the events of radialSweepSector() */
+struct externalEvent {
+	float angle;
+	uint32_t type;
+	uint64_t cell;
+	float dist;					/* squared, in m^2 */
+	float value;				/* slope for ENTER, target for CENTER */
+
+	bool operator<(const externalEvent& b) const
+	{
+		if (angle != b.angle) return angle < b.angle;
+		if (type != b.type) return type < b.type;
+		return cell < b.cell;
+	}
+};
+
+/* Active set key, distance first so prefixes are the nearer cells */
+static inline uint64_t activeKey(float dist, uint64_t cell)
+{
+	uint32_t bits;
+	memcpy(&bits, &dist, sizeof(bits));
+	return ((uint64_t)bits << 32) | (uint32_t)cell;
+}
+
+
+ExternalViewshedEngine::ExternalViewshedEngine()
+	: width(0), height(0), memoryBudget((size_t)256 << 20), runTime(0), numEvents(0), numRuns(0)
+{
+	memset(&io, 0, sizeof(io));
+}
+
+/*
+* Uses the raw row-major float32 DEM (in meters) at path,
+* the file is only read by run().
+*/
+int ExternalViewshedEngine::setElevationFile(const char* path, unsigned int w, unsigned int h)
+{
+	if (w < 2 || h < 2) {
+		printf("ExternalViewshedEngine::setElevationFile(): DEM must be at least 2x2\n");
+		return 0;
+	}
+
+	FILE* f = fopen(path, "rb");
+	if (f == nullptr) {
+		printf("ExternalViewshedEngine::setElevationFile(): cannot open %s\n", path);
+		return 0;
+	}
+	fseek64(f, 0, SEEK_END);
+	uint64_t size = (uint64_t)ftell64(f);
+	fclose(f);
+
+	if (size < (uint64_t)w * h * sizeof(float)) {
+		printf("ExternalViewshedEngine::setElevationFile(): %s is smaller than %ux%u floats\n", path, w, h);
+		return 0;
+	}
+
+	elevPath = path;
+	width = w;
+	height = h;
+	return 1;
+}
+
+/*
+* Computes the viewshed of one observer into the packed file outPath.
+*/
+int ExternalViewshedEngine::run(const viewshedParams* p, const char* outPath)
+{
+	if (elevPath.empty()) {
+		printf("ExternalViewshedEngine::run(): engine has no elevation file\n");
+		return 0;
+	}
+	if (!observerInBounds(p)) {
+		printf("ExternalViewshedEngine::run(): observer location is outside defined altitude raster\n");
+		return 0;
+	}
+	if (memoryBudget < 4 * minBlockBytes) {
+		printf("ExternalViewshedEngine::run(): memoryBudget must be at least %zu bytes\n", 4 * minBlockBytes);
+		return 0;
+	}
+
+	uint64_t startTime = tic();
+	memset(&io, 0, sizeof(io));
+
+	FILE* in = fopen(elevPath.c_str(), "rb");
+	if (in == nullptr) {
+		printf("ExternalViewshedEngine::run(): cannot open %s\n", elevPath.c_str());
+		return 0;
+	}
+
+	cpuRayContext c;
+	setupRayContext(&c, p, nullptr, (int)width, (int)height);
+	if (c.x1 >= 0 && c.y1 >= 0 && c.x1 < c.W && c.y1 < c.H) {
+		float h1;
+		if (!seekFile(in, ((uint64_t)c.y1 * width + c.x1) * sizeof(float)) || !readFile(in, &h1, sizeof(h1), &io)) {
+			printf("ExternalViewshedEngine::run(): read failed\n");
+			fclose(in);
+			return 0;
+		}
+		c.h1 += h1;
+	}
+
+	/* Events of all cells, the DEM read in row bands of 1/8 of the budget */
+	size_t bandRows = std::max((size_t)1, memoryBudget / 8 / ((size_t)width * sizeof(float)));
+	std::vector<float> band;
+	externalSorter<externalEvent>* events = new externalSorter<externalEvent>(memoryBudget - memoryBudget / 8, &io);
+	int status = seekFile(in, 0);
+
+	for (unsigned int y0 = 0; status && y0 < height; y0 += (unsigned int)bandRows) {
+		unsigned int y1 = (unsigned int)std::min((size_t)height, y0 + bandRows);
+		band.resize((size_t)(y1 - y0) * width);
+		if (!readFile(in, band.data(), band.size() * sizeof(float), &io)) {
+			printf("ExternalViewshedEngine::run(): read failed\n");
+			status = 0;
+			break;
+		}
+
+		for (unsigned int y = y0; status && y < y1; y++) {
+			for (unsigned int x = 0; x < width; x++) {
+				sweepCell cell;
+				setupSweepCell(&c, (int)x, (int)y, band[(size_t)(y - y0) * width + x], &cell);
+				if (cell.slope == -INFINITY)
+					continue;
+
+				double dx = ((int)x - c.x1) * (double)c.pixelScale[0], dy = ((int)y - c.y1) * (double)c.pixelScale[1];
+				externalEvent e;
+				e.cell = (uint64_t)y * width + x;
+				e.dist = (float)(dx * dx + dy * dy);
+
+				/* Cells straddling angle 0 are on the line from the start */
+				e.type = EXTERNAL_ENTER;
+				e.value = (float)cell.slope;
+				if (cell.enter > cell.exit) {
+					e.angle = 0.0f;
+					status &= events->push(e);
+				}
+				e.angle = cell.enter;
+				status &= events->push(e);
+				e.type = EXTERNAL_CENTER;
+				e.angle = cell.center;
+				e.value = (float)cell.target;
+				status &= events->push(e);
+				e.type = EXTERNAL_EXIT;
+				e.angle = cell.exit;
+				status &= events->push(e);
+			}
+		}
+	}
+	fclose(in);
+	std::vector<float>().swap(band);
+
+	status = status && events->finish();
+	numRuns = events->runs();
+	numEvents = 0;
+
+	/* Sweep, visible cells spill to a temporary file in angle order */
+	FILE* visFile = status ? tmpfile() : nullptr;
+	std::vector<uint64_t> visBuf(minBlockBytes / sizeof(uint64_t));
+	size_t numVis = 0;
+	uint64_t totalVis = 0;
+
+	if (visFile != nullptr) {
+		sweepScratch scratch;
+		maxSlopeTree tree(&scratch);
+		externalEvent e;
+
+		while (events->next(e)) {
+			numEvents++;
+			uint64_t key = activeKey(e.dist, e.cell);
+			if (e.type == EXTERNAL_ENTER) {
+				tree.insert(key, e.value);
+			}
+			else if (e.type == EXTERNAL_EXIT) {
+				tree.erase(key);
+			}
+			else if (e.value > tree.prefixMax(activeKey(e.dist, 0))) {
+				visBuf[numVis++] = e.cell;
+				if (numVis == visBuf.size()) {
+					status &= writeFile(visFile, visBuf.data(), numVis * sizeof(uint64_t), &io);
+					numVis = 0;
+				}
+				totalVis++;
+			}
+		}
+		if (numVis > 0)
+			status &= writeFile(visFile, visBuf.data(), numVis * sizeof(uint64_t), &io);
+		status = status && !events->failed();
+	}
+	else {
+		status = 0;
+	}
+	delete events;
+
+	/* Visible cells back in row order */
+	externalSorter<uint64_t> cells(memoryBudget - memoryBudget / 4, &io);
+	if (status) {
+		status = seekFile(visFile, 0);
+		for (uint64_t done = 0; status && done < totalVis; done += numVis) {
+			numVis = (size_t)std::min((uint64_t)visBuf.size(), totalVis - done);
+			status = readFile(visFile, visBuf.data(), numVis * sizeof(uint64_t), &io);
+			for (size_t i = 0; status && i < numVis; i++)
+				status = cells.push(visBuf[i]);
+		}
+		status = status && cells.finish();
+	}
+	if (visFile)
+		fclose(visFile);
+
+	/* Packed output by row bands of 1/4 of the budget */
+	FILE* out = status ? fopen(outPath, "wb") : nullptr;
+	if (out == nullptr) {
+		printf("ExternalViewshedEngine::run(): failed before writing %s\n", outPath);
+		return 0;
+	}
+
+	const size_t wordsPerRow = (width + 31) / 32;
+	bandRows = std::max((size_t)1, memoryBudget / 4 / (wordsPerRow * sizeof(uint32_t)));
+	std::vector<uint32_t> packed;
+	uint64_t cell;
+	int haveCell = cells.next(cell);
+
+	for (unsigned int y0 = 0; status && y0 < height; y0 += (unsigned int)bandRows) {
+		unsigned int y1 = (unsigned int)std::min((size_t)height, y0 + bandRows);
+		packed.assign((size_t)(y1 - y0) * wordsPerRow, 0);
+
+		for (; haveCell && cell < (uint64_t)y1 * width; haveCell = cells.next(cell)) {
+			size_t x = (size_t)(cell % width), y = (size_t)(cell / width) - y0;
+			packed[y * wordsPerRow + x / 32] |= 1u << (x % 32);
+		}
+
+		/* The observer sees its own cell */
+		if (c.y1 >= (int)y0 && c.y1 < (int)y1 && c.x1 >= 0 && c.x1 < c.W)
+			packed[(size_t)(c.y1 - y0) * wordsPerRow + c.x1 / 32] |= 1u << (c.x1 % 32);
+
+		status = writeFile(out, packed.data(), packed.size() * sizeof(uint32_t), &io);
+	}
+	status = status && !cells.failed();
+	fclose(out);
+
+	if (!status)
+		printf("ExternalViewshedEngine::run(): %s failed\n", cells.failed() ? "merge" : "write");
+
+	runTime = toc(startTime);
+	return status;
+}
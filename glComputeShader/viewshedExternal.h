@@ -0,0 +1,56 @@
+#ifndef VIEWSHEDEXTERNAL_H
+#define VIEWSHEDEXTERNAL_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "viewshed.h"
+
+/*
+* Bytes moved by the external engine and the time spent moving them.
+*/
+struct externalIOStats {
+	uint64_t bytesRead;
+	uint64_t bytesWritten;
+	double ioTime;				/* in fread/fwrite, in ms */
+};
+
+/*
+* External-memory viewshed for DEMs that do not fit in RAM.
+*
+* The DEM is a raw row-major float32 file, the result a packed file in
+* the output format of visibility.comp, (W+31)/32 uint32 per row. It
+* is the radial sweep of the CPU engine (CPU_RADIAL_SWEEP) with sorted
+* events on disk, like the I/O-efficient sweep of Haverkort et al.:
+*
+* 1. The DEM is read once in row bands, every cell adds its enter,
+*    center and exit events to sorted runs of memoryBudget bytes.
+* 2. The runs are merged, in several passes if they need more merge
+*    buffers than the budget holds, and the last merge feeds the
+*    sweep. Only the cells on the sweep line are kept in memory.
+* 3. Visible cells come out in angle order, they are sorted back by
+*    cell and written out in row bands.
+*
+* All file access is sequential in blocks of at least 64 KB.
+*/
+class ExternalViewshedEngine {
+public:
+	ExternalViewshedEngine();
+
+	int setElevationFile(const char* path, unsigned int width, unsigned int height);
+	int run(const viewshedParams* p, const char* outPath);
+
+	unsigned int width;			/* DEM width in pixels */
+	unsigned int height;		/* DEM height in pixels */
+	size_t memoryBudget;		/* bytes for buffers and sorted runs */
+	double runTime;				/* last run, in ms */
+	uint64_t numEvents;			/* sweep events of the last run */
+	unsigned int numRuns;		/* sorted runs of events before merging */
+	externalIOStats io;			/* of the last run */
+
+private:
+	std::string elevPath;
+};
+
+#endif // !VIEWSHEDEXTERNAL_H
@@ -0,0 +1,768 @@
+#include "viewshedGL.h"
+#include "shader.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+GLViewshedEngine::GLViewshedEngine()
+	: maxBatch(0), batchSize(0), cumulativeBatch(0), quantizationError(0), prog(0), heightProg(0), batchProg(0), countProg(0), elevTex(0), visTex(0),
+	relTex(0), batchTex(0), countTex(0), observerBuf(0), timeQuery(0), countImgSize(-1), countNumLayers(-1), batchLayers(0),
+	elevFormat(VIS_ELEVATION_R32F), maxGroupsX(65535)
+{
+	rangeBox[0] = rangeBox[1] = rangeBox[2] = rangeBox[3] = 0;
+
+	/* Every height on Earth, sea floor included, for DEMs uploaded a rectangle at a time */
+	elevationRange[0] = -11000.0f;
+	elevationRange[1] = 9000.0f;
+	elevationQuant[0] = 1.0f;
+	elevationQuant[1] = 0.0f;
+}
+
+GLViewshedEngine::~GLViewshedEngine()
+{
+	release();
+}
+
+/*
+* Path of a shader next to shaderPath.
+*/
+static void siblingPath(const char* shaderPath, const char* name, char* path, size_t size)
+{
+	const char* slash = strrchr(shaderPath, '/');
+	const char* backslash = strrchr(shaderPath, '\\');
+	if (backslash > slash) slash = backslash;
+	int dirLength = slash ? (int)(slash - shaderPath + 1) : 0;
+	snprintf(path, size, "%.*s%s", dirLength, shaderPath, name);
+}
+
+/*
+* IEEE half float, rounded to nearest even, and back.
+*/
+static uint16_t floatToHalf(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+	uint32_t a = x & 0x7fffffff;
+
+	if (a >= 0x47800000)		/* 65536 and above, inf and nan */
+		return sign | (a > 0x7f800000 ? 0x7e00 : 0x7c00);
+	if (a < 0x38800000) {		/* below 2^-14, subnormal */
+		float af;
+		memcpy(&af, &a, sizeof(af));
+		return sign | (uint16_t)lrintf(af * 16777216.0f);
+	}
+
+	uint32_t h = ((a >> 23) - 112) << 10 | (a & 0x7fffff) >> 13;
+	uint32_t rest = a & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+		h++;
+	return sign | (uint16_t)h;
+}
+
+static float halfToFloat(uint16_t h)
+{
+	uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff;
+	float f;
+	if (e == 0) {
+		f = ldexpf((float)m, -24);
+	}
+	else {
+		uint32_t x = e == 31 ? 0x7f800000 | m << 13 : (e + 112) << 23 | m << 13;
+		memcpy(&f, &x, sizeof(f));
+	}
+	return (h & 0x8000) ? -f : f;
+}
+
+/*
+* Quantizes n heights to a 16-bit format, returns the largest
+* difference between a height and what the shader reads back.
+*/
+static float quantizeElevation(const float* elev, size_t n, visElevationFormat format, const float quant[2], uint16_t* out)
+{
+	float maxError = 0;
+	for (size_t i = 0; i < n; i++) {
+		float v = (elev[i] - quant[1]) / quant[0], back;
+		if (format == VIS_ELEVATION_R16UI) {
+			out[i] = (uint16_t)std::min(std::max(floorf(v + 0.5f), 0.0f), 65535.0f);
+			back = (float)out[i];
+		}
+		else {
+			out[i] = floatToHalf(std::min(std::max(v, -65504.0f), 65504.0f));
+			back = halfToFloat(out[i]);
+		}
+		maxError = std::max(maxError, fabsf(back * quant[0] + quant[1] - elev[i]));
+	}
+	return maxError;
+}
+
+/*
+* Compiles a compute shader with defines and links it
+* into a new program, 0 on failure.
+*/
+static GLuint buildProgram(const char* path, const char* defines)
+{
+	GLuint program = glCreateProgram();
+	shaderAttachFromFileWithDefines(program, GL_COMPUTE_SHADER, path, defines);
+	if (!shaderLinkProgram(program)) {
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+/*
+* Compiles and links the visibility compute shader with
+* the given options and looks up its uniform locations once.
+*/
+int GLViewshedEngine::init(const char* shaderPath, const glViewshedOptions& opt)
+{
+	if (prog != 0) glDeleteProgram(prog);
+	if (heightProg != 0) glDeleteProgram(heightProg);
+	if (batchProg != 0) glDeleteProgram(batchProg);
+	if (countProg != 0) glDeleteProgram(countProg);
+	prog = heightProg = batchProg = countProg = 0;
+
+	GLint maxInvocations, maxSizeX, maxGroupsZ, maxLayers;
+	glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+	glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &maxSizeX);
+	glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &maxGroupsX);
+	glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 2, &maxGroupsZ);
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+	if (opt.localSize == 0 || opt.localSize > (unsigned int)maxInvocations || opt.localSize > (unsigned int)maxSizeX) {
+		printf("GLViewshedEngine::init(): workgroup size %u is not supported (max %d)\n", opt.localSize, maxInvocations < maxSizeX ? maxInvocations : maxSizeX);
+		return 0;
+	}
+
+	if (opt.output == VIS_OUTPUT_BALLOT && !(GLAD_GL_ARB_shader_ballot && GLAD_GL_ARB_gpu_shader_int64)) {
+		printf("GLViewshedEngine::init(): ballot output needs GL_ARB_shader_ballot and GL_ARB_gpu_shader_int64\n");
+		return 0;
+	}
+
+	char defines[256];
+	snprintf(defines, sizeof(defines), "#define LOCAL_SIZE_X %u\n#define OUTPUT_MODE %d\n#define WAYPOINT_MODE %d\n#define PROJECTION_MODE %d\n#define HEIGHT_MODE %d\n#define ANGLE_MODE %d\n#define ELEVATION_MODE %d\n",
+		opt.localSize, (int)opt.output, opt.rotationWaypoints ? 1 : 0, opt.localProjection ? 1 : 0, opt.precomputeHeights ? 1 : 0,
+		opt.tangentCompare ? 1 : 0, (int)opt.elevation);
+
+	prog = buildProgram(shaderPath, defines);
+	if (prog == 0)
+		return 0;
+	getUniformLocations(prog, &loc);
+
+	if (opt.precomputeHeights) {
+		char heightPath[1024];
+		siblingPath(shaderPath, "heightField.comp", heightPath, sizeof(heightPath));
+		heightProg = buildProgram(heightPath, defines);
+		if (heightProg == 0) {
+			glDeleteProgram(prog);
+			prog = 0;
+			return 0;
+		}
+		getUniformLocations(heightProg, &heightLoc);
+	}
+	else {
+		/* Batched observers, same program with observers from a buffer */
+		char batchDefines[288];
+		snprintf(batchDefines, sizeof(batchDefines), "%s#define BATCH_MODE 1\n", defines);
+		batchProg = buildProgram(shaderPath, batchDefines);
+		if (batchProg == 0) {
+			glDeleteProgram(prog);
+			prog = 0;
+			return 0;
+		}
+		getUniformLocations(batchProg, &batchLoc);
+
+		/* Batch layers to observer counts */
+		char countPath[1024];
+		siblingPath(shaderPath, "cumulative.comp", countPath, sizeof(countPath));
+		countProg = buildProgram(countPath, NULL);
+		if (countProg == 0) {
+			glDeleteProgram(prog);
+			glDeleteProgram(batchProg);
+			prog = batchProg = 0;
+			return 0;
+		}
+		countImgSize = glGetUniformLocation(countProg, "imgSize");
+		countNumLayers = glGetUniformLocation(countProg, "numLayers");
+	}
+
+	/* The resident DEM is in the wrong format for the new program */
+	if (elevTex != 0 && elevFormat != opt.elevation) {
+		printf("GLViewshedEngine::init(): elevation format changed, the DEM has to be uploaded again\n");
+		glDeleteTextures(1, &elevTex);
+		elevTex = 0;
+	}
+
+	options = opt;
+	maxBatch = batchProg != 0 ? (unsigned int)(maxGroupsZ < maxLayers ? maxGroupsZ : maxLayers) : 0;
+
+	if (timeQuery == 0)
+		glGenQueries(1, &timeQuery);
+
+	return 1;
+}
+
+/*
+* Looks up the per-observer uniforms, missing ones are -1
+* and ignored by glUniform*().
+*/
+void GLViewshedEngine::getUniformLocations(GLuint program, uniformLocations* l)
+{
+	l->observerAltitude = glGetUniformLocation(program, "observerAltitude");
+	l->targetAltitude = glGetUniformLocation(program, "targetAltitude");
+	l->lat1 = glGetUniformLocation(program, "lat1");
+	l->lon1 = glGetUniformLocation(program, "lon1");
+	l->actualRadius = glGetUniformLocation(program, "actualRadius");
+	l->effectiveRadius = glGetUniformLocation(program, "effectiveRadius");
+	l->imgBounds = glGetUniformLocation(program, "imgBounds");
+	l->imgSize = glGetUniformLocation(program, "imgSize");
+	l->numRays = glGetUniformLocation(program, "numRays");
+	l->pixelScale = glGetUniformLocation(program, "pixelScale");
+	l->rayRange = glGetUniformLocation(program, "rayRange");
+	l->rangeRays = glGetUniformLocation(program, "rangeRays");
+	l->azimuth = glGetUniformLocation(program, "azimuth");
+	l->verticalFOV = glGetUniformLocation(program, "verticalFOV");
+	l->elevationTan = glGetUniformLocation(program, "elevationTan");
+	l->elevationQuant = glGetUniformLocation(program, "elevationQuant");
+}
+
+/*
+* Sets the per-observer uniforms of the current program.
+*/
+void GLViewshedEngine::setUniforms(const uniformLocations* l, const viewshedParams* p)
+{
+	glUniform1f(l->observerAltitude, (GLfloat)p->observerAltitude);
+	glUniform1f(l->targetAltitude, (GLfloat)p->targetAltitude);
+	glUniform1f(l->lat1, (GLfloat)p->lat1);
+	glUniform1f(l->lon1, (GLfloat)p->lon1);
+	glUniform1f(l->actualRadius, (GLfloat)p->actualRadius);
+	glUniform1f(l->effectiveRadius, (GLfloat)p->effectiveRadius);
+	glUniform4f(l->imgBounds, (GLfloat)p->imgBounds[0], (GLfloat)p->imgBounds[1], (GLfloat)p->imgBounds[2], (GLfloat)p->imgBounds[3]);
+	glUniform2i(l->imgSize, (GLint)height, (GLint)width);
+
+	double scale[2];
+	localPixelScale(p, width, height, scale);
+	glUniform2f(l->pixelScale, (GLfloat)scale[0], (GLfloat)scale[1]);
+
+	/* One ray per perimeter pixel */
+	glUniform1i(l->numRays, (GLint)(2 * (width - 2) + 2 * height));
+
+	/* Field of view, the same for all observers */
+	glUniform2f(l->azimuth, (GLfloat)azimuthStart, azimuthSector() ? (GLfloat)azimuthWidth : 0.0f);
+	glUniform1i(l->verticalFOV, verticalFOV() ? 1 : 0);
+	const double halfPi = 1.5707963267948966;
+	glUniform2f(l->elevationTan, minElevation > -halfPi ? (GLfloat)tan(minElevation) : -FLT_MAX,
+		maxElevation < halfPi ? (GLfloat)tan(maxElevation) : FLT_MAX);
+
+	glUniform2f(l->elevationQuant, elevationQuant[0], elevationQuant[1]);
+}
+
+/*
+* Binds the elevation texture to binding 1, as an image or as a
+* texture for texelFetch depending on its format.
+*/
+void GLViewshedEngine::bindElevation()
+{
+	if (elevFormat == VIS_ELEVATION_R32F) {
+		glBindImageTexture(1, elevTex, 0, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+	}
+	else {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, elevTex);
+		glActiveTexture(GL_TEXTURE0);
+	}
+}
+
+/*
+* Uploads a row-major DEM (in meters). Textures are only
+* reallocated when the DEM dimensions change, otherwise the
+* resident textures are updated in place. elev NULL leaves
+* the contents to setElevationRect().
+*
+* 16-bit formats are quantized over elevationRange, fitted to
+* elev when there is one.
+*/
+int GLViewshedEngine::setElevation(const float* elev, unsigned int w, unsigned int h)
+{
+	if (w < 2 || h < 2) {
+		printf("GLViewshedEngine::setElevation(): DEM must be at least 2x2\n");
+		return 0;
+	}
+
+	if (w != width || h != height || elevTex == 0 || elevFormat != options.elevation) {
+		if (elevTex != 0) glDeleteTextures(1, &elevTex);
+		if (visTex != 0) glDeleteTextures(1, &visTex);
+		if (relTex != 0) glDeleteTextures(1, &relTex);
+		if (batchTex != 0) glDeleteTextures(1, &batchTex);
+		if (countTex != 0) glDeleteTextures(1, &countTex);
+		relTex = batchTex = countTex = 0;
+		batchLayers = batchSize = 0;
+
+		width = w;
+		height = h;
+		wordsPerRow = (w + 31) / 32;
+		rangeBox[0] = rangeBox[1] = 0;
+		rangeBox[2] = w - 1;
+		rangeBox[3] = h - 1;
+
+		/* Elevation texture */
+		glGenTextures(1, &elevTex);
+		glBindTexture(GL_TEXTURE_2D, elevTex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		const GLenum elevFormats[3] = { GL_R32F, GL_R16UI, GL_R16F }; /* note GL_R32F ensures that internally data values are not normalized */
+		elevFormat = options.elevation;
+		glTexStorage2D(GL_TEXTURE_2D, 1, elevFormats[elevFormat], width, height);
+
+		/* Packed output texture */
+		glGenTextures(1, &visTex);
+		glBindTexture(GL_TEXTURE_2D, visTex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32UI, wordsPerRow, height);
+	}
+
+	if (elev != NULL && elevFormat != VIS_ELEVATION_R32F) {
+		const size_t n = (size_t)width * height;
+		elevationRange[0] = *std::min_element(elev, elev + n);
+		elevationRange[1] = *std::max_element(elev, elev + n);
+	}
+
+	/* R16UI spans the range in 65535 steps, R16F is centered on it */
+	elevationQuant[0] = 1.0f;
+	elevationQuant[1] = 0.0f;
+	if (elevFormat == VIS_ELEVATION_R16UI) {
+		elevationQuant[0] = std::max(elevationRange[1] - elevationRange[0], 1.0f) / 65535.0f;
+		elevationQuant[1] = elevationRange[0];
+	}
+	else if (elevFormat == VIS_ELEVATION_R16F) {
+		elevationQuant[1] = 0.5f * (elevationRange[0] + elevationRange[1]);
+	}
+	quantizationError = 0;
+
+	if (elev == NULL)
+		return 1;
+
+	return setElevationRect(elev, 0, 0, width, height, width);
+}
+
+/*
+* Uploads w x h cells at (x,y) of the elevation texture, rows of the
+* source are stride floats apart.
+*/
+int GLViewshedEngine::setElevationRect(const float* elev, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned int stride)
+{
+	if (elevTex == 0 || x + w > width || y + h > height) {
+		printf("GLViewshedEngine::setElevationRect(): rectangle outside of the DEM\n");
+		return 0;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, elevTex);
+	if (elevFormat == VIS_ELEVATION_R32F) {
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, stride == w ? 0 : stride);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RED, GL_FLOAT, elev);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	}
+	else {
+		std::vector<uint16_t> quantized((size_t)w * h);
+		for (unsigned int r = 0; r < h; r++)
+			quantizationError = std::max(quantizationError,
+				quantizeElevation(elev + (size_t)r * stride, w, elevFormat, elevationQuant, &quantized[(size_t)r * w]));
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+		if (elevFormat == VIS_ELEVATION_R16UI)
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RED_INTEGER, GL_UNSIGNED_SHORT, quantized.data());
+		else
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RED, GL_HALF_FLOAT, quantized.data());
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	}
+
+	return 1;
+}
+
+/*
+* Uploads a whole DEM already in the texture format, floats for R32F,
+* steps over elevationRange for R16UI, half floats around its middle
+* for R16F. The samples go straight from host memory, e.g. a file
+* mapping, to a pixel unpack buffer and from there to the texture.
+*/
+int GLViewshedEngine::setElevationSamples(const void* samples, unsigned int w, unsigned int h, visElevationFormat format)
+{
+	if (format != options.elevation) {
+		printf("GLViewshedEngine::setElevationSamples(): samples are not in the elevation texture format\n");
+		return 0;
+	}
+	if (!setElevation(NULL, w, h))
+		return 0;
+
+	const GLenum formats[3] = { GL_RED, GL_RED_INTEGER, GL_RED };
+	const GLenum types[3] = { GL_FLOAT, GL_UNSIGNED_SHORT, GL_HALF_FLOAT };
+	const size_t sampleBytes = format == VIS_ELEVATION_R32F ? 4 : 2;
+
+	GLuint unpackBuf;
+	glGenBuffers(1, &unpackBuf);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpackBuf);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)((size_t)w * h * sampleBytes), samples, GL_STREAM_DRAW);
+
+	glBindTexture(GL_TEXTURE_2D, elevTex);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, (GLint)sampleBytes);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, formats[format], types[format], (const void*)0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	/* The texture keeps what it needs of the buffer until the copy is done */
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glDeleteBuffers(1, &unpackBuf);
+	return 1;
+}
+
+/*
+* Computes the viewshed for one observer. Only uniforms are
+* updated, the result stays on the GPU until read back.
+*/
+int GLViewshedEngine::run(const viewshedParams* p)
+{
+	if (prog == 0 || elevTex == 0) {
+		printf("GLViewshedEngine::run(): engine has no program or elevation data\n");
+		return 0;
+	}
+
+	if (!observerInBounds(p)) {
+		printf("GLViewshedEngine::run(): observer location is outside defined altitude raster\n");
+		return 0;
+	}
+
+	/* Scratch height field, allocated on first use */
+	if (heightProg != 0 && relTex == 0) {
+		glGenTextures(1, &relTex);
+		glBindTexture(GL_TEXTURE_2D, relTex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_RG32F, width, height);
+	}
+
+	glBeginQuery(GL_TIME_ELAPSED, timeQuery);
+
+	/* Rays to the range circle, only the words of its box are written */
+	viewshedRays rays;
+	raySet(p, &rays);
+	memcpy(rangeBox, rays.box, sizeof(rangeBox));
+	GLuint x0 = rangeBox[0] / 32, x1 = rangeBox[2] / 32;
+
+	GLuint clearColor[1] = { 0 };
+	glClearTexSubImage(visTex, 0, x0, rangeBox[1], 0, x1 - x0 + 1, rangeBox[3] - rangeBox[1] + 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, clearColor);
+
+	glBindImageTexture(0, visTex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+	bindElevation();
+
+	/* First pass, observer-relative heights of all pixels */
+	if (heightProg != 0) {
+		glUseProgram(heightProg);
+		setUniforms(&heightLoc, p);
+		glBindImageTexture(2, relTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG32F);
+		glDispatchCompute((width + 15) / 16, (height + 15) / 16, 1);
+
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+		glBindImageTexture(2, relTex, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RG32F);
+	}
+
+	glUseProgram(prog);
+	setUniforms(&loc, p);
+	glUniform1f(loc.rayRange, rays.range);
+	glUniform1ui(loc.rangeRays, rays.numRays);
+	dispatchRays(rays.numRays > 0 ? rays.numRays : 2 * (width - 2) + 2 * height, 1);
+
+	glEndQuery(GL_TIME_ELAPSED);
+
+	return 1;
+}
+
+/*
+* Dispatches numRays rays (the most of any observer) of
+* numObservers observers, rays over X and Y, observers over Z.
+*/
+void GLViewshedEngine::dispatchRays(GLuint numRays, GLuint numObservers)
+{
+	/* Spill into Y when the groups do not fit in X, the shader drops the tail */
+	GLuint numGroups = (numRays + options.localSize - 1) / options.localSize;
+	GLuint groupsX = numGroups < (GLuint)maxGroupsX ? numGroups : (GLuint)maxGroupsX;
+	GLuint groupsY = (numGroups + groupsX - 1) / groupsX;
+	glDispatchCompute(groupsX, groupsY, numObservers);
+}
+
+/*
+* Computes the viewshed of numObservers observers in a single
+* dispatch, one output layer each. Radii and image bounds are
+* taken from p[0], they are the same for all observers.
+*/
+int GLViewshedEngine::runBatch(const viewshedParams* p, unsigned int numObservers)
+{
+	if (batchProg == 0 || elevTex == 0) {
+		printf("GLViewshedEngine::runBatch(): engine has no batch program or elevation data\n");
+		return 0;
+	}
+
+	if (numObservers == 0 || numObservers > maxBatch) {
+		printf("GLViewshedEngine::runBatch(): %u observers, between 1 and %u are supported\n", numObservers, maxBatch);
+		return 0;
+	}
+
+	glBeginQuery(GL_TIME_ELAPSED, timeQuery);
+	int status = dispatchBatch(p, numObservers);
+	glEndQuery(GL_TIME_ELAPSED);
+
+	batchSize = status ? numObservers : 0;
+	return status;
+}
+
+/*
+* Uploads numObservers observers, clears their output layers and
+* dispatches the batch program.
+*/
+int GLViewshedEngine::dispatchBatch(const viewshedParams* p, unsigned int numObservers)
+{
+	/* Observers as laid out by the std430 observer struct of visibility.comp */
+	GLfloat* obs = (GLfloat*)malloc((size_t)numObservers * 8 * sizeof(GLfloat));
+	if (obs == NULL) {
+		printf("GLViewshedEngine::dispatchBatch(): out of memory\n");
+		return 0;
+	}
+	GLuint numRays = 0;
+	for (unsigned int i = 0; i < numObservers; i++) {
+		if (!observerInBounds(&p[i])) {
+			printf("GLViewshedEngine::dispatchBatch(): observer %u location is outside defined altitude raster\n", i);
+			free(obs);
+			return 0;
+		}
+
+		double scale[2];
+		localPixelScale(&p[i], width, height, scale);
+		GLfloat* o = obs + (size_t)i * 8;
+		o[0] = (GLfloat)p[i].lat1;
+		o[1] = (GLfloat)p[i].lon1;
+		o[2] = (GLfloat)p[i].observerAltitude;
+		o[3] = (GLfloat)p[i].targetAltitude;
+		o[4] = (GLfloat)scale[0];
+		o[5] = (GLfloat)scale[1];
+
+		/* Rays to the range circle, as a float the count is exact up to 2^24 */
+		viewshedRays rays;
+		raySet(&p[i], &rays);
+		o[6] = (GLfloat)rays.range;
+		o[7] = (GLfloat)rays.numRays;
+		GLuint observerRays = rays.numRays > 0 ? rays.numRays : 2 * (width - 2) + 2 * height;
+		if (observerRays > numRays)
+			numRays = observerRays;
+	}
+
+	if (observerBuf == 0)
+		glGenBuffers(1, &observerBuf);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, observerBuf);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)numObservers * 8 * sizeof(GLfloat), obs, GL_STREAM_DRAW);
+	free(obs);
+
+	/* Layered output, only grows */
+	if (numObservers > batchLayers) {
+		if (batchTex != 0) glDeleteTextures(1, &batchTex);
+		glGenTextures(1, &batchTex);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, batchTex);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_R32UI, wordsPerRow, height, numObservers);
+		batchLayers = numObservers;
+	}
+
+	GLuint clearColor[1] = { 0 };
+	glClearTexSubImage(batchTex, 0, 0, 0, 0, wordsPerRow, height, numObservers, GL_RED_INTEGER, GL_UNSIGNED_INT, clearColor);
+
+	glBindImageTexture(0, batchTex, 0, GL_TRUE, 0, GL_READ_WRITE, GL_R32UI);
+	bindElevation();
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, observerBuf);
+
+	glUseProgram(batchProg);
+	setUniforms(&batchLoc, &p[0]);
+	dispatchRays(numRays, numObservers);
+
+	return 1;
+}
+
+/*
+* Reads back the packed output of the last runBatch(), batchSize
+* layers of height rows of wordsPerRow words each.
+*/
+int GLViewshedEngine::readPackedBatch(uint32_t* packed)
+{
+	if (batchTex == 0 || batchSize == 0)
+		return 0;
+
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glGetTextureSubImage(batchTex, 0, 0, 0, 0, wordsPerRow, height, batchSize, GL_RED_INTEGER, GL_UNSIGNED_INT,
+		(GLsizei)((size_t)wordsPerRow * height * batchSize * sizeof(GLuint)), packed);
+
+	return 1;
+}
+
+/*
+* Reads back the packed output of the last run,
+* height rows of wordsPerRow words each. Only the
+* range box comes from the GPU, the rest is zeroed.
+*/
+int GLViewshedEngine::readPacked(uint32_t* packed)
+{
+	if (visTex == 0)
+		return 0;
+
+	// Make sure writing to image has finished before read
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+	GLuint x0 = rangeBox[0] / 32, x1 = rangeBox[2] / 32;
+	GLuint y0 = rangeBox[1], y1 = rangeBox[3];
+	if (x0 != 0 || y0 != 0 || x1 != wordsPerRow - 1 || y1 != height - 1) {
+		memset(packed, 0, (size_t)wordsPerRow * height * sizeof(uint32_t));
+		glPixelStorei(GL_PACK_ROW_LENGTH, wordsPerRow);
+	}
+
+	size_t offset = (size_t)y0 * wordsPerRow + x0;
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glGetTextureSubImage(visTex, 0, x0, y0, 0, x1 - x0 + 1, y1 - y0 + 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT,
+		(GLsizei)(((size_t)wordsPerRow * height - offset) * sizeof(GLuint)), packed + offset);
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+
+	return 1;
+}
+
+/*
+* Counts, for every cell, the observers p[0..numObservers) that see
+* it. Each batch of observers is ray marched into the batch layers,
+* then cumulative.comp adds the layers to the count texture.
+*/
+int GLViewshedEngine::runCumulative(const viewshedParams* p, unsigned int numObservers)
+{
+	if (countProg == 0 || elevTex == 0) {
+		printf("GLViewshedEngine::runCumulative(): engine has no batch program or elevation data\n");
+		return 0;
+	}
+
+	/* Batches big enough to fill the GPU, small enough to keep the layers in memory */
+	unsigned int chunk = cumulativeBatch;
+	if (chunk == 0) {
+		size_t layerBytes = (size_t)wordsPerRow * height * sizeof(GLuint);
+		chunk = (unsigned int)(((size_t)256 << 20) / layerBytes);
+	}
+	if (chunk > maxBatch) chunk = maxBatch;
+	if (chunk == 0) chunk = 1;
+
+	if (countTex == 0) {
+		glGenTextures(1, &countTex);
+		glBindTexture(GL_TEXTURE_2D, countTex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32UI, width, height);
+	}
+
+	glBeginQuery(GL_TIME_ELAPSED, timeQuery);
+
+	GLuint clearColor[1] = { 0 };
+	glClearTexImage(countTex, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, clearColor);
+
+	int status = 1;
+	for (unsigned int first = 0; first < numObservers && status; first += chunk) {
+		unsigned int n = numObservers - first < chunk ? numObservers - first : chunk;
+		status = dispatchBatch(p + first, n);
+		if (!status)
+			break;
+
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+		glUseProgram(countProg);
+		glUniform2i(countImgSize, (GLint)height, (GLint)width);
+		glUniform1i(countNumLayers, (GLint)n);
+		glBindImageTexture(0, batchTex, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32UI);
+		glBindImageTexture(3, countTex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+		glDispatchCompute((width + 15) / 16, (height + 15) / 16, 1);
+
+		/* Next batch clears and rewrites the layers */
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+	}
+
+	glEndQuery(GL_TIME_ELAPSED);
+
+	batchSize = 0;
+	return status;
+}
+
+/*
+* Reads back the count raster of the last runCumulative(),
+* row-major, one uint32 per cell.
+*/
+int GLViewshedEngine::readCount(uint32_t* count)
+{
+	if (countTex == 0)
+		return 0;
+
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glGetTextureImage(countTex, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, (GLsizei)((size_t)width * height * sizeof(GLuint)), count);
+
+	return 1;
+}
+
+/*
+* GPU time of the last run (clear and dispatch) in ms,
+* waits for the run to finish.
+*/
+double GLViewshedEngine::gpuTime()
+{
+	if (timeQuery == 0 || !glIsQuery(timeQuery))
+		return 0;
+
+	GLuint64 elapsed = 0;
+	glGetQueryObjectui64v(timeQuery, GL_QUERY_RESULT, &elapsed);
+	return elapsed * 1e-6;
+}
+
+/*
+* Deletes all GPU resources. Needs the context that
+* created them to still be current.
+*/
+void GLViewshedEngine::release()
+{
+	if (prog != 0) glDeleteProgram(prog);
+	if (heightProg != 0) glDeleteProgram(heightProg);
+	if (batchProg != 0) glDeleteProgram(batchProg);
+	if (countProg != 0) glDeleteProgram(countProg);
+	if (elevTex != 0) glDeleteTextures(1, &elevTex);
+	if (visTex != 0) glDeleteTextures(1, &visTex);
+	if (relTex != 0) glDeleteTextures(1, &relTex);
+	if (batchTex != 0) glDeleteTextures(1, &batchTex);
+	if (countTex != 0) glDeleteTextures(1, &countTex);
+	if (observerBuf != 0) glDeleteBuffers(1, &observerBuf);
+	if (timeQuery != 0) glDeleteQueries(1, &timeQuery);
+
+	prog = 0;
+	heightProg = 0;
+	batchProg = 0;
+	countProg = 0;
+	relTex = 0;
+	batchTex = 0;
+	countTex = 0;
+	observerBuf = 0;
+	batchLayers = batchSize = maxBatch = 0;
+	elevTex = 0;
+	visTex = 0;
+	timeQuery = 0;
+	width = height = wordsPerRow = 0;
+}
@@ -0,0 +1,143 @@
+#ifndef VIEWSHEDGL_H
+#define VIEWSHEDGL_H
+
+#include "gl/glad.h"
+#include "viewshed.h"
+
+/*
+* How visibility.comp writes the packed output, see OUTPUT_MODE there.
+*/
+enum visOutputMode {
+	VIS_OUTPUT_ATOMIC = 0,		/* atomic OR at every ray step */
+	VIS_OUTPUT_VISIBLE,			/* atomic OR of visible cells only */
+	VIS_OUTPUT_BALLOT			/* subgroup OR before the atomic, needs GL_ARB_shader_ballot */
+};
+
+/*
+* Storage of the elevation texture, see ELEVATION_MODE in shaders/elevation.glsl.
+*/
+enum visElevationFormat {
+	VIS_ELEVATION_R32F = 0,		/* float meters, read as an image */
+	VIS_ELEVATION_R16UI,		/* 65536 steps over elevationRange, read with texelFetch */
+	VIS_ELEVATION_R16F			/* half floats around the middle of elevationRange, read with texelFetch */
+};
+
+/*
+* Compile time options of the visibility program.
+*/
+struct glViewshedOptions {
+	unsigned int localSize;		/* rays per workgroup */
+	visOutputMode output;		/* output path */
+	bool rotationWaypoints;		/* great-circle way points by rotation recurrence, see greatCircle.glsl */
+	bool localProjection;		/* straight rays in pixel space, see viewshedLocalProjectionError() */
+	bool precomputeHeights;		/* two passes, heightField.comp then the ray march */
+	bool tangentCompare;		/* slopes compared by cross multiplication instead of atan */
+	visElevationFormat elevation;	/* elevation texture format */
+
+	glViewshedOptions() : localSize(64), output(VIS_OUTPUT_VISIBLE), rotationWaypoints(false), localProjection(false),
+		precomputeHeights(false), tangentCompare(false), elevation(VIS_ELEVATION_R32F) {}
+};
+
+/*
+* GPU viewshed engine. Keeps the compute program, the elevation
+* texture and the packed output texture resident on the GPU.
+* Running another observer over the same DEM only updates uniforms,
+* clears the output and dispatches.
+*
+* Rays are packed options.localSize to a workgroup and dispatched as a 2D
+* grid of workgroups once they no longer fit in the X dimension.
+*
+* With options.precomputeHeights, heightField.comp (next to the
+* visibility shader) first writes the observer-relative height and
+* range of every pixel to a scratch texture, the ray march then only
+* loads and compares.
+*
+* runBatch() computes many observers in one dispatch, with the
+* observers in a storage buffer and one packed output layer each.
+* It is not available with options.precomputeHeights.
+*
+* runCumulative() runs its observers in batches of at most
+* cumulativeBatch and has cumulative.comp add each batch to a count
+* texture, nothing is read back until readCount().
+*
+* With a 16-bit options.elevation, heights are quantized on upload to
+* elevationRange, which setElevation() with data fits to the DEM and
+* setElevation() without data takes as set. That halves the bytes the
+* ray march reads per step, quantizationError tells what it costs.
+*
+* With maxRange or an azimuth sector, run() clears and reads back only
+* the words of the box the rays reach. Batches keep whole layers,
+* every observer has its own box.
+*
+* Requires a current OpenGL 4.4 context with functions loaded.
+*/
+class GLViewshedEngine : public ViewshedEngine {
+public:
+	GLViewshedEngine();
+	~GLViewshedEngine();
+
+	int init(const char* shaderPath, const glViewshedOptions& opt = glViewshedOptions());
+	int setElevation(const float* elev, unsigned int width, unsigned int height);
+	int setElevationRect(const float* elev, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned int stride);
+	int setElevationSamples(const void* samples, unsigned int width, unsigned int height, visElevationFormat format);
+	int run(const viewshedParams* p);
+	int readPacked(uint32_t* packed);
+	int runBatch(const viewshedParams* p, unsigned int numObservers);
+	int readPackedBatch(uint32_t* packed);
+	int runCumulative(const viewshedParams* p, unsigned int numObservers);
+	int readCount(uint32_t* count);
+	void release();
+	double gpuTime();
+
+	glViewshedOptions options;	/* options the program was built with */
+	unsigned int maxBatch;		/* most observers runBatch() takes at once */
+	unsigned int batchSize;		/* observers of the last runBatch() */
+	unsigned int cumulativeBatch;	/* observers per dispatch of runCumulative(), 0 sizes batches to 256 MB of output */
+	float elevationRange[2];	/* lowest and highest height the 16-bit formats hold, in meters */
+	float quantizationError;	/* largest error of the 16-bit heights uploaded since setElevation(), in meters */
+
+private:
+	struct uniformLocations {
+		GLint observerAltitude, targetAltitude;
+		GLint lat1, lon1;
+		GLint actualRadius, effectiveRadius;
+		GLint imgBounds, imgSize;
+		GLint numRays;
+		GLint pixelScale;
+		GLint rayRange, rangeRays;
+		GLint azimuth, verticalFOV, elevationTan;
+		GLint elevationQuant;
+	};
+
+	static void getUniformLocations(GLuint program, uniformLocations* l);
+	void setUniforms(const uniformLocations* l, const viewshedParams* p);
+
+	void bindElevation();
+	void dispatchRays(GLuint numRays, GLuint numObservers);
+	int dispatchBatch(const viewshedParams* p, unsigned int numObservers);
+
+	GLuint prog;
+	GLuint heightProg;
+	GLuint batchProg;
+	GLuint countProg;
+	GLuint elevTex;
+	GLuint visTex;
+	GLuint relTex;
+	GLuint batchTex;
+	GLuint countTex;
+	GLuint observerBuf;
+	GLuint timeQuery;
+
+	uniformLocations loc;
+	uniformLocations heightLoc;
+	uniformLocations batchLoc;
+	GLint countImgSize, countNumLayers;
+	unsigned int batchLayers;
+	unsigned int rangeBox[4];	/* output cells of the last run, x0 y0 x1 y1 */
+	visElevationFormat elevFormat;	/* of elevTex */
+	float elevationQuant[2];	/* 16-bit value to meters, scale and offset */
+
+	GLint maxGroupsX;
+};
+
+#endif // !VIEWSHEDGL_H
@@ -0,0 +1,65 @@
+#include "viewshedCPU.h"
+
+#include <float.h>
+#include <math.h>
+
+/*
+* Reference-plane viewshed (Wang, Robinson and White 2000), scalar
+* reference of the row kernels in viewshedPacket.h. The octants are
+* those of XDraw, ring r being row r of the octant. Every cell keeps
+* an auxiliary height, the higher of its own curvature-adjusted
+* height and of the plane through the observer and the auxiliary
+* heights of its two inward neighbours. The cell is visible when its
+* target is above that plane. Along the line of sight the plane is the
+* interpolated height where the line crosses the previous row,
+* extrapolated by r/(r-1).
+*
+* East and west octants read elevT, the DEM transposed, so that a row
+* of any octant is contiguous in memory.
+*/
+void refPlaneOctantScalar(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis)
+{
+	const size_t stride = ((size_t)o->maxK + 2 + 15) & ~(size_t)15;
+	float* prev = ring;
+	float* cur = ring + stride;
+
+	const bool transposed = o->mx != 0;
+	const float* e = transposed ? elevT : c->elev;
+	const int rowStride = transposed ? c->H : c->W;
+	const float sx = c->pixelScale[0], sy = c->pixelScale[1];
+	const float invTwoR = 0.5f / (c->effectiveRadius * 1e3f);
+
+	for (int r = 1; r <= o->numRings; r++) {
+		int kmax = r < o->maxK ? r : o->maxK;
+		int x0 = c->x1 + r * o->mx, y0 = c->y1 + r * o->my;
+		const float* row = transposed ? &e[(size_t)x0 * rowStride + y0] : &e[(size_t)y0 * rowStride + x0];
+		const int step = transposed ? o->ny : o->nx;
+		const float extrapolate = (float)r / (float)(r - 1);
+
+		for (int k = 0; k <= kmax; k++) {
+			float dx = (float)(r * o->mx) * sx + (float)k * (o->nx * sx);
+			float dy = (float)(r * o->my) * sy + (float)k * (o->ny * sy);
+			float z = row[k * step] - (dx * dx + dy * dy) * invTwoR - c->h1;
+
+			/* The first row only has the observer inwards */
+			float plane = -FLT_MAX;
+			if (r > 1) {
+				float p = (float)(k * (r - 1)) / (float)r;
+				int a = (int)p;
+				float w = p - (float)a;
+				plane = (prev[a] + w * (prev[a + 1] - prev[a])) * extrapolate;
+			}
+
+			if (z + c->targetAltitude > plane) {
+				int x = x0 + k * o->nx, y = y0 + k * o->ny;
+				vis[(size_t)y * c->wordsPerRow + x / 32] |= 1u << (x % 32);
+			}
+			cur[k] = z > plane ? z : plane;
+		}
+
+		cur[kmax + 1] = cur[kmax];
+		float* t = prev;
+		prev = cur;
+		cur = t;
+	}
+}
@@ -0,0 +1,112 @@
+#include "viewshedCPU.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+
+// SSE4.1 is enabled for this file only, callers check detectSimdLevel() first
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse4.1"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC target("sse4.1")
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include <smmintrin.h>
+
+struct vecSSE4 {
+	enum { N = 4 };
+	typedef __m128 f;
+	typedef __m128i i;
+	typedef __m128 m;
+
+	static inline f set1(float a) { return _mm_set1_ps(a); }
+	static inline f load(const float* p) { return _mm_load_ps(p); }
+	static inline void store(float* p, f a) { _mm_store_ps(p, a); }
+	static inline f add(f a, f b) { return _mm_add_ps(a, b); }
+	static inline f sub(f a, f b) { return _mm_sub_ps(a, b); }
+	static inline f mul(f a, f b) { return _mm_mul_ps(a, b); }
+	static inline f div(f a, f b) { return _mm_div_ps(a, b); }
+	static inline f sqrt(f a) { return _mm_sqrt_ps(a); }
+	static inline f fand(f a, f b) { return _mm_and_ps(a, b); }
+	static inline f fxor(f a, f b) { return _mm_xor_ps(a, b); }
+	static inline f itof(i a) { return _mm_cvtepi32_ps(a); }
+	static inline f castf(i a) { return _mm_castsi128_ps(a); }
+	static inline f select(m k, f a, f b) { return _mm_blendv_ps(b, a, k); }
+	static inline m gt(f a, f b) { return _mm_cmpgt_ps(a, b); }
+	static inline m lt(f a, f b) { return _mm_cmplt_ps(a, b); }
+
+	static inline i iset1(int a) { return _mm_set1_epi32(a); }
+	static inline i iload(const int* p) { return _mm_load_si128((const __m128i*)p); }
+	static inline void istore(int* p, i a) { _mm_store_si128((__m128i*)p, a); }
+	static inline i iadd(i a, i b) { return _mm_add_epi32(a, b); }
+	static inline i isub(i a, i b) { return _mm_sub_epi32(a, b); }
+	static inline i imul(i a, i b) { return _mm_mullo_epi32(a, b); }
+	static inline i iand(i a, i b) { return _mm_and_si128(a, b); }
+	static inline i iandnot(i a, i b) { return _mm_andnot_si128(b, a); }
+	static inline i islli29(i a) { return _mm_slli_epi32(a, 29); }
+	static inline i isrli5(i a) { return _mm_srai_epi32(a, 5); }
+	static inline i ftoi(f a) { return _mm_cvttps_epi32(a); }
+	static inline i iselect(m k, i a, i b) { return _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(b), _mm_castsi128_ps(a), k)); }
+	static inline m ieq(i a, i b) { return _mm_castsi128_ps(_mm_cmpeq_epi32(a, b)); }
+	static inline m igt(i a, i b) { return _mm_castsi128_ps(_mm_cmpgt_epi32(a, b)); }
+	static inline m ige(i a, i b) { return _mm_xor_ps(igt(b, a), _mm_castsi128_ps(_mm_set1_epi32(-1))); }
+
+	static inline m mand(m a, m b) { return _mm_and_ps(a, b); }
+	static inline m mandnot(m a, m b) { return _mm_andnot_ps(b, a); }
+	static inline m mor(m a, m b) { return _mm_or_ps(a, b); }
+	static inline int bits(m a) { return _mm_movemask_ps(a); }
+
+	/* No gather instruction before AVX2 */
+	static inline f gather(const float* base, i idx, m k)
+	{
+		int index[4];
+		float out[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		_mm_storeu_si128((__m128i*)index, idx);
+		int kb = _mm_movemask_ps(k);
+		for (int l = 0; l < 4; l++) {
+			if (kb & (1 << l))
+				out[l] = base[index[l]];
+		}
+		return _mm_loadu_ps(out);
+	}
+};
+
+#include "viewshedPacket.h"
+
+void traceRayPacketSSE4(const cpuRayContext* c, const int* rays, int numRays, uint32_t* vis)
+{
+	traceRayPacket<vecSSE4>(c, rays, numRays, vis);
+}
+
+void xdrawOctantSSE4(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis)
+{
+	xdrawOctantKernel<vecSSE4>(c, o, ring, vis);
+}
+
+void refPlaneOctantSSE4(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis)
+{
+	refPlaneOctantKernel<vecSSE4>(c, o, elevT, ring, vis);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#else
+
+void traceRayPacketSSE4(const cpuRayContext* c, const int* rays, int numRays, uint32_t* vis)
+{
+	for (int r = 0; r < numRays; r++)
+		traceRayScalar(c, rays[r], vis);
+}
+
+void xdrawOctantSSE4(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis)
+{
+	xdrawOctantScalar(c, o, ring, vis);
+}
+
+void refPlaneOctantSSE4(const cpuRayContext* c, const xdrawOctant* o, const float* elevT, float* ring, uint32_t* vis)
+{
+	refPlaneOctantScalar(c, o, elevT, ring, vis);
+}
+
+#endif
@@ -0,0 +1,343 @@
+#include "viewshedCPU.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+/*
+* Exact viewshed by radial sweep (Van Kreveld 1996). A line from the
+* observer sweeps once around, every cell is an interval of angles
+* (enter to exit) and a center event. The cells the line crosses are
+* kept in a max tree over their rank by distance, so at the center
+* event of a cell the steepest slope of the cells strictly nearer on
+* the line is one prefix query. The events are sorted once for the
+* whole circle, every sector takes its run of them. Distances use the
+* observer-local projection (pixelScale) and heights the Earth
+* curvature of visibility.comp, in double.
+*/
+
+const double TWO_PI = 6.283185307179586476925286766559;
+
+enum sweepEventType {
+	SWEEP_ENTER = 0,
+	SWEEP_CENTER,
+	SWEEP_EXIT
+};
+
+/* Angle of (dx,dy) in [0, 2pi) */
+static inline double sweepAngle(double dx, double dy)
+{
+	double a = atan2(dy, dx);
+	return a < 0 ? a + TWO_PI : a;
+}
+
+/* Angle of the point (px,py) in pixels, corners are at half pixels */
+static inline double cornerAngle(const cpuRayContext* c, double px, double py)
+{
+	return sweepAngle((px - c->x1) * c->pixelScale[0], (py - c->y1) * c->pixelScale[1]);
+}
+
+/* Events sort by angle, then type, angles are >= 0 so their float bits sort like them */
+static inline uint64_t sweepEvent(float angle, sweepEventType type, int cell)
+{
+	uint32_t bits;
+	memcpy(&bits, &angle, sizeof(bits));
+	return ((uint64_t)bits << 32) | ((uint64_t)type << 30) | (uint32_t)cell;
+}
+
+/*
+* Stable LSD radix sort of keys on bits [lowBit, lowBit+33), the bits
+* above are 0. tmp is scratch space.
+*/
+static void radixSortKeys(std::vector<uint64_t>& keys, std::vector<uint64_t>& tmp, int lowBit)
+{
+	const int digitBits = 11, numDigits = 1 << digitBits;
+	std::vector<size_t> count(numDigits);
+
+	tmp.resize(keys.size());
+	for (int pass = 0; pass < 3; pass++) {
+		int shift = lowBit + pass * digitBits;
+		std::fill(count.begin(), count.end(), 0);
+		for (size_t i = 0; i < keys.size(); i++)
+			count[(keys[i] >> shift) & (numDigits - 1)]++;
+		size_t sum = 0;
+		for (int d = 0; d < numDigits; d++) {
+			size_t n = count[d];
+			count[d] = sum;
+			sum += n;
+		}
+		for (size_t i = 0; i < keys.size(); i++)
+			tmp[count[(keys[i] >> shift) & (numDigits - 1)]++] = keys[i];
+		keys.swap(tmp);
+	}
+}
+
+/* Elevation and target slopes of a cell (dx,dy) meters from the observer */
+static inline void sweepCellSlopes(const cpuRayContext* c, double dx, double dy, float h, sweepCell* cell)
+{
+	const double reff = (double)c->effectiveRadius * 1e3;
+
+	// Adjust Earth profile altitude to take into account effective radius of the Earth
+	double gndRng = sqrt(dx * dx + dy * dy);
+	double r = reff + h;
+	double phi = gndRng / reff;
+	double rng = r * sin(phi);
+	double el = r * cos(phi) - reff - c->h1;
+	cell->slope = el / rng;
+	cell->target = (el + c->targetAltitude) / rng;
+}
+
+/*
+* Angles and slopes of cell (x,y) of height h.
+*/
+void setupSweepCell(const cpuRayContext* c, int x, int y, float h, sweepCell* cell)
+{
+	if (x == c->x1 && y == c->y1) {
+		cell->enter = cell->center = cell->exit = 0.0f;
+		cell->slope = cell->target = -INFINITY;
+		return;
+	}
+
+	cell->center = (float)cornerAngle(c, x, y);
+	if (y == c->y1 && x > c->x1) {
+		/* Straddles angle 0 */
+		cell->enter = (float)cornerAngle(c, x - 0.5, y - 0.5);
+		cell->exit = (float)cornerAngle(c, x - 0.5, y + 0.5);
+		cell->center = 0.0f;
+	}
+	else {
+		double a[4] = { cornerAngle(c, x - 0.5, y - 0.5), cornerAngle(c, x + 0.5, y - 0.5),
+			cornerAngle(c, x - 0.5, y + 0.5), cornerAngle(c, x + 0.5, y + 0.5) };
+		cell->enter = (float)std::min(std::min(a[0], a[1]), std::min(a[2], a[3]));
+		cell->exit = (float)std::max(std::max(a[0], a[1]), std::max(a[2], a[3]));
+	}
+
+	sweepCellSlopes(c, (x - c->x1) * c->pixelScale[0], (y - c->y1) * c->pixelScale[1], h, cell);
+}
+
+/*
+* Angles and slopes of the cells of rows [y0, y1), the same as
+* setupSweepCell() but every corner angle is computed once for the
+* cells around it. Cells outside the range circle get the slopes of
+* the observer cell, so they have no events.
+*/
+void setupSweepCells(const cpuRayContext* c, int y0, int y1, sweepCell* cells)
+{
+	const int W = c->W, cornersPerRow = W + 1;
+	std::vector<float> corners((size_t)(y1 - y0 + 1) * cornersPerRow);
+	for (int y = y0; y <= y1; y++) {
+		float* row = &corners[(size_t)(y - y0) * cornersPerRow];
+		for (int x = 0; x <= W; x++)
+			row[x] = (float)cornerAngle(c, x - 0.5, y - 0.5);
+	}
+
+	for (int y = y0; y < y1; y++) {
+		const float* top = &corners[(size_t)(y - y0) * cornersPerRow];
+		const float* bottom = top + cornersPerRow;
+		for (int x = 0; x < W; x++) {
+			size_t i = (size_t)y * W + x;
+			sweepCell* cell = &cells[i];
+			if (x == c->x1 && y == c->y1) {
+				setupSweepCell(c, x, y, c->elev[i], cell);
+				continue;
+			}
+			if (!inRangeCircle(c, x, y)) {
+				cell->enter = cell->center = cell->exit = 0.0f;
+				cell->slope = cell->target = -INFINITY;
+				continue;
+			}
+
+			if (y == c->y1 && x > c->x1) {
+				cell->enter = top[x];
+				cell->exit = bottom[x];
+				cell->center = 0.0f;
+			}
+			else {
+				cell->enter = std::min(std::min(top[x], top[x + 1]), std::min(bottom[x], bottom[x + 1]));
+				cell->exit = std::max(std::max(top[x], top[x + 1]), std::max(bottom[x], bottom[x + 1]));
+				cell->center = (float)cornerAngle(c, x, y);
+			}
+			sweepCellSlopes(c, (x - c->x1) * c->pixelScale[0], (y - c->y1) * c->pixelScale[1], c->elev[i], cell);
+		}
+	}
+}
+
+/*
+* Ranks the cells by distance to the observer. order and tmp are
+* scratch space for the sort.
+*/
+void rankSweepCells(const cpuRayContext* c, sweepCell* cells, std::vector<uint64_t>& order, std::vector<uint64_t>& tmp)
+{
+	const double sx = c->pixelScale[0], sy = c->pixelScale[1];
+	const size_t numCells = (size_t)c->W * c->H;
+
+	order.resize(numCells);
+	for (int y = 0; y < c->H; y++) {
+		for (int x = 0; x < c->W; x++) {
+			double dx = (x - c->x1) * sx, dy = (y - c->y1) * sy;
+			float dist = (float)(dx * dx + dy * dy);
+			uint32_t bits;
+			memcpy(&bits, &dist, sizeof(bits));
+			size_t i = (size_t)y * c->W + x;
+			order[i] = ((uint64_t)bits << 32) | (uint32_t)i;
+		}
+	}
+	/* Distances are >= 0, the sign bit is clear */
+	radixSortKeys(order, tmp, 32);
+
+	/* Equidistant cells do not block each other */
+	int nearer = 0;
+	for (size_t k = 0; k < numCells; k++) {
+		if (k > 0 && (order[k] >> 32) != (order[k - 1] >> 32))
+			nearer = (int)k;
+		sweepCell* cell = &cells[(uint32_t)order[k]];
+		cell->rank = (int)k;
+		cell->nearer = nearer;
+	}
+}
+
+/*
+* The enter, center and exit events of all cells, sorted by angle
+* and type. Cells of the same angle and type keep their DEM order.
+*/
+void sortSweepEvents(const cpuRayContext* c, const sweepCell* cells, std::vector<uint64_t>& events, std::vector<uint64_t>& tmp)
+{
+	const int numCells = c->W * c->H;
+
+	events.clear();
+	for (int i = 0; i < numCells; i++) {
+		const sweepCell* cell = &cells[i];
+		if (cell->slope == -INFINITY)
+			continue;
+		events.push_back(sweepEvent(cell->enter, SWEEP_ENTER, i));
+		events.push_back(sweepEvent(cell->center, SWEEP_CENTER, i));
+		events.push_back(sweepEvent(cell->exit, SWEEP_EXIT, i));
+	}
+	/* Angle and type, the sign bit of the angle is clear */
+	radixSortKeys(events, tmp, 30);
+}
+
+/*
+* Max tree over the distance ranks of all cells, leaves are -INFINITY
+* but for the cells on the sweep line. Bottom-up, leaf k is node n+k.
+*/
+struct rankMaxTree {
+	std::vector<double>& node;
+	std::vector<int>& inserted;
+	size_t n;
+
+	rankMaxTree(sweepScratch* s, size_t numCells) : node(s->rankMax), inserted(s->inserted), n(numCells)
+	{
+		if (node.size() != 2 * n)
+			node.assign(2 * n, -INFINITY);
+		inserted.clear();
+	}
+
+	/* Back to all -INFINITY, only the paths of the inserted leaves are set */
+	~rankMaxTree()
+	{
+		for (size_t k = 0; k < inserted.size(); k++)
+			for (size_t i = n + inserted[k]; i > 0 && node[i] != -INFINITY; i >>= 1)
+				node[i] = -INFINITY;
+	}
+
+	void insert(int rank, double slope)
+	{
+		inserted.push_back(rank);
+		size_t i = n + rank;
+		node[i] = slope;
+		for (i >>= 1; i > 0 && node[i] < slope; i >>= 1)
+			node[i] = slope;
+	}
+
+	void erase(int rank)
+	{
+		size_t i = n + rank;
+		node[i] = -INFINITY;
+		for (i >>= 1; i > 0; i >>= 1) {
+			double m = std::max(node[2 * i], node[2 * i + 1]);
+			if (node[i] == m)
+				break;
+			node[i] = m;
+		}
+	}
+
+	/* Max slope of ranks < rank */
+	double prefixMax(int rank) const
+	{
+		double m = -INFINITY;
+		for (size_t l = n, r = n + rank; l < r; l >>= 1, r >>= 1) {
+			if (l & 1) m = std::max(m, node[l++]);
+			if (r & 1) m = std::max(m, node[--r]);
+		}
+		return m;
+	}
+};
+
+/* The sweep line at angle a crosses the cell */
+static inline bool sweepCrosses(const sweepCell* cell, float a)
+{
+	if (cell->enter > cell->exit)
+		return a > cell->enter || a <= cell->exit;
+	return cell->enter < a && a <= cell->exit;
+}
+
+/*
+* Inserts the cells the line at angle a crosses. The line is walked
+* along its major axis, the cells within two of it on the minor axis
+* are tested against their angles.
+*/
+static void insertSweepLine(const cpuRayContext* c, const sweepCell* cells, float a, rankMaxTree& tree)
+{
+	double ux = cos((double)a) / c->pixelScale[0], uy = sin((double)a) / c->pixelScale[1];
+	bool alongX = fabs(ux) >= fabs(uy);
+	int major = alongX ? c->x1 : c->y1, majorSize = alongX ? c->W : c->H, minorSize = alongX ? c->H : c->W;
+	int step = (alongX ? ux : uy) >= 0 ? 1 : -1;
+	double minorStep = alongX ? uy / fabs(ux) : ux / fabs(uy);
+	double minor0 = alongX ? c->y1 : c->x1;
+
+	for (int m = major, k = 0; m >= 0 && m < majorSize; m += step, k++) {
+		int mid = (int)floor(minor0 + k * minorStep + 0.5);
+		for (int n = std::max(mid - 2, 0); n <= std::min(mid + 2, minorSize - 1); n++) {
+			size_t i = alongX ? (size_t)n * c->W + m : (size_t)m * c->W + n;
+			const sweepCell* cell = &cells[i];
+			if (cell->slope != -INFINITY && sweepCrosses(cell, a))
+				tree.insert(cell->rank, cell->slope);
+		}
+	}
+}
+
+/*
+* Sweeps the sorted events of one sector, all at angles >= a0, and
+* sets the visible cells whose center is in there. Starts from the
+* cells the line at a0 already crosses.
+*/
+void radialSweepSector(const cpuRayContext* c, const sweepCell* cells, const uint64_t* events, size_t numEvents, float a0, sweepScratch* s, uint32_t* vis)
+{
+	rankMaxTree tree(s, (size_t)c->W * c->H);
+	insertSweepLine(c, cells, a0, tree);
+
+	for (size_t e = 0; e < numEvents; e++) {
+		int i = (int)(events[e] & 0x3fffffff);
+		int type = (int)((events[e] >> 30) & 3);
+		const sweepCell* cell = &cells[i];
+
+		if (type == SWEEP_ENTER) {
+			tree.insert(cell->rank, cell->slope);
+		}
+		else if (type == SWEEP_EXIT) {
+			tree.erase(cell->rank);
+		}
+		else if (cell->target > tree.prefixMax(cell->nearer)) {
+			int x = i % c->W, y = i / c->W;
+			vis[(size_t)y * c->wordsPerRow + x / 32] |= 1u << (x % 32);
+		}
+	}
+}
+
+/* First of the sorted events at angles >= a */
+size_t firstSweepEvent(const std::vector<uint64_t>& events, float a)
+{
+	return std::lower_bound(events.begin(), events.end(), sweepEvent(a, SWEEP_ENTER, 0)) - events.begin();
+}
@@ -0,0 +1,274 @@
+#include "viewshedTotal.h"
+#include "timer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+TotalViewshedEngine::TotalViewshedEngine()
+	: width(0), height(0), numSectors(64), maxRange(0), runTime(0), pool(nullptr), maxHeight(0)
+{
+}
+
+TotalViewshedEngine::~TotalViewshedEngine()
+{
+	release();
+}
+
+/*
+* Starts the worker threads, numThreads = 0 uses one thread per
+* hardware thread.
+*/
+int TotalViewshedEngine::init(unsigned int numThreads)
+{
+	delete pool;
+	pool = new ThreadPool(numThreads);
+	threadArea.assign(pool->size(), std::vector<double>());
+	return 1;
+}
+
+/*
+* Keeps a copy of the row-major DEM (in meters).
+*/
+int TotalViewshedEngine::setElevation(const float* e, unsigned int w, unsigned int h)
+{
+	if (pool == nullptr) {
+		printf("TotalViewshedEngine::setElevation(): engine not initialized\n");
+		return 0;
+	}
+	if (w < 2 || h < 2) {
+		printf("TotalViewshedEngine::setElevation(): DEM must be at least 2x2\n");
+		return 0;
+	}
+
+	width = w;
+	height = h;
+	elev.assign(e, e + (size_t)w * h);
+	maxHeight = *std::max_element(elev.begin(), elev.end());
+	area.assign((size_t)w * h, 0.0f);
+	return 1;
+}
+
+/*
+* Computes the visible area, in square meters, from every cell.
+* Observer and target altitudes, radii and image bounds come from p,
+* lat1 and lon1 are not used. Pixel sizes are taken at the center
+* latitude of the DEM.
+*/
+int TotalViewshedEngine::run(const viewshedParams* p)
+{
+	if (pool == nullptr || elev.empty()) {
+		printf("TotalViewshedEngine::run(): engine has no elevation data\n");
+		return 0;
+	}
+	if (numSectors == 0) {
+		printf("TotalViewshedEngine::run(): numSectors must be at least 1\n");
+		return 0;
+	}
+
+	uint64_t startTime = tic();
+
+	viewshedParams center = *p;
+	center.lat1 = 0.5 * (p->imgBounds[0] + p->imgBounds[2]);
+	double scale[2];
+	localPixelScale(&center, width, height, scale);
+
+	for (size_t t = 0; t < threadArea.size(); t++)
+		threadArea[t].assign((size_t)width * height, 0.0);
+
+	pool->run(numSectors, [&](size_t s, unsigned int worker) {
+		runSector((unsigned int)s, p, scale, threadArea[worker].data());
+	});
+
+	/* Sum the worker rasters by row bands */
+	const size_t rowsPerBand = 16;
+	pool->run((height + rowsPerBand - 1) / rowsPerBand, [&](size_t band, unsigned int worker) {
+		size_t begin = band * rowsPerBand * width;
+		size_t end = std::min((size_t)height, (band + 1) * rowsPerBand) * width;
+		for (size_t i = begin; i < end; i++) {
+			double sum = 0;
+			for (size_t t = 0; t < threadArea.size(); t++)
+				sum += threadArea[t][i];
+			area[i] = (float)sum;
+		}
+	});
+
+	runTime = toc(startTime);
+	return 1;
+}
+
+struct lineParams {
+	double scale[2];			/* pixel size, in meters */
+	double delta[2];			/* length of the line across a column and a row, in meters */
+	float invTwoR;				/* 1/(2 effective radius), in 1/meters */
+	float range;				/* in meters */
+	float maxHeight;			/* of the DEM */
+	float observerAltitude;
+	float targetAltitude;
+};
+
+/* A cell of the band of sight, ordered along the sector direction */
+struct bandCell {
+	double t;					/* center along the sector direction, in meters */
+	int x, y;
+	float z;					/* height, in meters */
+
+	bool operator<(const bandCell& o) const
+	{
+		return t < o.t || (t == o.t && (y < o.y || (y == o.y && x < o.x)));
+	}
+};
+
+/*
+* Walks the band of sight of the observer at band[obs] one way, step
+* 1 along the sector direction to the end of the band, -1 against it
+* to the start. The band holds the cells the line of sight crosses in
+* the order it crosses them, so the line leaves each cell where it
+* enters the next (Amanatides and Woo). Every cell blocks with the
+* height and distance of its center, as in the exact radial sweep, and
+* adds t_out^2-t_in^2 of its stretch of the line when its target is
+* above the horizon of the cells before it. The observer cell is
+* visible. The walk ends when even a target on the highest cell of the
+* DEM would be below the horizon from there on.
+*/
+static double walkBand(const std::vector<bandCell>& band, size_t obs, int step, const lineParams& s)
+{
+	const int x1 = band[obs].x, y1 = band[obs].y;
+	const float h0 = band[obs].z + s.observerAltitude;
+	const double deltaX = s.delta[0], deltaY = s.delta[1];
+	const double range = s.range;
+	const float reach = s.maxHeight + s.targetAltitude - h0;
+	const float halfDiagonal = 0.5f * (float)sqrt(s.scale[0] * s.scale[0] + s.scale[1] * s.scale[1]);
+
+	double nextX = 0.5 * deltaX, nextY = 0.5 * deltaY;
+	double tIn = std::min(std::min(nextX, nextY), range);
+	double acc = tIn * tIn;
+	float horizon = -INFINITY;
+
+	/* Each cell is one column or one row on from the cell before */
+	const ptrdiff_t end = step > 0 ? (ptrdiff_t)band.size() : -1;
+	int x = x1;
+	for (ptrdiff_t i = (ptrdiff_t)obs + step; i != end && tIn < range; i += step) {
+		if (band[i].x != x) {
+			x = band[i].x;
+			nextX += deltaX;
+		}
+		else {
+			nextY += deltaY;
+		}
+		const int y = band[i].y;
+		double tOut = std::min(std::min(nextX, nextY), range);
+
+		float dx = (float)((x - x1) * s.scale[0]), dy = (float)((y - y1) * s.scale[1]);
+		float d2 = dx * dx + dy * dy;
+		float el = band[i].z - d2 * s.invTwoR - h0;
+		float inv = 1.0f / sqrtf(d2);
+		if ((el + s.targetAltitude) * inv > horizon)
+			acc += tOut * tOut - tIn * tIn;
+		horizon = std::max(horizon, el * inv);
+		tIn = tOut;
+
+		/* Centers of the cells ahead are at least tIn - halfDiagonal away */
+		float nearest = (float)tIn - halfDiagonal;
+		if (reach >= 0 && nearest > 0 && horizon * nearest > reach)
+			break;
+	}
+	return acc;
+}
+
+/*
+* One sector. A line of sight crosses exactly the cells whose center
+* is closer to it, across the sector direction, than half the width of
+* a cell seen along that direction. The cells are sorted once by their
+* offset across the direction and the observers taken in that order,
+* so the band of sight of the next observer only gains the cells that
+* come into its reach and loses those left behind. The band is kept
+* sorted along the direction and shared by all observers of the
+* sector, each cell enters and leaves it once. Every observer walks
+* it forwards and backwards from its own cell.
+*/
+void TotalViewshedEngine::runSector(unsigned int s, const viewshedParams* p, const double scale[2], double* out)
+{
+	const int W = (int)width;
+	const size_t n = (size_t)W * height;
+
+	double theta = (s + 0.5) * 3.14159265358979323846 / numSectors;
+	double ux = cos(theta), uy = sin(theta);
+
+	lineParams params;
+	params.scale[0] = scale[0];
+	params.scale[1] = scale[1];
+	params.delta[0] = ux != 0 ? scale[0] / fabs(ux) : INFINITY;
+	params.delta[1] = uy != 0 ? scale[1] / fabs(uy) : INFINITY;
+	params.invTwoR = (float)(0.5 / (p->effectiveRadius * 1e3));
+	params.range = maxRange > 0 ? (float)maxRange : INFINITY;
+	params.maxHeight = maxHeight;
+	params.observerAltitude = (float)p->observerAltitude;
+	params.targetAltitude = (float)p->targetAltitude;
+
+	/* Each of the two directions spans pi/numSectors, a ring sector is dtheta/2 (b^2-a^2) */
+	const double halfDtheta = 0.5 * 3.14159265358979323846 / numSectors;
+
+	/* Offset of the cell centers across the direction, and half the band width */
+	std::vector<double> across(n);
+	std::vector<uint32_t> order(n);
+	for (size_t i = 0; i < n; i++) {
+		across[i] = (double)(i / W) * scale[1] * ux - (double)(i % W) * scale[0] * uy;
+		order[i] = (uint32_t)i;
+	}
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return across[a] < across[b] || (across[a] == across[b] && a < b); });
+	const double halfWidth = 0.5 * (scale[0] * fabs(uy) + scale[1] * fabs(ux));
+
+	auto cellOf = [&](uint32_t i) {
+		bandCell c;
+		c.x = (int)(i % W);
+		c.y = (int)(i / W);
+		c.t = c.x * scale[0] * ux + c.y * scale[1] * uy;
+		c.z = elev[i];
+		return c;
+	};
+
+	std::vector<bandCell> band;
+	size_t enter = 0, leave = 0;
+	for (size_t k = 0; k < n; k++) {
+		const double a = across[order[k]];
+		for (; enter < n && across[order[enter]] < a + halfWidth; enter++) {
+			bandCell c = cellOf(order[enter]);
+			band.insert(std::lower_bound(band.begin(), band.end(), c), c);
+		}
+		for (; across[order[leave]] <= a - halfWidth; leave++)
+			band.erase(std::lower_bound(band.begin(), band.end(), cellOf(order[leave])));
+
+		bandCell c = cellOf(order[k]);
+		size_t obs = std::lower_bound(band.begin(), band.end(), c) - band.begin();
+		double acc = walkBand(band, obs, 1, params) + walkBand(band, obs, -1, params);
+		out[(size_t)c.y * W + c.x] += halfDtheta * acc;
+	}
+}
+
+/*
+* Copies out the visible area of the last run,
+* row-major, in square meters.
+*/
+int TotalViewshedEngine::readArea(float* a)
+{
+	if (area.empty())
+		return 0;
+
+	memcpy(a, area.data(), area.size() * sizeof(float));
+	return 1;
+}
+
+void TotalViewshedEngine::release()
+{
+	delete pool;
+	pool = nullptr;
+
+	elev.clear();
+	area.clear();
+	threadArea.clear();
+	width = height = 0;
+}
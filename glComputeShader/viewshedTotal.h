@@ -0,0 +1,56 @@
+#ifndef VIEWSHEDTOTAL_H
+#define VIEWSHEDTOTAL_H
+
+#include <vector>
+
+#include "viewshed.h"
+#include "threadpool.h"
+
+/*
+* Total viewshed engine, the visible area from every cell of the DEM,
+* after the sector-based total viewshed of Tabik et al.
+*
+* Directions are split into numSectors sectors over 180 degrees, each
+* sector also covering its opposite. The line of sight of an observer
+* runs through the middle of the sector, and its band of sight is the
+* cells the line crosses. Per sector the cells are sorted once across
+* the sector direction and visited in that order, so one band, kept
+* sorted along the direction, slides over all observers with every
+* cell entering and leaving it once. Each observer walks the band both
+* ways from its cell, every cell blocking with its center height like
+* in the exact radial sweep (CPU_RADIAL_SWEEP), and every visible cell
+* adds the area of its stretch of the ring sector. The areas converge
+* to those of the exact sweep as numSectors grows, main.cpp checks the
+* error.
+*
+* Sectors run on a work-stealing pool, every worker accumulates into
+* its own area raster and the rasters are summed at the end.
+*/
+class TotalViewshedEngine {
+public:
+	TotalViewshedEngine();
+	~TotalViewshedEngine();
+
+	int init(unsigned int numThreads);
+	int setElevation(const float* elev, unsigned int width, unsigned int height);
+	int run(const viewshedParams* p);
+	int readArea(float* area);
+	void release();
+
+	unsigned int width;			/* DEM width in pixels */
+	unsigned int height;		/* DEM height in pixels */
+	unsigned int numSectors;	/* sectors over 180 degrees */
+	double maxRange;			/* in meters, 0 sees to the DEM edge */
+	double runTime;				/* last run, in ms */
+
+private:
+	void runSector(unsigned int s, const viewshedParams* p, const double scale[2], double* area);
+
+	ThreadPool* pool;
+	std::vector<float> elev;
+	float maxHeight;			/* of elev, ends the lines of sight early */
+	std::vector<float> area;
+	std::vector< std::vector<double> > threadArea;
+};
+
+#endif // !VIEWSHEDTOTAL_H
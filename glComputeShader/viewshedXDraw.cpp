@@ -0,0 +1,57 @@
+#include "viewshedCPU.h"
+
+#include <float.h>
+#include <math.h>
+
+/*
+* XDraw (Franklin and Ray 1994), scalar reference of the ring kernels
+* in viewshedPacket.h. Rings are squares around the observer, the
+* line of sight of cell k of ring r crosses ring r-1 at k(r-1)/r, and
+* the horizon there is interpolated between the two cells around it.
+* The horizon of a cell is the steeper of that and its own slope.
+* Distances use the observer-local projection (pixelScale), heights
+* the parabolic Earth curvature of the effective radius.
+*/
+void xdrawOctantScalar(const cpuRayContext* c, const xdrawOctant* o, float* ring, uint32_t* vis)
+{
+	const size_t stride = ((size_t)o->maxK + 2 + 15) & ~(size_t)15;
+	float* prev = ring;
+	float* cur = ring + stride;
+
+	const float sx = c->pixelScale[0], sy = c->pixelScale[1];
+	const float invTwoR = 0.5f / (c->effectiveRadius * 1e3f);
+
+	/* Ring 0 is the observer, it hides nothing */
+	prev[0] = prev[1] = -FLT_MAX;
+
+	for (int r = 1; r <= o->numRings; r++) {
+		int kmax = r < o->maxK ? r : o->maxK;
+		int x0 = c->x1 + r * o->mx, y0 = c->y1 + r * o->my;
+
+		for (int k = 0; k <= kmax; k++) {
+			int x = x0 + k * o->nx, y = y0 + k * o->ny;
+
+			/* Crossing with ring r-1, prev[kmax+1] repeats the last cell */
+			float p = (float)(k * (r - 1)) / (float)r;
+			int a = (int)p;
+			float w = p - (float)a;
+			float horizon = prev[a] + w * (prev[a + 1] - prev[a]);
+
+			float dx = (float)(r * o->mx) * sx + (float)k * (o->nx * sx);
+			float dy = (float)(r * o->my) * sy + (float)k * (o->ny * sy);
+			float d2 = dx * dx + dy * dy;
+			float invD = 1.0f / sqrtf(d2);
+			float el = c->elev[(size_t)y * c->W + x] - d2 * invTwoR - c->h1;
+			float slope = el * invD;
+
+			if ((el + c->targetAltitude) * invD > horizon)
+				vis[(size_t)y * c->wordsPerRow + x / 32] |= 1u << (x % 32);
+			cur[k] = slope > horizon ? slope : horizon;
+		}
+
+		cur[kmax + 1] = cur[kmax];
+		float* t = prev;
+		prev = cur;
+		cur = t;
+	}
+}